@@ -0,0 +1,502 @@
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#ifndef CSTAG_PATH
+#define CSTAG_PATH                      "cstag"
+#endif
+
+#define BENCH_FILES                     200
+#define BENCH_TAGS                      40
+#define BENCH_NAMES                     2000
+#define BENCH_RUNS                      5
+#define BENCH_SEED                      1
+#define BENCH_ZIPF                      1.0
+// 每个目录下的文件数
+#define BENCH_FANOUT                    50
+// 每个测试的最大运行次数
+#define BENCH_MAXRUNS                   100
+#define BUFSIZE                         (PATH_MAX + 16)
+
+#define echoerr(args...)                fprintf(stderr, PROGRAM_NAME ": " args)
+
+#define PROGRAM_NAME                    "cstag_bench"
+#define PROGRAM_USAGE                   "\
+Usage:\n\
+  " PROGRAM_NAME " [OPTION]\n\
+\n\
+Generate a synthetic source tree, then time full builds, no-op updates,\n\
+every query opcode and every output format of cstag, and print the results\n\
+as JSON.\n\
+\n\
+Option:\n\
+  -b FILE          the cstag executable, default is " CSTAG_PATH ".\n\
+  -w DIR           the work directory, which is kept after the run, default\n\
+                   is a new temporary directory, removed at exit unless -k\n\
+                   is given.\n\
+  -n N             number of generated files, default is 200.\n\
+  -t N             tags per file, default is 40.\n\
+  -s N             number of distinct symbol names, default is 2000.\n\
+  -z S             zipf exponent of the name distribution, 0 means uniform,\n\
+                   default is 1.0.\n\
+  -S N             random seed, default is 1.\n\
+  -r N             runs of each benchmark, default is 5.\n\
+  -j N             pass -j N to cstag when building.\n\
+  -o FILE          write the JSON to the file instead of stdout.\n\
+  -k               keep the work directory.\n\
+  -h               print help message.\n\
+\n\
+Environment:\n\
+  CTAGSPATH        passed through to cstag.\n\
+"
+
+/**
+ * 合成语料的参数
+ */
+struct corpus {
+    int files;
+    int tags;
+    int names;
+    double zipf;
+    uint64_t seed;
+    uint64_t bytes;
+    double *weights;
+};
+
+/**
+ * 一项测试的结果，时间单位为毫秒
+ */
+struct result {
+    const char *name;
+    char args[BUFSIZE];
+    int runs;
+    int status;
+    double min;
+    double median;
+    double mean;
+};
+
+/**
+ * 伪随机数，xorshift64*
+ * @param state 随机数状态
+ * @return      下一个随机数
+ */
+static uint64_t nextrand(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * 按名称分布取一个名称下标，zipf为0时均匀分布，否则按累积权重二分查找
+ * @param corpus 语料参数
+ * @param state  随机数状态
+ * @return       名称下标
+ */
+static int pickname(const struct corpus *corpus, uint64_t *state)
+{
+    int lo = 0, hi = corpus->names - 1, mid;
+    double val;
+
+    if (!corpus->weights)
+        return (int) (nextrand(state) % corpus->names);
+
+    val = (nextrand(state) >> 11) * (1.0 / 9007199254740992.0) * corpus->weights[corpus->names - 1];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (corpus->weights[mid] < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * 生成合成语料，每个文件包含若干函数，每个函数产生一个定义、两个调用、一个赋值和一个字符串
+ * 文件按BENCH_FANOUT个一组放在子目录中
+ * @param corpus 语料参数，生成后记录总字节数
+ * @param root   语料根目录
+ * @return       生成成功返回0，否则返回非0
+ */
+static int gencorpus(struct corpus *corpus, const char *root)
+{
+    FILE *fp;
+    int idx, tag, name;
+    uint64_t state = corpus->seed ? corpus->seed : BENCH_SEED;
+    char path[BUFSIZE];
+
+    if (corpus->zipf > 0) {
+        if (!(corpus->weights = (double *) malloc(corpus->names * sizeof(double))))
+            return -1;
+        for (idx = 0; idx < corpus->names; idx++)
+            corpus->weights[idx] = (idx ? corpus->weights[idx - 1] : 0) + 1.0 / pow(idx + 1, corpus->zipf);
+    }
+
+    if (mkdir(root, 0755) != 0)
+        return -1;
+
+    for (corpus->bytes = 0, idx = 0; idx < corpus->files; idx++) {
+        snprintf(path, sizeof(path), "%s/d%03d", root, idx / BENCH_FANOUT);
+        if (idx % BENCH_FANOUT == 0 && mkdir(path, 0755) != 0)
+            return -1;
+
+        snprintf(path, sizeof(path), "%s/d%03d/f%05d.c", root, idx / BENCH_FANOUT, idx);
+        if (!(fp = fopen(path, "w")))
+            return -1;
+
+        fprintf(fp, "#include <stdio.h>\n#include \"d%03d.h\"\n\nint g_%d;\n\n", idx / BENCH_FANOUT, idx);
+        for (tag = 0; tag < corpus->tags; tag += 5) {
+            name = pickname(corpus, &state);
+            fprintf(fp,
+                    "int sym_%d(int a)\n"
+                    "{\n"
+                    "    sym_%d(a);\n"
+                    "    sym_%d(a + 1);\n"
+                    "    g_%d = a;\n"
+                    "    puts(\"text %d\");\n"
+                    "    return a;\n"
+                    "}\n\n",
+                    name, pickname(corpus, &state), pickname(corpus, &state), idx, name);
+        }
+
+        corpus->bytes += ftell(fp);
+        if (fclose(fp) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 递归删除目录
+ * @param path 目录路径
+ */
+static void removedir(const char *path)
+{
+    pid_t pid;
+    int status;
+
+    if ((pid = fork()) == 0) {
+        execlp("rm", "rm", "-rf", path, (char *) NULL);
+        _exit(127);
+    }
+
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+}
+
+/**
+ * 毫秒级单调时钟
+ * @return 毫秒数
+ */
+static double monotime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * 在指定目录下运行命令，丢弃标准输出和标准错误
+ * @param dir  工作目录
+ * @param argv 命令参数
+ * @return     命令的退出码，无法运行返回-1
+ */
+static int runcmd(const char *dir, char *const argv[])
+{
+    int fd, status;
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        if (chdir(dir) == 0)
+            execv(argv[0], argv);
+        _exit(127);
+    }
+
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return -1;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * 比较两个时间，用于排序
+ */
+static int cmptime(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * 多次运行命令并统计耗时
+ * @param res   测试结果
+ * @param name  测试名称
+ * @param dir   工作目录
+ * @param runs  运行次数
+ * @param reset 每次运行前删除的文件，NULL表示不删除
+ * @param argv  命令参数
+ */
+static void bench(struct result *res, const char *name, const char *dir, int runs, const char *reset,
+                  char *const argv[])
+{
+    int idx, len = 0;
+    double start, times[BENCH_MAXRUNS], sum = 0;
+
+    res->name = name;
+    res->runs = runs = runs < BENCH_MAXRUNS ? runs : BENCH_MAXRUNS;
+    res->status = 0;
+
+    // 记录参数，不含cstag路径
+    res->args[0] = '\0';
+    for (idx = 1; argv[idx] && len < (int) sizeof(res->args); idx++)
+        len += snprintf(res->args + len, sizeof(res->args) - len, "%s%s", idx > 1 ? " " : "", argv[idx]);
+
+    for (idx = 0; idx < runs; idx++) {
+        if (reset)
+            unlink(reset);
+        start = monotime();
+        if ((res->status = runcmd(dir, argv)) != 0)
+            runs = idx + 1;
+        times[idx] = monotime() - start;
+        sum += times[idx];
+    }
+
+    res->runs = runs;
+    qsort(times, runs, sizeof(times[0]), cmptime);
+    res->min = times[0];
+    res->median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    res->mean = sum / runs;
+}
+
+/**
+ * 输出JSON字符串，转义引号、反斜杠和控制字符
+ * @param fp   文件句柄
+ * @param text 字符串
+ */
+static void echojson(FILE *fp, const char *text)
+{
+    fputc('"', fp);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\')
+            fprintf(fp, "\\%c", *text);
+        else if ((unsigned char) *text < 0x20)
+            fprintf(fp, "\\u%04x", *text);
+        else
+            fputc(*text, fp);
+    }
+    fputc('"', fp);
+}
+
+/**
+ * 输出全部结果
+ * @param fp      文件句柄
+ * @param cstag   cstag路径
+ * @param corpus  语料参数
+ * @param runs    每项测试的运行次数
+ * @param dbsize  完整构建后的数据库字节数
+ * @param results 测试结果
+ * @param count   测试结果数
+ */
+static void echoresults(FILE *fp, const char *cstag, const struct corpus *corpus, int runs, long long dbsize,
+                        const struct result results[], int count)
+{
+    fprintf(fp, "{\n  \"cstag\": ");
+    echojson(fp, cstag);
+    fprintf(fp, ",\n  \"corpus\": {\"files\": %d, \"tags_per_file\": %d, \"names\": %d, "
+                "\"distribution\": \"%s\", \"zipf\": %g, \"seed\": %llu, \"bytes\": %llu},\n",
+            corpus->files, corpus->tags, corpus->names, corpus->zipf > 0 ? "zipf" : "uniform", corpus->zipf,
+            (unsigned long long) corpus->seed, (unsigned long long) corpus->bytes);
+    fprintf(fp, "  \"runs\": %d,\n  \"db_bytes\": %lld,\n  \"results\": [\n", runs, dbsize);
+    for (int idx = 0; idx < count; idx++) {
+        fprintf(fp, "    {\"name\": ");
+        echojson(fp, results[idx].name);
+        fprintf(fp, ", \"args\": ");
+        echojson(fp, results[idx].args);
+        fprintf(fp, ", \"runs\": %d, \"status\": %d, \"min_ms\": %.3f, \"median_ms\": %.3f, \"mean_ms\": %.3f}%s\n",
+                results[idx].runs, results[idx].status, results[idx].min, results[idx].median, results[idx].mean,
+                idx + 1 < count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char *const argv[])
+{
+    int tmp, count = 0, runs = BENCH_RUNS, keep = 0, failed = 0;
+    char *jobs = NULL;
+    char *work = NULL;
+    char *output = NULL;
+    char cstag[BUFSIZE] = CSTAG_PATH;
+    char root[BUFSIZE], dbpath[BUFSIZE], snap[BUFSIZE], snaparg[BUFSIZE + 16];
+    char tmpdir[] = "/tmp/cstag_bench.XXXXXX";
+    char hot[32], one[32], func[32], text[32], assign[32];
+    struct corpus corpus = {.files = BENCH_FILES, .tags = BENCH_TAGS, .names = BENCH_NAMES,
+                            .zipf = BENCH_ZIPF, .seed = BENCH_SEED};
+    struct result results[32];
+    struct stat info;
+    FILE *fp = stdout;
+
+    while ((tmp = getopt(argc, argv, "b:w:n:t:s:z:S:r:j:o:kh")) != -1) {
+        switch (tmp) {
+            case 'b':
+                if (!realpath(optarg, cstag)) {
+                    echoerr("cstag '%s' doesn't exist.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                work = optarg;
+                break;
+            case 'n':
+                corpus.files = (tmp = atoi(optarg)) > 0 ? tmp : BENCH_FILES;
+                break;
+            case 't':
+                corpus.tags = (tmp = atoi(optarg)) > 0 ? tmp : BENCH_TAGS;
+                break;
+            case 's':
+                corpus.names = (tmp = atoi(optarg)) > 0 ? tmp : BENCH_NAMES;
+                break;
+            case 'z':
+                corpus.zipf = atof(optarg) > 0 ? atof(optarg) : 0;
+                break;
+            case 'S':
+                corpus.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                runs = (tmp = atoi(optarg)) > 0 ? tmp : BENCH_RUNS;
+                break;
+            case 'j':
+                jobs = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            case 'h':
+                fprintf(stdout, PROGRAM_USAGE);
+                return 0;
+            default:
+                fprintf(stderr, PROGRAM_USAGE);
+                return 1;
+        }
+    }
+
+    if (!work && !(work = mkdtemp(tmpdir))) {
+        echoerr("create work directory failed.\n");
+        return 1;
+    }
+
+    snprintf(root, sizeof(root), "%s/src", work);
+    snprintf(dbpath, sizeof(dbpath), "%s/tag.db", work);
+    snprintf(snap, sizeof(snap), "%s/tag.snap", work);
+    snprintf(snaparg, sizeof(snaparg), "--snapshot=%s", snap);
+
+    if ((stat(work, &info) != 0 && mkdir(work, 0755) != 0) || gencorpus(&corpus, root) != 0) {
+        echoerr("generate corpus in '%s' failed.\n", work);
+        free(corpus.weights);
+        return 1;
+    }
+
+    // 最常见的名称、只出现少数几次的名称、函数名、字符串和赋值的变量
+    snprintf(hot, sizeof(hot), "sym_0");
+    snprintf(one, sizeof(one), "sym_%d", corpus.names - 1);
+    snprintf(func, sizeof(func), "sym_1");
+    snprintf(text, sizeof(text), "text 0");
+    snprintf(assign, sizeof(assign), "g_0");
+
+    {
+        char *build[] = {cstag, "-f", dbpath, "-P", root, "-R", ".", NULL, NULL, NULL};
+        char *update[] = {cstag, "-f", dbpath, "-P", root, "-R", "-u", ".", NULL};
+        char *export[] = {cstag, "-f", dbpath, "-P", root, "-d", "--export-snapshot", snap, NULL};
+
+        if (jobs) {
+            build[6] = "-j";
+            build[7] = jobs;
+            build[8] = ".";
+        }
+
+        // 每次构建前删除数据库，都是完整构建
+        bench(&results[count++], "build", root, runs, dbpath, build);
+        failed = results[count - 1].status;
+        bench(&results[count++], "update_noop", root, runs, NULL, update);
+        bench(&results[count++], "export_snapshot", root, runs, NULL, export);
+    }
+
+    {
+        // 查询均带-d，不检查文件，只测查询和输出本身
+        const struct {
+            const char *name;
+            const char *args[3];
+        } queries[] = {
+                {"query_0_symbol",      {"-0", hot}},
+                {"query_0_symbol_rare", {"-0", one}},
+                {"query_1_define",      {"-1", hot}},
+                {"query_2_caller",      {"-2", func}},
+                {"query_3_refer",       {"-3", hot}},
+                {"query_4_string",      {"-4", text}},
+                {"query_5_regex",       {"-5", "-0", "^sym_1"}},
+                {"query_6_egrep",       {"-6", "sym_1[0-9]+"}},
+                {"query_7_file",        {"-7", "*f0000*"}},
+                {"query_8_include",     {"-8", "stdio.h"}},
+                {"query_9_assign",      {"-9", assign}},
+                {"query_e_pattern",     {"-e", "puts(.text 1"}},
+                {"query_E_pattern",     {"-E", "sym_(1|2)\\("}},
+                {"query_callers",       {"--callers", func}},
+                {"query_callees",       {"--callees", func}},
+                {"snapshot_0_symbol",   {snaparg, "-0", hot}},
+                {"snapshot_1_define",   {snaparg, "-1", hot}},
+                {"snapshot_3_refer",    {snaparg, "-3", hot}},
+                // 所有tags都匹配，测试输出格式的吞吐
+                {"format_s_cscope",     {"-5", "-0.", "-s"}},
+                {"format_c_ctags",      {"-5", "-0.", "-c"}},
+                {"format_x_xref",       {"-5", "-0.", "-x"}},
+                {"format_g_grep",       {"-5", "-0.", "-g"}},
+                {"format_X_xml",        {"-5", "-0.", "-X"}},
+        };
+
+        for (tmp = 0; tmp < (int) (sizeof(queries) / sizeof(queries[0])); tmp++) {
+            char *query[] = {cstag, "-f", dbpath, "-P", root, "-d", NULL, NULL, NULL, NULL};
+            memcpy(query + 6, queries[tmp].args, sizeof(queries[tmp].args));
+            bench(&results[count++], queries[tmp].name, root, runs, NULL, query);
+        }
+    }
+
+    if (output && !(fp = fopen(output, "w"))) {
+        echoerr("open '%s' failed.\n", output);
+        fp = stdout;
+    }
+
+    echoresults(fp, cstag, &corpus, runs, stat(dbpath, &info) == 0 ? (long long) info.st_size : -1, results, count);
+
+    if (fp != stdout)
+        fclose(fp);
+
+    if (!keep && work == tmpdir)
+        removedir(work);
+
+    free(corpus.weights);
+
+    return failed ? 1 : 0;
+}
\ No newline at end of file
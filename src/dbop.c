@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <regex.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,48 +10,164 @@
 #include "path.h"
 #include "dbop.h"
 
-#define SQL_INIT                "\
-PRAGMA foreign_keys = ON;\n\
-PRAGMA synchronous = OFF;\n\
-CREATE TABLE IF NOT EXISTS file (\n\
-    id INTEGER PRIMARY KEY,\n\
-    " FIELD_STR_PATH " TEXT UNIQUE NOT NULL,\n\
-    size INTEGER DEFAULT 0,\n\
-    time INTEGER DEFAULT 0\n\
-);\n\
-CREATE TABLE IF NOT EXISTS tag (\n\
+// tag表的结构，kind等取值较少的列保存为dict表中的id，pattern和compact保存在code表中，由(fid, cid)引用，
+// func为包含此tag的最内层函数的起始行，不在函数中时为0
+#define SQL_TAGTABLE(name)      "\
+CREATE TABLE IF NOT EXISTS " name " (\n\
     fid INTEGER NOT NULL,\n\
     " FIELD_STR_MARK " TEXT NOT NULL,\n\
     " FIELD_STR_NAME " TEXT NOT NULL,\n\
-    " FIELD_STR_PATTERN " TEXT NOT NULL,\n\
-    " FIELD_STR_COMPACT " TEXT NOT NULL,\n\
+    cid INTEGER NOT NULL,\n\
     " FIELD_STR_LINE " INTEGER NOT NULL,\n\
     " FIELD_STR_ENDL " INTEGER DEFAULT 0,\n\
-    " FIELD_STR_LANG " TEXT,\n\
-    " FIELD_STR_ROLE " TEXT,\n\
-    " FIELD_STR_KIND " TEXT,\n\
+    " FIELD_STR_LANG " INTEGER,\n\
+    " FIELD_STR_ROLE " INTEGER,\n\
+    " FIELD_STR_KIND " INTEGER,\n\
     " FIELD_STR_TYPE " TEXT,\n\
     " FIELD_STR_SIGN " TEXT,\n\
-    " FIELD_STR_ACCESS " TEXT,\n\
+    " FIELD_STR_ACCESS " INTEGER,\n\
     " FIELD_STR_INHERIT " TEXT,\n\
     " FIELD_STR_IMPL " TEXT,\n\
-    " FIELD_STR_KSCOPE " TEXT,\n\
+    " FIELD_STR_KSCOPE " INTEGER,\n\
     " FIELD_STR_NSCOPE " TEXT,\n\
-    " FIELD_STR_EXTRAS " TEXT,\n\
+    " FIELD_STR_EXTRAS " INTEGER,\n\
+    func INTEGER DEFAULT 0,\n\
+    FOREIGN KEY(fid) REFERENCES file(id) ON UPDATE CASCADE ON DELETE CASCADE\n\
+);\n"
+#define SQL_TAGINDEX            "\
+CREATE INDEX IF NOT EXISTS tag_name ON tag (" FIELD_STR_NAME ", " FIELD_STR_MARK ");\n\
+CREATE INDEX IF NOT EXISTS tag_kind ON tag (" FIELD_STR_KIND ");\n\
+CREATE INDEX IF NOT EXISTS tag_fid ON tag (fid, " FIELD_STR_LINE ");\n"
+
+#define SQL_TABLES              "\
+CREATE TABLE IF NOT EXISTS file (\n\
+    id INTEGER PRIMARY KEY,\n\
+    " FIELD_STR_PATH " TEXT UNIQUE NOT NULL,\n\
+    size INTEGER DEFAULT 0,\n\
+    time INTEGER DEFAULT 0,\n\
+    hash INTEGER DEFAULT 0\n\
+);\n\
+CREATE TABLE IF NOT EXISTS dict (\n\
+    id INTEGER PRIMARY KEY,\n\
+    text TEXT UNIQUE NOT NULL\n\
+);\n\
+CREATE TABLE IF NOT EXISTS code (\n\
+    fid INTEGER NOT NULL,\n\
+    id INTEGER NOT NULL,\n\
+    " FIELD_STR_PATTERN " TEXT NOT NULL,\n\
+    " FIELD_STR_COMPACT " TEXT NOT NULL,\n\
+    PRIMARY KEY(fid, id),\n\
+    FOREIGN KEY(fid) REFERENCES file(id) ON UPDATE CASCADE ON DELETE CASCADE\n\
+) WITHOUT ROWID;\n" SQL_TAGTABLE("tag") "\
+CREATE TABLE IF NOT EXISTS gram (\n\
+    gram INTEGER NOT NULL,\n\
+    fid INTEGER NOT NULL,\n\
+    PRIMARY KEY(gram, fid),\n\
     FOREIGN KEY(fid) REFERENCES file(id) ON UPDATE CASCADE ON DELETE CASCADE\n\
-);\
-"
+) WITHOUT ROWID;\n"
+#define SQL_INDEXES             SQL_TAGINDEX "CREATE INDEX IF NOT EXISTS gram_fid ON gram (fid);\n"
+
+#define SQL_INIT                "\
+PRAGMA foreign_keys = ON;\n\
+PRAGMA synchronous = OFF;\n" SQL_TABLES SQL_INDEXES
+
+// 批量导入到新建的临时数据库：不检查外键，独占锁，回滚日志只保存在内存中，页缓存256MB，
+// 除唯一约束外的索引都在导入结束时由dbindex一次建立
+#define SQL_BULKINIT            "\
+PRAGMA foreign_keys = OFF;\n\
+PRAGMA synchronous = OFF;\n\
+PRAGMA locking_mode = EXCLUSIVE;\n\
+PRAGMA journal_mode = MEMORY;\n\
+PRAGMA cache_size = -262144;\n" SQL_TABLES
+
+// 数据库格式版本，保存在user_version中
+#define DB_VERSION              5
+// 只读连接等待写入事务结束的毫秒数
+#define DB_TIMEOUT              5000
+
+// 大小写不敏感的文件系统上路径按NOCASE比较（仅折叠ASCII字母），由file_path_nocase索引支持
+#define SQL_NOCASE              "CREATE UNIQUE INDEX IF NOT EXISTS file_path_nocase ON file (" FIELD_STR_PATH " COLLATE NOCASE);"
+#define SQL_PATHCMP(cmp)        FIELD_STR_PATH " = ?" cmp
 
 #define SQL_ALLFILE             "SELECT id, ABSPATH(" FIELD_STR_PATH "), size, time FROM file;"
-#define SQL_GETFILE             "SELECT id, size, time FROM file WHERE " FIELD_STR_PATH " MATCH RELPATH(?) LIMIT 1;"
-#define SQL_SETFILE             "INSERT OR REPLACE INTO file (" FIELD_STR_PATH ", size, time) VALUES (RELPATH(?), ?, ?);"
-#define SQL_DELFILE             "DELETE FROM file WHERE " FIELD_STR_PATH " MATCH RELPATH(?);"
+#define SQL_GETFILE(cmp)        "SELECT id, size, time, hash FROM file WHERE " SQL_PATHCMP(cmp) " LIMIT 1;"
+// 已有的文件只更新属性，保留file.id，其tag由dbaddatag与原有的行比较后增删改
+#define SQL_SETFILE             "INSERT INTO file (" FIELD_STR_PATH ", size, time, hash) VALUES (?, ?, ?, ?);"
+#define SQL_UPDFILE             "UPDATE file SET " FIELD_STR_PATH " = ?, size = ?, time = ?, hash = ? WHERE id = ?;"
+// 列的顺序须与sigcols一致；按行号倒序读取，链表头插后同键的行按行号升序
+#define SQL_OLDTAGS             "SELECT rowid, " FIELD_STR_MARK ", " FIELD_STR_NAME ", " FIELD_STR_KIND ", cid, \
+" FIELD_STR_LINE ", " FIELD_STR_ENDL ", " FIELD_STR_LANG ", " FIELD_STR_ROLE ", " FIELD_STR_TYPE ", " FIELD_STR_SIGN ", \
+" FIELD_STR_ACCESS ", " FIELD_STR_INHERIT ", " FIELD_STR_IMPL ", " FIELD_STR_KSCOPE ", " FIELD_STR_NSCOPE ", \
+" FIELD_STR_EXTRAS ", func FROM tag WHERE fid = ? ORDER BY " FIELD_STR_LINE " DESC;"
+#define SQL_OLDCODES            "SELECT id, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT " FROM code WHERE fid = ?;"
+#define SQL_OLDGRAMS            "SELECT gram FROM gram WHERE fid = ?;"
+#define SQL_DELTAG              "DELETE FROM tag WHERE rowid = ?;"
+#define SQL_DELCODE             "DELETE FROM code WHERE fid = ? AND id = ?;"
+#define SQL_DELGRAM             "DELETE FROM gram WHERE gram = ? AND fid = ?;"
+#define SQL_SETTIME             "UPDATE file SET time = ? WHERE id = ?;"
+#define SQL_HASCOL              "SELECT hash FROM file LIMIT 0;"
+#define SQL_ADDCOL              "ALTER TABLE file ADD COLUMN hash INTEGER DEFAULT 0;"
+#define SQL_HASFUNC             "SELECT func FROM tag LIMIT 0;"
+#define SQL_ADDFUNC             "ALTER TABLE tag ADD COLUMN func INTEGER DEFAULT 0;"
+// func列可能由addcolumn添加，其索引不能放在SQL_INIT中
+#define SQL_FUNCINDEX           "CREATE INDEX IF NOT EXISTS tag_func ON tag (fid, func);"
+#define SQL_FKCHECK             "PRAGMA foreign_key_check;"
+// 版本5之前没有func列，升级时按同一文件中函数的行范围求出
+#define SQL_SETFUNC             "UPDATE tag SET func = ifnull((SELECT max(f." FIELD_STR_LINE ") FROM tag AS f \
+WHERE f.fid = tag.fid AND f." FIELD_STR_KIND " = " SQL_WORD("function") " AND \
+tag." FIELD_STR_LINE " BETWEEN f." FIELD_STR_LINE " AND f." FIELD_STR_ENDL "), 0);"
+#define SQL_DELFILE(cmp)        "DELETE FROM file WHERE " SQL_PATHCMP(cmp) ";"
+#define SQL_DELDIR              "DELETE FROM file WHERE " FIELD_STR_PATH " > ? AND " FIELD_STR_PATH " < ?;"
+#define SQL_GONE                "CREATE TEMP TABLE IF NOT EXISTS gone (id INTEGER PRIMARY KEY); DELETE FROM temp.gone;"
+#define SQL_ADDGONE             "INSERT OR IGNORE INTO temp.gone (id) VALUES (?);"
+#define SQL_DELGONE             "DELETE FROM file WHERE id IN (SELECT id FROM temp.gone);"
+#define SQL_ADDGRAM             "INSERT OR IGNORE INTO gram (gram, fid) VALUES (?, ?);"
+#define SQL_GETDICT             "SELECT text FROM dict WHERE id = ?;"
+#define SQL_FINDDICT            "SELECT id FROM dict WHERE text = ?;"
+#define SQL_ADDDICT             "INSERT INTO dict (text) VALUES (?);"
+#define SQL_WORD(w)             "(SELECT id FROM dict WHERE text = '" w "')"
+#define SQL_GETCODE             "SELECT " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT " FROM code WHERE fid = ? AND id = ?;"
+#define SQL_LASTCODE            "SELECT ifnull(max(id), 0) FROM code WHERE fid = ?;"
+#define SQL_ADDCODE             "INSERT INTO code (fid, id, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT ") VALUES (?, ?, ?, ?);"
+#define SQL_JOINCODE            "INNER JOIN code ON code.fid = tag.fid AND code.id = tag.cid "
+// 用户条件中的fid和id须仍指tag.fid和file.id，code表只提供pattern和compact两列
+#define SQL_JOINTEXT            "INNER JOIN (SELECT fid AS codefid, id AS codeid, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT " FROM code) \
+ON codefid = tag.fid AND codeid = tag.cid "
+// 用户条件所用的tag表：dict列换回文本，pattern和compact取自code表，列名与dict表引入前相同
+#define SQL_DICTTEXT(col)       "(SELECT text FROM dict WHERE id = tag." col ") AS " col
+#define SQL_TAGTEXT             "(SELECT tag.fid AS fid, " FIELD_STR_MARK ", " FIELD_STR_NAME ", cid, \
+" FIELD_STR_PATTERN ", " FIELD_STR_COMPACT ", " FIELD_STR_LINE ", " FIELD_STR_ENDL ", " SQL_DICTTEXT(FIELD_STR_LANG) ", \
+" SQL_DICTTEXT(FIELD_STR_ROLE) ", " SQL_DICTTEXT(FIELD_STR_KIND) ", " FIELD_STR_TYPE ", " FIELD_STR_SIGN ", \
+" SQL_DICTTEXT(FIELD_STR_ACCESS) ", " FIELD_STR_INHERIT ", " FIELD_STR_IMPL ", " SQL_DICTTEXT(FIELD_STR_KSCOPE) ", \
+" FIELD_STR_NSCOPE ", " SQL_DICTTEXT(FIELD_STR_EXTRAS) ", func FROM tag " SQL_JOINTEXT ") AS tag"
+#define SQL_HASCID              "SELECT cid FROM tag LIMIT 0;"
+// 版本3之前dict列保存文本，版本4之前pattern和compact保存在tag表中，升级时换成id后重建tag表
+#define SQL_TODICT(col)         "INSERT OR IGNORE INTO dict (text) SELECT DISTINCT " col " FROM tag WHERE typeof(" col ") = 'text';"
+#define SQL_DICTCOL(col)        "CASE typeof(" col ") WHEN 'text' THEN (SELECT id FROM dict WHERE text = " col ") ELSE " col " END"
+#define SQL_TOCODE              "\
+CREATE TEMP TABLE lines (id INTEGER PRIMARY KEY, fid, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT ");\
+INSERT INTO temp.lines (fid, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT ") \
+SELECT DISTINCT fid, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT " FROM tag;\
+CREATE INDEX temp.lines_key ON lines (fid, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT ");\
+INSERT INTO code SELECT fid, id, " FIELD_STR_PATTERN ", " FIELD_STR_COMPACT " FROM temp.lines;"
+#define SQL_CODECOL             "(SELECT id FROM temp.lines AS l WHERE l.fid = tag.fid AND \
+l." FIELD_STR_PATTERN " = tag." FIELD_STR_PATTERN " AND l." FIELD_STR_COMPACT " = tag." FIELD_STR_COMPACT ")"
+#define SQL_RETAG               \
+    SQL_TODICT(FIELD_STR_LANG) SQL_TODICT(FIELD_STR_ROLE) SQL_TODICT(FIELD_STR_KIND) \
+    SQL_TODICT(FIELD_STR_ACCESS) SQL_TODICT(FIELD_STR_KSCOPE) SQL_TODICT(FIELD_STR_EXTRAS) SQL_TOCODE \
+    SQL_TAGTABLE("tag_code") "INSERT INTO tag_code SELECT fid, " FIELD_STR_MARK ", " FIELD_STR_NAME ", " \
+    SQL_CODECOL ", " FIELD_STR_LINE ", " FIELD_STR_ENDL ", " \
+    SQL_DICTCOL(FIELD_STR_LANG) ", " SQL_DICTCOL(FIELD_STR_ROLE) ", " SQL_DICTCOL(FIELD_STR_KIND) ", " \
+    FIELD_STR_TYPE ", " FIELD_STR_SIGN ", " SQL_DICTCOL(FIELD_STR_ACCESS) ", " FIELD_STR_INHERIT ", " \
+    FIELD_STR_IMPL ", " SQL_DICTCOL(FIELD_STR_KSCOPE) ", " FIELD_STR_NSCOPE ", " SQL_DICTCOL(FIELD_STR_EXTRAS) \
+    ", 0 FROM tag; DROP TABLE tag; DROP TABLE temp.lines; ALTER TABLE tag_code RENAME TO tag;" SQL_TAGINDEX
+#define SQL_ALLGRAM             "SELECT tag.fid, " FIELD_STR_NAME ", " FIELD_STR_COMPACT " FROM tag " SQL_JOINCODE "ORDER BY tag.fid;"
+#define SQL_GRAMFID             "SELECT fid FROM gram WHERE gram = %u"
 #define SQL_ADDTAGS             "INSERT INTO tag VALUES (\
     $fid,\
     $" FIELD_STR_MARK ",\
     $" FIELD_STR_NAME ",\
-    $" FIELD_STR_PATTERN ",\
-    $" FIELD_STR_COMPACT ",\
+    $cid,\
     $" FIELD_STR_LINE ",\
     $" FIELD_STR_ENDL ",\
     $" FIELD_STR_LANG ",\
@@ -63,15 +180,46 @@ CREATE TABLE IF NOT EXISTS tag (\n\
     $" FIELD_STR_IMPL ",\
     $" FIELD_STR_KSCOPE ",\
     $" FIELD_STR_NSCOPE ",\
-    $" FIELD_STR_EXTRAS "\
+    $" FIELD_STR_EXTRAS ",\
+    $func\
 );"
-
-#define SQL_QUERYTAG            "SELECT \
-ABSPATH(" FIELD_STR_PATH "), \
+// 参数的顺序与SQL_ADDTAGS一致，两条语句共用参数位置
+#define SQL_UPDTAGS             "UPDATE tag SET \
+    fid = $fid,\
+    " FIELD_STR_MARK " = $" FIELD_STR_MARK ",\
+    " FIELD_STR_NAME " = $" FIELD_STR_NAME ",\
+    cid = $cid,\
+    " FIELD_STR_LINE " = $" FIELD_STR_LINE ",\
+    " FIELD_STR_ENDL " = $" FIELD_STR_ENDL ",\
+    " FIELD_STR_LANG " = $" FIELD_STR_LANG ",\
+    " FIELD_STR_ROLE " = $" FIELD_STR_ROLE ",\
+    " FIELD_STR_KIND " = $" FIELD_STR_KIND ",\
+    " FIELD_STR_TYPE " = $" FIELD_STR_TYPE ",\
+    " FIELD_STR_SIGN " = $" FIELD_STR_SIGN ",\
+    " FIELD_STR_ACCESS " = $" FIELD_STR_ACCESS ",\
+    " FIELD_STR_INHERIT " = $" FIELD_STR_INHERIT ",\
+    " FIELD_STR_IMPL " = $" FIELD_STR_IMPL ",\
+    " FIELD_STR_KSCOPE " = $" FIELD_STR_KSCOPE ",\
+    " FIELD_STR_NSCOPE " = $" FIELD_STR_NSCOPE ",\
+    " FIELD_STR_EXTRAS " = $" FIELD_STR_EXTRAS ",\
+    func = $func \
+WHERE rowid = $rowid;"
+
+// 比较新旧tag时cid和func在列数组中的位置，排在FIELD_IDX_*之后
+#define TAGCOL_CID              FIELD_MAX
+#define TAGCOL_FUNC             (FIELD_MAX + 1)
+#define TAGCOL_MAX              (FIELD_MAX + 2)
+// 签名的前SIG_KEYS列为比较的键，键相同而其他列不同时更新原有的行
+#define SIG_KEYS                4
+
+// 路径列为file表中的键，由游标通过pathcache转换为显示路径，dict列由游标转换为文本，
+// pattern和compact两列均为cid，输出时才由游标读取code表，最后一列为file.id
+#define SQL_QUERYFROM(from)     "SELECT \
+" FIELD_STR_PATH ", \
 " FIELD_STR_MARK ", \
 " FIELD_STR_NAME ", \
-" FIELD_STR_PATTERN ", \
-" FIELD_STR_COMPACT ", \
+cid, \
+cid, \
 " FIELD_STR_LINE ", \
 " FIELD_STR_ENDL ", \
 " FIELD_STR_LANG ", \
@@ -84,20 +232,55 @@ ABSPATH(" FIELD_STR_PATH "), \
 " FIELD_STR_IMPL ", \
 " FIELD_STR_KSCOPE ", \
 " FIELD_STR_NSCOPE ", \
-" FIELD_STR_EXTRAS " \
-FROM tag INNER JOIN file ON tag.fid = file.id "
-
-#define SQL_TAGSORT             "ORDER BY " FIELD_STR_NAME "," FIELD_STR_LINE "," FIELD_STR_KIND " ASC;"
-#define SQL_SYMBOL              SQL_QUERYTAG "WHERE " FIELD_STR_NAME " REGEXP ? " SQL_TAGSORT
-#define SQL_DEFINE              SQL_QUERYTAG "WHERE " FIELD_STR_NAME " REGEXP ? AND " FIELD_STR_MARK " = 'D' " SQL_TAGSORT
-#define SQL_CALLER              SQL_QUERYTAG "INNER JOIN (SELECT fid," FIELD_STR_LINE " AS line1," FIELD_STR_ENDL " AS line2 FROM tag WHERE " FIELD_STR_NAME " REGEXP ? AND " FIELD_STR_KIND " = 'function') AS scope ON tag.fid = scope.fid WHERE " FIELD_STR_LINE " BETWEEN line1 AND line2 " SQL_TAGSORT
-#define SQL_REFER               SQL_QUERYTAG "WHERE " FIELD_STR_NAME " REGEXP ? AND " FIELD_STR_MARK " = 'R' " SQL_TAGSORT
-#define SQL_STRING              SQL_QUERYTAG "WHERE " FIELD_STR_NAME " REGEXP ? AND " FIELD_STR_KIND " = 'string' " SQL_TAGSORT
-#define SQL_PATTERN             SQL_QUERYTAG "WHERE " FIELD_STR_COMPACT " REGEXP ? " SQL_TAGSORT
+" FIELD_STR_EXTRAS ", \
+file.id \
+FROM " from " INNER JOIN file ON tag.fid = file.id "
+#define SQL_QUERYTAG            SQL_QUERYFROM("tag")
+
+// 名称条件：BYNAME逐行匹配，BYRANGE先用?2、?3在tag_name索引上确定范围，再逐行匹配范围内的tags
+#define SQL_BYNAME              FIELD_STR_NAME " REGEXP ?1"
+#define SQL_BYRANGE             FIELD_STR_NAME " BETWEEN ?2 AND ?3 AND " FIELD_STR_NAME " REGEXP ?1"
+// 正则条件：BYGRAM、BYTEXTGRAM先用gram表求出包含全部必需trigram的文件（%s处），再逐行匹配这些文件的tags
+#define SQL_BYGRAM              "fid IN (%s) AND " SQL_BYNAME
+#define SQL_BYTEXT              FIELD_STR_COMPACT " REGEXP ?1"
+#define SQL_BYTEXTGRAM          "tag.fid IN (%s) AND " SQL_BYTEXT
+
+#define SQL_TAGSORT             "ORDER BY " FIELD_STR_NAME "," FIELD_STR_LINE ",(SELECT text FROM dict WHERE id = " FIELD_STR_KIND ") ASC;"
+#define SQL_TEXTSORT            "ORDER BY " FIELD_STR_NAME "," FIELD_STR_LINE "," FIELD_STR_KIND " ASC;"
+#define SQL_SYMBOL(by)          SQL_QUERYTAG "WHERE " by " " SQL_TAGSORT
+#define SQL_DEFINE(by)          SQL_QUERYTAG "WHERE " by " AND " FIELD_STR_MARK " = 'D' " SQL_TAGSORT
+// 函数内的tag的func都在函数的行范围内（嵌套函数起始于外层函数之内），可以用tag_func索引按范围查找
+#define SQL_CALLER(by)          SQL_QUERYTAG "INNER JOIN (SELECT fid," FIELD_STR_LINE " AS line1," FIELD_STR_ENDL " AS line2 FROM tag WHERE " by " AND " FIELD_STR_KIND " = " SQL_WORD("function") ") AS scope ON tag.fid = scope.fid WHERE func BETWEEN line1 AND line2 " SQL_TAGSORT
+#define SQL_REFER(by)           SQL_QUERYTAG "WHERE " by " AND " FIELD_STR_MARK " = 'R' " SQL_TAGSORT
+#define SQL_STRING(by)          SQL_QUERYTAG "WHERE " by " AND " FIELD_STR_KIND " = " SQL_WORD("string") " " SQL_TAGSORT
+#define SQL_PATTERN(by)         SQL_QUERYTAG SQL_JOINCODE "WHERE " by " " SQL_TAGSORT
 #define SQL_INFILE              SQL_QUERYTAG "WHERE " FIELD_STR_PATH " MATCH ? " SQL_TAGSORT
-#define SQL_INCLUDE             SQL_QUERYTAG "WHERE " FIELD_STR_NAME " REGEXP ? AND " FIELD_STR_KIND " = 'header' " SQL_TAGSORT
-#define SQL_ASSIGN              SQL_QUERYTAG "WHERE " FIELD_STR_NAME " REGEXP ? AND " FIELD_STR_KIND " = 'variable' " SQL_TAGSORT
-#define SQL_FPATH               "SELECT ABSPATH(" FIELD_STR_PATH ") FROM file WHERE " FIELD_STR_PATH " MATCH ? ORDER BY " FIELD_STR_PATH " ASC;"
+#define SQL_INCLUDE(by)         SQL_QUERYTAG "WHERE " by " AND " FIELD_STR_KIND " = " SQL_WORD("header") " " SQL_TAGSORT
+#define SQL_ASSIGN(by)          SQL_QUERYTAG "WHERE " by " AND " FIELD_STR_KIND " = " SQL_WORD("variable") " " SQL_TAGSORT
+// 调用图：从名称匹配的函数出发，每步沿调用关系扩展一层，UNION去重，深度不超过?4，所以有环时也会结束；
+// 调用者为包含调用点的函数（由调用点的func找到其定义），被调用者为函数行范围内调用的函数；
+// 结果为扩展到的函数（不含出发的函数）的定义，按最小深度排序；
+// CROSS JOIN固定以graph为外层循环，kind前的'+'使其不用tag_kind索引，每步都走名称或文件的索引，
+// 起点只在名称逐行匹配时用tag_kind索引（hint为空）
+#define SQL_FUNC                SQL_WORD("function")
+#define SQL_CALLERS             "\
+SELECT f." FIELD_STR_NAME ", graph.depth + 1 FROM graph \
+CROSS JOIN tag AS r ON r." FIELD_STR_NAME " = graph." FIELD_STR_NAME " AND r." FIELD_STR_MARK " = 'R' \
+CROSS JOIN tag AS f ON f.fid = r.fid AND f." FIELD_STR_LINE " = r.func \
+WHERE graph.depth < ?4 AND +r." FIELD_STR_KIND " = " SQL_FUNC " AND r.func > 0 AND \
++f." FIELD_STR_KIND " = " SQL_FUNC " AND f." FIELD_STR_MARK " = 'D'"
+#define SQL_CALLEES             "\
+SELECT c." FIELD_STR_NAME ", graph.depth + 1 FROM graph \
+CROSS JOIN tag AS f ON f." FIELD_STR_NAME " = graph." FIELD_STR_NAME " AND f." FIELD_STR_MARK " = 'D' \
+CROSS JOIN tag AS c ON c.fid = f.fid AND c.func BETWEEN f." FIELD_STR_LINE " AND f." FIELD_STR_ENDL " \
+WHERE graph.depth < ?4 AND +f." FIELD_STR_KIND " = " SQL_FUNC " AND \
++c." FIELD_STR_KIND " = " SQL_FUNC " AND c." FIELD_STR_MARK " = 'R'"
+#define SQL_GRAPH(by, hint, step) "WITH RECURSIVE graph(" FIELD_STR_NAME ", depth) AS (\
+SELECT " FIELD_STR_NAME ", 0 FROM tag WHERE " by " AND " hint FIELD_STR_KIND " = " SQL_FUNC " UNION " step ") " \
+SQL_QUERYTAG "INNER JOIN (SELECT " FIELD_STR_NAME " AS node, min(depth) AS depth FROM graph GROUP BY " FIELD_STR_NAME ") AS reach \
+ON tag." FIELD_STR_NAME " = reach.node WHERE reach.depth > 0 AND +" FIELD_STR_KIND " = " SQL_FUNC " AND " FIELD_STR_MARK " = 'D' \
+ORDER BY reach.depth," FIELD_STR_NAME "," FIELD_STR_LINE ",(SELECT text FROM dict WHERE id = " FIELD_STR_KIND ") ASC;"
+#define SQL_FPATH               "SELECT " FIELD_STR_PATH ", id FROM file WHERE " FIELD_STR_PATH " MATCH ? ORDER BY " FIELD_STR_PATH " ASC;"
 
 enum {
     DBOP_ADDTAGS,
@@ -111,18 +294,221 @@ enum {
     QUERY_INCLUDE,
     QUERY_ASSIGN,
     QUERY_FPATH,
+    QUERY_CALLERS,
+    QUERY_CALLEES,
     DBOP_ALLFILE,
     DBOP_GETFILE,
     DBOP_SETFILE,
+    DBOP_UPDFILE,
+    DBOP_SETTIME,
     DBOP_DELFILE,
+    DBOP_DELDIR,
+    DBOP_ADDGRAM,
+    DBOP_GETDICT,
+    DBOP_FINDDICT,
+    DBOP_ADDDICT,
+    DBOP_GETCODE,
+    DBOP_LASTCODE,
+    DBOP_ADDCODE,
+    DBOP_UPDTAGS,
+    DBOP_OLDTAGS,
+    DBOP_OLDCODES,
+    DBOP_OLDGRAMS,
+    DBOP_DELTAG,
+    DBOP_DELCODE,
+    DBOP_DELGRAM,
     DBOP_COUNT
 };
 
+#define PATHCACHE_SIZE          4096
+
+// 一次查询最多使用的trigram数
+#define GRAM_MAX                16
+#define GRAM(p)                 ((uint32_t) tolower((unsigned char) (p)[0]) << 16 | \
+                                 (uint32_t) tolower((unsigned char) (p)[1]) << 8 | \
+                                 (uint32_t) tolower((unsigned char) (p)[2]))
+
+/**
+ * code保存当前行pattern和compact的文本，以'\0'分隔，按需读取，fid和cid未变时复用
+ * held表示dbcount设置了保存点，计数与逐行读取在同一读事务中，由dbfinish释放
+ */
+struct tagCursor {
+    db_t db;
+    sqlite3_stmt *stmt;
+    int owned;
+    int pathcol;
+    int tags;
+    int held;
+    int64_t fid;
+    int64_t cid;
+    char *code;
+};
+
+/**
+ * file.id到显示路径的缓存，按id直接映射，冲突时替换
+ * key为file表中的键，用于确认缓存项仍对应同一文件
+ */
+struct pathcache {
+    int64_t fid;
+    char *key;
+    char *show;
+};
+
+/**
+ * dict表在内存中的映射，texts按id保存文本，slots为文本到id的开放寻址散列，0表示空位
+ * 回滚可能撤销新加入的行，added非0时回滚后整个映射作废，之后按需重新读取
+ */
+struct dictset {
+    char **texts;
+    int64_t size;
+    int64_t *slots;
+    uint32_t cap;
+    uint32_t count;
+    int added;
+};
+
+/**
+ * 当前文件已写入code表的行，按pattern和compact开放寻址散列，id为0表示空位
+ * text保存pattern和compact，以'\0'分隔；保存点结束后行可能被撤销或随文件删除，须清空
+ * 重新解析已有的文件时预先读入其原有的行，used为0表示新的tag尚未用到，结束时删除
+ */
+struct codeline {
+    uint32_t hash;
+    int64_t id;
+    char *text;
+    int used;
+};
+
+struct codeset {
+    int64_t fid;
+    int64_t last;
+    struct codeline *slots;
+    uint32_t size;
+    uint32_t count;
+};
+
+/**
+ * 一个文件中名称和上下文的trigram集合，开放寻址，0表示空位
+ * 文本中不含'\0'，所以trigram不会为0
+ */
+struct gramset {
+    int64_t fid;
+    uint32_t *slots;
+    uint32_t size;
+    uint32_t count;
+};
+
+/**
+ * 重新解析的文件在库中原有的tag，sig为各列按sigcols顺序以'\0'结尾拼接的签名，保存在text中的偏移，
+ * 签名的前keylen字节为(mark, name, kind, cid)；hash和keys为两种比较方式的散列链表头，保存下标加1
+ */
+struct oldtag {
+    int64_t rowid;
+    size_t sig;
+    uint32_t len;
+    uint32_t keylen;
+    uint32_t hash;
+    uint32_t keyhash;
+    uint32_t nexthash;
+    uint32_t nextkey;
+    int used;
+};
+
+struct oldset {
+    int64_t fid;
+    struct oldtag *tags;
+    uint32_t count;
+    uint32_t size;
+    uint32_t *hash;
+    uint32_t *keys;
+    uint32_t cap;
+    char *text;
+    size_t textlen;
+    size_t textcap;
+};
+
 struct tagDB {
     sqlite3 *db3;
     sqlite3_stmt *stmt[DBOP_COUNT];
+    sqlite3_stmt *range[QUERY_CALLEES + 1];
     unsigned char mode;
     char path[PATH_MAX + 1];
+    char *view;
+    struct pathcache cache[PATHCACHE_SIZE];
+    struct gramset grams;
+    struct codeset codes;
+    int trigram;
+    int fidslot;
+    int cidslot;
+    int funcslot;
+    int rowslot;
+    int slots[FIELD_MAX];
+    struct dictset dict;
+    struct oldset olds;
+    int depth;
+};
+
+// 保存为dict表中id的列
+static const unsigned char dictcol[FIELD_MAX] = {
+        [FIELD_IDX_LANG] = 1,
+        [FIELD_IDX_ROLE] = 1,
+        [FIELD_IDX_KIND] = 1,
+        [FIELD_IDX_ACCESS] = 1,
+        [FIELD_IDX_KSCOPE] = 1,
+        [FIELD_IDX_EXTRAS] = 1
+};
+
+// SQL_ADDTAGS中各字段的参数名，预编译后换算为参数位置，pattern和compact换成$cid
+static const char *const bindname[FIELD_MAX] = {
+        [FIELD_IDX_MARK] = "$" FIELD_STR_MARK,
+        [FIELD_IDX_NAME] = "$" FIELD_STR_NAME,
+        [FIELD_IDX_LINE] = "$" FIELD_STR_LINE,
+        [FIELD_IDX_ENDL] = "$" FIELD_STR_ENDL,
+        [FIELD_IDX_LANG] = "$" FIELD_STR_LANG,
+        [FIELD_IDX_ROLE] = "$" FIELD_STR_ROLE,
+        [FIELD_IDX_KIND] = "$" FIELD_STR_KIND,
+        [FIELD_IDX_TYPE] = "$" FIELD_STR_TYPE,
+        [FIELD_IDX_SIGN] = "$" FIELD_STR_SIGN,
+        [FIELD_IDX_ACCESS] = "$" FIELD_STR_ACCESS,
+        [FIELD_IDX_INHERIT] = "$" FIELD_STR_INHERIT,
+        [FIELD_IDX_IMPL] = "$" FIELD_STR_IMPL,
+        [FIELD_IDX_KSCOPE] = "$" FIELD_STR_KSCOPE,
+        [FIELD_IDX_NSCOPE] = "$" FIELD_STR_NSCOPE,
+        [FIELD_IDX_EXTRAS] = "$" FIELD_STR_EXTRAS
+};
+
+// 签名中各列的顺序，与SQL_OLDTAGS中rowid之后的列一致
+static const int sigcols[] = {
+        FIELD_IDX_MARK,
+        FIELD_IDX_NAME,
+        FIELD_IDX_KIND,
+        TAGCOL_CID,
+        FIELD_IDX_LINE,
+        FIELD_IDX_ENDL,
+        FIELD_IDX_LANG,
+        FIELD_IDX_ROLE,
+        FIELD_IDX_TYPE,
+        FIELD_IDX_SIGN,
+        FIELD_IDX_ACCESS,
+        FIELD_IDX_INHERIT,
+        FIELD_IDX_IMPL,
+        FIELD_IDX_KSCOPE,
+        FIELD_IDX_NSCOPE,
+        FIELD_IDX_EXTRAS,
+        TAGCOL_FUNC
+};
+
+static const char *const gramsql[QUERY_CALLEES + 1] = {
+        [QUERY_SYMBOL] = SQL_SYMBOL(SQL_BYGRAM),
+        [QUERY_DEFINE] = SQL_DEFINE(SQL_BYGRAM),
+        [QUERY_CALLER] = SQL_CALLER(SQL_BYGRAM),
+        [QUERY_REFER] = SQL_REFER(SQL_BYGRAM),
+        [QUERY_STRING] = SQL_STRING(SQL_BYGRAM),
+        [QUERY_PATTERN] = SQL_PATTERN(SQL_BYTEXTGRAM),
+        [QUERY_INCLUDE] = SQL_INCLUDE(SQL_BYGRAM),
+        [QUERY_ASSIGN] = SQL_ASSIGN(SQL_BYGRAM),
+        [QUERY_CALLERS] = SQL_GRAPH(SQL_BYGRAM, "+", SQL_CALLERS),
+        [QUERY_CALLEES] = SQL_GRAPH(SQL_BYGRAM, "+", SQL_CALLEES)
 };
 
 static void strmatch(sqlite3_context *ctx, int argc, sqlite3_value *argv[])
@@ -194,326 +580,1876 @@ static void toabspath(sqlite3_context *ctx, int argc, sqlite3_value *argv[])
     if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT)
         return;
 
+    // 键由真实路径转换而来，按字面规则即可还原，无需再调用realpath
     path = (char *) sqlite3_value_text(argv[0]);
-    if (abspath(base, path, buf))
+    if (normpath(base, path, buf))
         sqlite3_result_text(ctx, buf, -1, SQLITE_TRANSIENT);
     else
         sqlite3_result_null(ctx);
 }
 
-static void torelpath(sqlite3_context *ctx, int argc, sqlite3_value *argv[])
+/**
+ * 计算名称模式在tag_name索引上的范围，[lo, hi]之外的名称一定不匹配模式
+ * 非正则模式是精确匹配，范围为[pattern, pattern]；
+ * 正则模式只有以'^'开始时才能取出字面前缀，包含选择分支或忽略大小写时无法确定范围。
+ * 基本正则中的\?、\+和\{是量词，前缀不一定出现，也不确定范围
+ * @param mode    数据库模式
+ * @param pattern 名称模式
+ * @param lo      范围下界，大小至少为strlen(pattern) + 1
+ * @param hi      范围上界，大小至少为strlen(pattern) + 1
+ * @return        能确定范围返回1，否则返回0
+ */
+static int namerange(unsigned char mode, const char *pattern, char *lo, char *hi)
 {
-    char *path, buf[PATH_MAX + 1] = {0};
-    const char *base = (const char *) sqlite3_user_data(ctx);
+    int len = 0;
+    const char *p, *meta = mode & DB_EXREG ? ".[]\\()*+?{}|^$" : ".[]\\*^$";
 
-    if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT)
-        return;
+    if (mode & DB_ICASE)
+        return 0;
 
-    path = (char *) sqlite3_value_text(argv[0]);
-    if (relpath(base, path, buf))
-        sqlite3_result_text(ctx, buf, -1, SQLITE_TRANSIENT);
-    else
-        sqlite3_result_null(ctx);
+    if (!(mode & DB_REGEX)) {
+        strcpy(lo, pattern);
+        strcpy(hi, pattern);
+        return 1;
+    }
+
+    if (*pattern != '^' || strchr(pattern, '|'))
+        return 0;
+
+    for (p = pattern + 1; *p; p++) {
+        if (!strchr(meta, *p))
+            lo[len++] = *p;
+        else if (*p == '\\' && p[1] && strchr(".[]\\*^$/", p[1]))
+            lo[len++] = *++p;
+        else
+            break;
+    }
+
+    if (!(mode & DB_EXREG) && p[0] == '\\' && p[1] && strchr("?+{", p[1]))
+        return 0;
+
+    // 后随量词的字符不一定出现
+    if (len > 0 && (*p == '*' || (mode & DB_EXREG && (*p == '?' || *p == '{'))))
+        len--;
+
+    lo[len] = '\0';
+    strcpy(hi, lo);
+
+    if (*p == '$' && !p[1])
+        return 1;
+
+    // 前缀的后继：去掉末尾的0xFF后将最后一个字节加一
+    while (len > 0 && (unsigned char) hi[len - 1] == 0xFF)
+        hi[--len] = '\0';
+
+    if (len == 0)
+        return 0;
+
+    hi[len - 1]++;
+
+    return 1;
 }
 
 /**
- * 查询数据库
+ * 将文件路径转成file表中的键，即相对数据库基本路径的真实路径
+ * 文件已经不存在时无法取得真实路径，此时按字面规则转换
  * @param db   数据库句柄
- * @param mode 数据库模式
- * @param sql  查询语句
- * @param rows 结果集行数
- * @param cols 结果集列数
- * @return     查询成功返回结果集，否则返回NULL
+ * @param path 文件路径
+ * @param buf  转换后的缓冲区，大小至少为2 * PATH_MAX + 1
+ * @return     转换成功返回buf指针，否则返回NULL
  */
-static char **dbquery(db_t db, unsigned char mode, const char *sql, int *rows, int *cols)
+static char *pathkey(db_t db, const char *path, char buf[])
 {
-    int rc;
-    char **table = NULL;
+    char tmp[PATH_MAX + 1] = {0};
 
-    assert(db && db->db3 && sql && rows && cols);
+    if (!abspath(NULL, path, tmp) && !normpath(NULL, path, tmp))
+        return NULL;
 
-    db->mode = mode;
+    return relpath(db->path, tmp, buf);
+}
+
+/**
+ * 向集合添加一个trigram
+ * @param set  trigram集合
+ * @param gram trigram
+ * @return     添加成功返回0，否则返回非0
+ */
+static int addgram(struct gramset *set, uint32_t gram)
+{
+    uint32_t idx, size, *slots;
+
+    if ((set->count + 1) * 2 > set->size) {
+        size = set->size ? set->size * 2 : 1024;
+        if (!(slots = (uint32_t *) sqlite3_malloc64(size * sizeof(*slots))))
+            return -1;
+        memset(slots, 0, size * sizeof(*slots));
+        for (idx = 0; idx < set->size; idx++) {
+            if (set->slots[idx]) {
+                uint32_t pos = set->slots[idx] * 2654435761u & (size - 1);
+                for (; slots[pos]; pos = (pos + 1) & (size - 1));
+                slots[pos] = set->slots[idx];
+            }
+        }
+        sqlite3_free(set->slots);
+        set->slots = slots;
+        set->size = size;
+    }
+
+    for (idx = gram * 2654435761u & (set->size - 1); set->slots[idx]; idx = (idx + 1) & (set->size - 1)) {
+        if (set->slots[idx] == gram)
+            return 0;
+    }
 
-    rc = sqlite3_get_table(db->db3, sql, &table, rows, cols, NULL);
+    set->slots[idx] = gram;
+    set->count++;
 
-    return (rc == SQLITE_OK ? table : NULL);
+    return 0;
 }
 
 /**
- * 开始新的事务
- * @param db 数据库句柄
- * @return   事务开始成功返回0，否则返回非0
+ * 将文本中所有trigram添加到集合，字母统一转为小写
+ * @param set  trigram集合
+ * @param text 文本
  */
-int dbbegin(db_t db)
+static void addgrams(struct gramset *set, const char *text)
 {
-    assert(db && db->db3);
-    return sqlite3_exec(db->db3, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+    for (; text && text[0] && text[1] && text[2]; text++)
+        addgram(set, GRAM(text));
 }
 
 /**
- * 提交由dbbegin开始的事务
- * @param db 数据库句柄
- * @return   提交成功返回0，否则返回非0
+ * 判断trigram是否在集合中
+ * @param set  trigram集合
+ * @param gram trigram
+ * @return     在集合中返回非0
  */
-int dbcommit(db_t db)
+static int hasgram(const struct gramset *set, uint32_t gram)
 {
-    assert(db && db->db3);
-    return sqlite3_exec(db->db3, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+    uint32_t idx;
+
+    if (!set->count)
+        return 0;
+
+    for (idx = gram * 2654435761u & (set->size - 1); set->slots[idx]; idx = (idx + 1) & (set->size - 1)) {
+        if (set->slots[idx] == gram)
+            return 1;
+    }
+
+    return 0;
 }
 
 /**
- * 回滚由dbbegin开始的事务
+ * 清空当前文件的trigram集合
  * @param db 数据库句柄
- * @return   回滚成功返回0，否则返回非0
  */
-int dbrollback(db_t db)
+static void dropgrams(db_t db)
 {
-    assert(db && db->db3);
-    return sqlite3_exec(db->db3, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+    if (db->grams.count)
+        memset(db->grams.slots, 0, db->grams.size * sizeof(*db->grams.slots));
+    db->grams.count = 0;
+    db->grams.fid = 0;
 }
 
 /**
- * 遍历所有文件
- * @param db   数据库句柄
- * @param func 查找到文件时的回调函数，参数为此文件相关属性
- * @param ctx  回调函数上下文
- * @return     遍历成功返回0，否则返回非0
+ * 将当前文件的trigram集合写入gram表并清空
+ * @param db 数据库句柄
+ * @return   写入成功返回0，否则返回非0
  */
-int dballfile(db_t db, void (*func)(int64_t fid, const char *path, int64_t size, int64_t time, void *ctx), void *ctx)
+static int flushgrams(db_t db)
 {
-    int rc;
-    int64_t fid, size, time;
-    const unsigned char *path;
+    int rc = SQLITE_DONE;
+
+    for (uint32_t idx = 0; db->grams.count && idx < db->grams.size && rc == SQLITE_DONE; idx++) {
+        if (db->grams.slots[idx]) {
+            sqlite3_reset(db->stmt[DBOP_ADDGRAM]);
+            sqlite3_bind_int64(db->stmt[DBOP_ADDGRAM], 1, db->grams.slots[idx]);
+            sqlite3_bind_int64(db->stmt[DBOP_ADDGRAM], 2, db->grams.fid);
+            rc = sqlite3_step(db->stmt[DBOP_ADDGRAM]);
+        }
+    }
 
-    assert(db && db->stmt[DBOP_ALLFILE]);
+    dropgrams(db);
 
-    sqlite3_reset(db->stmt[DBOP_ALLFILE]);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
 
-    while ((rc = sqlite3_step(db->stmt[DBOP_ALLFILE])) == SQLITE_ROW) {
-        fid = sqlite3_column_int64(db->stmt[DBOP_ALLFILE], 0);
-        path = sqlite3_column_text(db->stmt[DBOP_ALLFILE], 1);
-        size = sqlite3_column_int64(db->stmt[DBOP_ALLFILE], 2);
-        time = sqlite3_column_int64(db->stmt[DBOP_ALLFILE], 3);
-        func(fid, (char *) path, size, time, ctx);
+/**
+ * 将字面字符串中的trigram去重后追加到grams
+ * @param lit   字面字符串
+ * @param len   字符串长度
+ * @param grams trigram数组
+ * @param cnt   grams中已有的个数
+ * @param max   grams的大小
+ * @return      追加后grams中的个数
+ */
+static int litgrams(const char *lit, int len, uint32_t grams[], int cnt, int max)
+{
+    int idx, pos;
+
+    for (idx = 0; idx + 3 <= len && cnt < max; idx++) {
+        grams[cnt] = GRAM(lit + idx);
+        for (pos = 0; pos < cnt && grams[pos] != grams[cnt]; pos++);
+        cnt += pos == cnt;
     }
 
-    return rc == SQLITE_DONE ? 0 : -1;
+    return cnt;
 }
 
 /**
- * 获取文件属性
- * @param db   数据库句柄
- * @param path 文件绝对路径
- * @param size 返回的文件字节数
- * @param time 返回的文件修改时间
- * @return     获取成功返回0，否则返回非0
+ * 跳过正则中的一个元素：方括号表达式、分组、区间量词或单个元字符
+ * @param mode 数据库模式
+ * @param p    元素起始位置
+ * @return     元素之后的位置
  */
-int64_t dbgetfile(db_t db, const char *path, int64_t *size, int64_t *time)
+static const char *skipmeta(unsigned char mode, const char *p)
 {
-    int64_t id = 0;
-    char buf[PATH_MAX + 1] = {0};
-
-    assert(db && db->db3 && db->stmt[DBOP_GETFILE] && path);
+    int depth;
+    const char *q;
+
+    if (*p == '[') {
+        // ']'紧随'['或'[^'时是普通字符
+        for (p += 1 + (p[1] == '^'), p += *p == ']'; *p && *p != ']'; p++) {
+            if (*p == '[' && p[1] && strchr(":.=", p[1]) && (q = strchr(p + 2, ']')))
+                p = q;
+        }
+        return *p ? p + 1 : p;
+    }
 
-    if (!abspath(NULL, path, buf))
-        return -1;
+    if (mode & DB_EXREG ? *p == '(' : p[0] == '\\' && p[1] == '(') {
+        // 分组可能整体可选，跳过其中的全部内容
+        for (depth = 0; *p;) {
+            if (*p == '[') {
+                p = skipmeta(mode, p);
+                continue;
+            }
+            if (*p == '\\' && p[1]) {
+                if (!(mode & DB_EXREG))
+                    depth += (p[1] == '(') - (p[1] == ')');
+                p += 2;
+            } else {
+                if (mode & DB_EXREG)
+                    depth += (*p == '(') - (*p == ')');
+                p++;
+            }
+            if (depth == 0)
+                break;
+        }
+        return p;
+    }
 
-    sqlite3_reset(db->stmt[DBOP_GETFILE]);
+    if (mode & DB_EXREG ? *p == '{' : p[0] == '\\' && p[1] == '{') {
+        for (; *p && *p != '}'; p++);
+        return *p ? p + 1 : p;
+    }
 
-    sqlite3_bind_text(db->stmt[DBOP_GETFILE], 1, buf, -1, NULL);
+    return p[0] == '\\' && p[1] ? p + 2 : p + 1;
+}
 
-    if (sqlite3_step(db->stmt[DBOP_GETFILE]) == SQLITE_ROW) {
-        id = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 0);
-        if (size)
-            *size = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 1);
-        if (time)
-            *time = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 2);
+/**
+ * 提取匹配模式的文本中必定包含的trigram
+ * 只从一定会出现的字面字符串中提取：分组、方括号、后随量词的字符都会被跳过，
+ * 包含选择分支时无法确定；少提取只会使候选文件变多，不影响结果。
+ * 基本正则中的\?、\+和\{是量词，按扩展正则中的?、+和{处理
+ * @param mode    数据库模式
+ * @param pattern 模式
+ * @param grams   提取到的trigram
+ * @param max     grams的大小
+ * @return        提取到的trigram个数
+ */
+static int patgrams(unsigned char mode, const char *pattern, uint32_t grams[], int max)
+{
+    int cnt = 0, len = 0;
+    const char *p = pattern;
+    char lit[strlen(pattern) + 1];
+    const char *meta = mode & DB_EXREG ? ".[\\*^$()+?{|" : ".[\\*^$";
+    const char *escape = mode & DB_EXREG ? ".[]\\*^$/+?(){}|" : ".[]\\*^$/";
+
+    if (!(mode & DB_REGEX))
+        return litgrams(pattern, strlen(pattern), grams, 0, max);
+
+    if (strchr(pattern, '|'))
+        return 0;
+
+    for (;;) {
+        if (p[0] == '\\' && p[1] && strchr(escape, p[1])) {
+            lit[len++] = p[1];
+            p += 2;
+        } else if (*p && !strchr(meta, *p))
+            lit[len++] = *p++;
+        else {
+            // 后随量词的字符不一定出现，基本正则中的\?和\{与扩展正则中的?和{相同
+            if (len > 0 && (*p == '*' || (mode & DB_EXREG ? *p == '?' || *p == '{' : p[0] == '\\' && p[1] && strchr("?{", p[1]))))
+                len--;
+            cnt = litgrams(lit, len, grams, cnt, max);
+            len = 0;
+            if (!*p)
+                break;
+            p = skipmeta(mode, p);
+        }
     }
 
-    return id;
+    return cnt;
 }
 
 /**
- * 添加或修改文件属性信息
- * @param db   数据库句柄
- * @param path 文件绝对路径
- * @param size 文件字节数
- * @param time 文件修改时间
- * @return     设置成功返回0，否则返回非0
+ * 根据trigram创建查询语句，只匹配包含全部trigram的文件中的tags
+ * @param db     数据库句柄
+ * @param opcode 查找操作码
+ * @param grams  trigram
+ * @param cnt    trigram个数
+ * @return       创建成功返回查询语句，否则返回NULL
  */
-int64_t dbsetfile(db_t db, const char *path, int64_t size, int64_t time)
+static sqlite3_stmt *gramstmt(db_t db, unsigned char opcode, const uint32_t grams[], int cnt)
 {
-    char buf[PATH_MAX + 1] = {0};
+    char *fids, *sql;
+    sqlite3_stmt *stmt = NULL;
 
-    assert(db && db->db3 && db->stmt[DBOP_SETFILE] && path);
+    if (!gramsql[opcode] || !(fids = sqlite3_mprintf(SQL_GRAMFID, grams[0])))
+        return NULL;
 
-    if (!abspath(NULL, path, buf))
-        return -1;
+    for (int idx = 1; idx < cnt && fids; idx++)
+        fids = sqlite3_mprintf("%z INTERSECT " SQL_GRAMFID, fids, grams[idx]);
 
-    sqlite3_reset(db->stmt[DBOP_SETFILE]);
+    if (fids && (sql = sqlite3_mprintf(gramsql[opcode], fids))) {
+        if (sqlite3_prepare_v2(db->db3, sql, -1, &stmt, NULL) != SQLITE_OK && stmt)
+            stmt = (sqlite3_finalize(stmt), NULL);
+        sqlite3_free(sql);
+    }
 
-    sqlite3_bind_text(db->stmt[DBOP_SETFILE], 1, buf, -1, NULL);
-    sqlite3_bind_int64(db->stmt[DBOP_SETFILE], 2, size);
-    sqlite3_bind_int64(db->stmt[DBOP_SETFILE], 3, time);
+    sqlite3_free(fids);
 
-    return sqlite3_step(db->stmt[DBOP_SETFILE]) == SQLITE_DONE ? sqlite3_last_insert_rowid(db->db3) : 0;
+    return stmt;
 }
 
 /**
- * 从数据库中删除文件（文件里的tags也会清除）
- * @param db   数据库句柄
- * @param path 文件绝对路径
- * @return     删除成功返回0，否则返回非0
+ * 计算dict文本的散列值（FNV-1a）
+ * @param text 文本
+ * @return     散列值
  */
-int dbdelfile(db_t db, const char *path)
+static uint32_t dicthash(const char *text)
 {
-    char buf[PATH_MAX + 1] = {0};
+    uint32_t hash = 2166136261u;
 
-    assert(db && db->stmt[DBOP_DELFILE] && path);
+    while (*text)
+        hash = (hash ^ (unsigned char) *text++) * 16777619u;
 
-    if (!abspath(NULL, path, buf))
-        return -1;
+    return hash;
+}
 
-    sqlite3_reset(db->stmt[DBOP_DELFILE]);
+/**
+ * 在内存映射中查找文本的id
+ * @param dict 内存映射
+ * @param text 文本
+ * @return     找到返回id，否则返回0
+ */
+static int64_t dictfind(struct dictset *dict, const char *text)
+{
+    uint32_t idx;
 
-    sqlite3_bind_text(db->stmt[DBOP_DELFILE], 1, buf, -1, NULL);
+    if (!dict->cap)
+        return 0;
 
-    return sqlite3_step(db->stmt[DBOP_DELFILE]) == SQLITE_DONE ? 0 : -1;
+    for (idx = dicthash(text) & (dict->cap - 1); dict->slots[idx]; idx = (idx + 1) & (dict->cap - 1)) {
+        if (strcmp(dict->texts[dict->slots[idx]], text) == 0)
+            return dict->slots[idx];
+    }
+
+    return 0;
 }
 
 /**
- * 向数据库添加一条tag
- * @param db     数据库句柄
- * @param fid    待添加的tag所属的文件id
- * @param fields tag内容，用户必须保证以NULL结尾
- * @return       添加成功返回0，否则返回非0
+ * 把id和文本加入内存映射
+ * @param dict 内存映射
+ * @param id   dict表中的id
+ * @param text 文本
+ * @return     映射中的文本，失败返回NULL
  */
-int dbaddatag(db_t db, int64_t fid, char *const *fields)
+static const char *dictput(struct dictset *dict, int64_t id, const char *text)
 {
-    int idx, type;
-    char *item, *const *field;
-
-    assert(db && db->stmt[DBOP_ADDTAGS]);
+    uint32_t idx, pos, cap;
+    int64_t size, *slots;
+    char **texts;
 
-    sqlite3_reset(db->stmt[DBOP_ADDTAGS]);
+    if (id <= 0 || !text)
+        return NULL;
 
-    idx = sqlite3_bind_parameter_index(db->stmt[DBOP_ADDTAGS], "$fid");
-    sqlite3_bind_int64(db->stmt[DBOP_ADDTAGS], idx, fid);
+    if (id >= dict->size) {
+        size = id + 1 > dict->size * 2 ? id + 1 : dict->size * 2;
+        if (!(texts = (char **) sqlite3_realloc64(dict->texts, size * sizeof(*texts))))
+            return NULL;
+        memset(texts + dict->size, 0, (size - dict->size) * sizeof(*texts));
+        dict->texts = texts;
+        dict->size = size;
+    }
 
-    for (field = fields; *field; field++) {
-        item = *field;
-        type = *item++;
-        idx = sqlite3_bind_parameter_index(db->stmt[DBOP_ADDTAGS], strsep(&item, "="));
-        if (idx > 0) {
-            if (strcmp(item, "-") == 0)
-                *item = '\0';
-            if (*item == '\0' && type == 'T')
-                type = 0;
-            switch (type) {
-                case 'I':
-                    sqlite3_bind_int64(db->stmt[DBOP_ADDTAGS], idx, strtoull(item, NULL, 10));
-                    break;
-                case 'T':
-                    sqlite3_bind_text(db->stmt[DBOP_ADDTAGS], idx, item, -1, NULL);
-                    break;
-                default:
-                    sqlite3_bind_null(db->stmt[DBOP_ADDTAGS], idx);
-                    break;
+    if (dict->texts[id])
+        return dict->texts[id];
+
+    if ((dict->count + 1) * 2 > dict->cap) {
+        cap = dict->cap ? dict->cap * 2 : 256;
+        if (!(slots = (int64_t *) sqlite3_malloc64(cap * sizeof(*slots))))
+            return NULL;
+        memset(slots, 0, cap * sizeof(*slots));
+        for (idx = 0; idx < dict->cap; idx++) {
+            if (dict->slots[idx]) {
+                for (pos = dicthash(dict->texts[dict->slots[idx]]) & (cap - 1); slots[pos]; pos = (pos + 1) & (cap - 1));
+                slots[pos] = dict->slots[idx];
             }
         }
+        sqlite3_free(dict->slots);
+        dict->slots = slots;
+        dict->cap = cap;
     }
 
-    return sqlite3_step(db->stmt[DBOP_ADDTAGS]) == SQLITE_DONE ? 0 : -1;
+    if (!(dict->texts[id] = sqlite3_mprintf("%s", text)))
+        return NULL;
+
+    for (idx = dicthash(text) & (dict->cap - 1); dict->slots[idx]; idx = (idx + 1) & (dict->cap - 1));
+    dict->slots[idx] = id;
+    dict->count++;
+
+    return dict->texts[id];
 }
 
 /**
- * 读取不同操作码对应的tags
- * @param db      数据库句柄
- * @param mode    数据库模式
- * @param opcode  查找操作码
- * @param pattern 对应操作码的模式
- * @param rows    结果集行数
- * @param cols    结果集列数
- * @return        查找成功返回结果集，否则返回NULL
+ * 清空内存映射
+ * @param dict 内存映射
  */
-char **dbreadtags(db_t db, unsigned char mode, unsigned char opcode, const char *pattern, int *rows, int *cols)
+static void dictdrop(struct dictset *dict)
 {
-    char *sql, **table = NULL;
-
-    assert(QUERY_SYMBOL <= opcode && opcode <= QUERY_ASSIGN && db && db->stmt[opcode] && pattern);
-
-    sqlite3_reset(db->stmt[opcode]);
-    sqlite3_bind_text(db->stmt[opcode], 1, pattern, -1, NULL);
-
-    if ((sql = sqlite3_expanded_sql(db->stmt[opcode]))) {
-        table = dbquery(db, mode, sql, rows, cols);
-        sqlite3_free(sql);
+    for (int64_t id = 0; id < dict->size; id++) {
+        sqlite3_free(dict->texts[id]);
+        dict->texts[id] = NULL;
     }
 
-    return table;
+    if (dict->cap)
+        memset(dict->slots, 0, dict->cap * sizeof(*dict->slots));
+
+    dict->count = 0;
+    dict->added = 0;
 }
 
 /**
- * 根据路径模式查找文件路径
- * @param db      数据库句柄
- * @param mode    数据库模式
- * @param pattern 查找模式
- * @param rows    结果集行数
- * @param cols    结果集列数
- * @return        查找成功返回结果集，否则返回NULL
+ * 获取文本在dict表中的id，不存在时加入
+ * @param db   数据库句柄
+ * @param text 文本
+ * @return     成功返回id，否则返回0
  */
-char **dbfindpath(db_t db, unsigned char mode, const char *pattern, int *rows, int *cols)
+static int64_t wordid(db_t db, const char *text)
 {
-    char *sql, **table = NULL;
+    int64_t id;
 
-    assert(db && db->stmt[QUERY_FPATH] && pattern);
+    if ((id = dictfind(&db->dict, text)) > 0)
+        return id;
 
-    sqlite3_reset(db->stmt[QUERY_FPATH]);
-    sqlite3_bind_text(db->stmt[QUERY_FPATH], 1, pattern, -1, NULL);
+    sqlite3_bind_text(db->stmt[DBOP_FINDDICT], 1, text, -1, SQLITE_STATIC);
+    if (sqlite3_step(db->stmt[DBOP_FINDDICT]) == SQLITE_ROW)
+        id = sqlite3_column_int64(db->stmt[DBOP_FINDDICT], 0);
+    sqlite3_reset(db->stmt[DBOP_FINDDICT]);
 
-    if ((sql = sqlite3_expanded_sql(db->stmt[QUERY_FPATH]))) {
-        table = dbquery(db, mode, sql, rows, cols);
-        sqlite3_free(sql);
+    if (id <= 0) {
+        sqlite3_bind_text(db->stmt[DBOP_ADDDICT], 1, text, -1, SQLITE_STATIC);
+        if (sqlite3_step(db->stmt[DBOP_ADDDICT]) == SQLITE_DONE) {
+            id = sqlite3_last_insert_rowid(db->db3);
+            db->dict.added = 1;
+        }
+        sqlite3_reset(db->stmt[DBOP_ADDDICT]);
     }
 
-    return table;
+    dictput(&db->dict, id, text);
+
+    return id;
 }
 
 /**
- * 根据where参数查找tags
- * @param db    数据库句柄
- * @param mode  数据库模式
- * @param where 查询条件
- * @param rows  结果集行数
- * @param cols  结果集列数
- * @return      查找成功返回结果集，否则返回NULL
+ * 获取dict表中id对应的文本，其他连接新加入的id按需读取
+ * @param db 数据库句柄
+ * @param id dict表中的id
+ * @return   文本，不存在时返回NULL
  */
-char **dbfindtags(db_t db, unsigned char mode, const char *where, int *rows, int *cols)
+static const char *wordtext(db_t db, int64_t id)
 {
-    char *sql, **table = NULL;
+    const char *text = NULL;
 
-    assert(db && where);
+    if (id > 0 && id < db->dict.size && db->dict.texts[id])
+        return db->dict.texts[id];
 
-    if ((sql = sqlite3_mprintf(SQL_QUERYTAG "WHERE %s " SQL_TAGSORT, where))) {
-        table = dbquery(db, mode, sql, rows, cols);
-        sqlite3_free(sql);
-    }
+    sqlite3_bind_int64(db->stmt[DBOP_GETDICT], 1, id);
+    if (sqlite3_step(db->stmt[DBOP_GETDICT]) == SQLITE_ROW)
+        text = dictput(&db->dict, id, (const char *) sqlite3_column_text(db->stmt[DBOP_GETDICT], 0));
+    sqlite3_reset(db->stmt[DBOP_GETDICT]);
 
-    return table;
+    return text;
 }
 
 /**
- * 释放由dbreadtags/dbfindpath/dbfindtags返回的table
- * @param table 结果集
+ * 清空当前文件的行集合
+ * @param set 行集合
  */
-void dbfree(char **table)
+static void dropcodes(struct codeset *set)
 {
-    assert(table);
-    sqlite3_free_table(table);
+    for (uint32_t idx = 0; set->count && idx < set->size; idx++) {
+        sqlite3_free(set->slots[idx].text);
+        set->slots[idx].text = NULL;
+        set->slots[idx].id = 0;
+    }
+
+    set->count = 0;
+    set->fid = 0;
+    set->last = 0;
+}
+
+/**
+ * 在行集合中查找一行，找不到时返回可以放入该行的空位，集合将满时先扩容
+ * @param set     行集合
+ * @param hash    pattern和compact的散列值
+ * @param pattern tag的pattern
+ * @param compact tag的compact
+ * @return        找到的行或空位，扩容失败返回NULL
+ */
+static struct codeline *codeslot(struct codeset *set, uint32_t hash, const char *pattern, const char *compact)
+{
+    uint32_t idx, pos, size;
+    size_t plen = strlen(pattern);
+    struct codeline *slots;
+
+    if ((set->count + 1) * 2 > set->size) {
+        size = set->size ? set->size * 2 : 256;
+        if (!(slots = (struct codeline *) sqlite3_malloc64(size * sizeof(*slots))))
+            return NULL;
+        memset(slots, 0, size * sizeof(*slots));
+        for (idx = 0; idx < set->size; idx++) {
+            if (set->slots[idx].id) {
+                for (pos = set->slots[idx].hash & (size - 1); slots[pos].id; pos = (pos + 1) & (size - 1));
+                slots[pos] = set->slots[idx];
+            }
+        }
+        sqlite3_free(set->slots);
+        set->slots = slots;
+        set->size = size;
+    }
+
+    for (idx = hash & (set->size - 1); set->slots[idx].id; idx = (idx + 1) & (set->size - 1)) {
+        if (set->slots[idx].hash == hash && memcmp(set->slots[idx].text, pattern, plen + 1) == 0 &&
+            strcmp(set->slots[idx].text + plen + 1, compact) == 0)
+            break;
+    }
+
+    return &set->slots[idx];
+}
+
+/**
+ * 把一行放入行集合的空位
+ * @param set     行集合
+ * @param slot    codeslot返回的空位
+ * @param hash    pattern和compact的散列值
+ * @param id      行在code表中的id
+ * @param pattern tag的pattern
+ * @param compact tag的compact
+ * @return        成功返回0，否则返回非0
+ */
+static int codeput(struct codeset *set, struct codeline *slot, uint32_t hash, int64_t id,
+                   const char *pattern, const char *compact)
+{
+    size_t plen = strlen(pattern), clen = strlen(compact);
+
+    if (!(slot->text = (char *) sqlite3_malloc64(plen + clen + 2)))
+        return -1;
+
+    memcpy(slot->text, pattern, plen + 1);
+    memcpy(slot->text + plen + 1, compact, clen + 1);
+    slot->hash = hash;
+    slot->id = id;
+    slot->used = 0;
+    set->count++;
+
+    return 0;
+}
+
+/**
+ * 获取一行源码在code表中的id，同一文件中已写入过的行直接复用，否则写入code表
+ * 新写入或首次用到的预读行同时把compact的trigram加入当前文件的集合
+ * @param db      数据库句柄
+ * @param fid     文件id
+ * @param pattern tag的pattern
+ * @param compact tag的compact
+ * @return        成功返回id，否则返回0
+ */
+static int64_t codeid(db_t db, int64_t fid, const char *pattern, const char *compact)
+{
+    uint32_t hash;
+    struct codeline *slot;
+    struct codeset *set = &db->codes;
+    sqlite3_stmt *stmt;
+
+    if (fid != set->fid) {
+        dropcodes(set);
+        stmt = db->stmt[DBOP_LASTCODE];
+        sqlite3_bind_int64(stmt, 1, fid);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            sqlite3_reset(stmt);
+            return 0;
+        }
+        set->last = sqlite3_column_int64(stmt, 0);
+        set->fid = fid;
+        sqlite3_reset(stmt);
+    }
+
+    hash = dicthash(pattern) * 31 + dicthash(compact);
+
+    if (!(slot = codeslot(set, hash, pattern, compact)))
+        return 0;
+
+    if (slot->id) {
+        if (!slot->used) {
+            slot->used = 1;
+            addgrams(&db->grams, compact);
+        }
+        return slot->id;
+    }
+
+    if (codeput(set, slot, hash, set->last + 1, pattern, compact) != 0)
+        return 0;
+
+    stmt = db->stmt[DBOP_ADDCODE];
+    sqlite3_bind_int64(stmt, 1, fid);
+    sqlite3_bind_int64(stmt, 2, slot->id);
+    sqlite3_bind_text(stmt, 3, pattern, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, compact, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sqlite3_reset(stmt);
+        sqlite3_free(slot->text);
+        slot->text = NULL;
+        slot->id = 0;
+        set->count--;
+        return 0;
+    }
+
+    sqlite3_reset(stmt);
+
+    slot->used = 1;
+    set->last++;
+
+    addgrams(&db->grams, compact);
+
+    return slot->id;
+}
+
+/**
+ * 计算签名的散列值（FNV-1a），签名中含有'\0'，按长度计算
+ * @param text 签名
+ * @param len  签名长度
+ * @return     散列值
+ */
+static uint32_t sighash(const char *text, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--)
+        hash = (hash ^ (unsigned char) *text++) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * 清空原有tag的集合，保留已分配的内存
+ * @param set 原有tag的集合
+ */
+static void dropolds(struct oldset *set)
+{
+    set->fid = 0;
+    set->count = 0;
+    set->textlen = 0;
+}
+
+/**
+ * 在text末尾的签名后追加一列，签名本身不计入textlen，确认保存时再增加textlen
+ * 值写为'='加文本加'\0'，NULL只写'\0'，与空串区分
+ * @param set 原有tag的集合
+ * @param len 签名已有的长度，返回追加后的长度
+ * @param val 列的文本，NULL表示列值为NULL
+ * @return    成功返回0，否则返回非0
+ */
+static int sigcol(struct oldset *set, size_t *len, const char *val)
+{
+    char *text, *pos;
+    size_t cap, size = val ? strlen(val) + 2 : 1;
+
+    if (set->textlen + *len + size > set->textcap) {
+        for (cap = set->textcap ? set->textcap * 2 : 4096; cap < set->textlen + *len + size; cap *= 2);
+        if (!(text = (char *) sqlite3_realloc64(set->text, cap)))
+            return -1;
+        set->text = text;
+        set->textcap = cap;
+    }
+
+    pos = set->text + set->textlen + *len;
+    if (val) {
+        *pos++ = '=';
+        memcpy(pos, val, size - 2);
+        pos += size - 2;
+    }
+    *pos = '\0';
+    *len += size;
+
+    return 0;
+}
+
+/**
+ * 查找与text末尾的签名相同且未用到的原有tag，同键的行中先找到行号较小的
+ * @param set 原有tag的集合
+ * @param len 比较的长度，为签名全长时比较所有列，为keylen时只比较键
+ * @param key 非0时只比较键
+ * @return    找到的tag，没有时返回NULL
+ */
+static struct oldtag *findold(struct oldset *set, size_t len, int key)
+{
+    uint32_t idx, hash;
+    struct oldtag *old;
+    const char *sig = set->text + set->textlen;
+
+    if (!set->count)
+        return NULL;
+
+    hash = sighash(sig, len);
+
+    for (idx = (key ? set->keys : set->hash)[hash & (set->cap - 1)]; idx; idx = key ? old->nextkey : old->nexthash) {
+        old = &set->tags[idx - 1];
+        if (!old->used && (key ? old->keyhash == hash && old->keylen == len : old->hash == hash && old->len == len) &&
+            memcmp(set->text + old->sig, sig, len) == 0)
+            return old;
+    }
+
+    return NULL;
+}
+
+/**
+ * 读入重新解析的文件在库中原有的tag和code表中的行，之后dbaddatag与之比较
+ * @param db  数据库句柄
+ * @param fid 文件id
+ * @return    成功返回0，否则返回非0
+ */
+static int loadfile(db_t db, int64_t fid)
+{
+    int rc, col;
+    uint32_t idx, cap, hash, *buckets;
+    size_t len, keylen = 0;
+    int64_t id;
+    const char *pattern, *compact;
+    struct oldtag *tags, *old;
+    struct codeline *slot;
+    struct oldset *set = &db->olds;
+    sqlite3_stmt *stmt = db->stmt[DBOP_OLDTAGS];
+
+    dropolds(set);
+    dropcodes(&db->codes);
+
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, fid);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (set->count == set->size) {
+            cap = set->size ? set->size * 2 : 256;
+            if (!(tags = (struct oldtag *) sqlite3_realloc64(set->tags, cap * sizeof(*tags))))
+                break;
+            set->tags = tags;
+            set->size = cap;
+        }
+        for (len = col = 0; col < (int) (sizeof(sigcols) / sizeof(*sigcols)); col++) {
+            if (sigcol(set, &len, (const char *) sqlite3_column_text(stmt, col + 1)) != 0)
+                break;
+            if (col == SIG_KEYS - 1)
+                keylen = len;
+        }
+        if (col < (int) (sizeof(sigcols) / sizeof(*sigcols)))
+            break;
+        old = &set->tags[set->count++];
+        old->rowid = sqlite3_column_int64(stmt, 0);
+        old->sig = set->textlen;
+        old->len = len;
+        old->keylen = keylen;
+        old->hash = sighash(set->text + set->textlen, len);
+        old->keyhash = sighash(set->text + set->textlen, keylen);
+        old->used = 0;
+        set->textlen += len;
+    }
+
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE)
+        return -1;
+
+    // 行数已知，散列表一次建好；按读取顺序头插，同一链表中行号小的在前
+    for (cap = 256; cap < set->count * 2; cap *= 2);
+    if (cap > set->cap) {
+        if (!(buckets = (uint32_t *) sqlite3_realloc64(set->hash, cap * sizeof(*buckets))))
+            return -1;
+        set->hash = buckets;
+        if (!(buckets = (uint32_t *) sqlite3_realloc64(set->keys, cap * sizeof(*buckets))))
+            return -1;
+        set->keys = buckets;
+        set->cap = cap;
+    }
+    memset(set->hash, 0, set->cap * sizeof(*set->hash));
+    memset(set->keys, 0, set->cap * sizeof(*set->keys));
+
+    for (idx = 0; idx < set->count; idx++) {
+        old = &set->tags[idx];
+        old->nexthash = set->hash[old->hash & (set->cap - 1)];
+        set->hash[old->hash & (set->cap - 1)] = idx + 1;
+        old->nextkey = set->keys[old->keyhash & (set->cap - 1)];
+        set->keys[old->keyhash & (set->cap - 1)] = idx + 1;
+    }
+
+    // 预读原有的行，内容不变的行沿用原来的id，tag的cid才能与原有的行相同
+    stmt = db->stmt[DBOP_OLDCODES];
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, fid);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        id = sqlite3_column_int64(stmt, 0);
+        pattern = (const char *) sqlite3_column_text(stmt, 1);
+        compact = (const char *) sqlite3_column_text(stmt, 2);
+        if (id > db->codes.last)
+            db->codes.last = id;
+        if (!pattern || !compact)
+            continue;
+        hash = dicthash(pattern) * 31 + dicthash(compact);
+        if (!(slot = codeslot(&db->codes, hash, pattern, compact)) ||
+            (!slot->id && codeput(&db->codes, slot, hash, id, pattern, compact) != 0))
+            break;
+    }
+
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        dropcodes(&db->codes);
+        dropolds(set);
+        return -1;
+    }
+
+    db->codes.fid = fid;
+    set->fid = fid;
+
+    return 0;
+}
+
+/**
+ * 写入重新解析的文件与原有内容的差异：删除没有用到的原有tag、code表中的行和不再出现的trigram
+ * @param db 数据库句柄
+ * @return   成功返回0，否则返回非0
+ */
+static int flushtags(db_t db)
+{
+    int rc = SQLITE_DONE;
+    uint32_t idx, count = 0, size = 0, gram, *grams = NULL, *tmp;
+    struct oldset *set = &db->olds;
+    struct codeset *codes = &db->codes;
+    sqlite3_stmt *stmt;
+
+    if (!set->fid)
+        return 0;
+
+    stmt = db->stmt[DBOP_DELTAG];
+    for (idx = 0; idx < set->count && rc == SQLITE_DONE; idx++) {
+        if (!set->tags[idx].used) {
+            sqlite3_reset(stmt);
+            sqlite3_bind_int64(stmt, 1, set->tags[idx].rowid);
+            rc = sqlite3_step(stmt);
+        }
+    }
+
+    stmt = db->stmt[DBOP_DELCODE];
+    for (idx = 0; codes->fid == set->fid && idx < codes->size && rc == SQLITE_DONE; idx++) {
+        if (codes->slots[idx].id && !codes->slots[idx].used) {
+            sqlite3_reset(stmt);
+            sqlite3_bind_int64(stmt, 1, set->fid);
+            sqlite3_bind_int64(stmt, 2, codes->slots[idx].id);
+            rc = sqlite3_step(stmt);
+        }
+    }
+
+    // 原有的trigram先全部读出再删除，读取过程中不修改gram表；新的trigram由flushgrams写入
+    stmt = db->stmt[DBOP_OLDGRAMS];
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, set->fid);
+    while (rc == SQLITE_DONE && sqlite3_step(stmt) == SQLITE_ROW) {
+        gram = (uint32_t) sqlite3_column_int64(stmt, 0);
+        if (db->grams.fid == set->fid && hasgram(&db->grams, gram))
+            continue;
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            if (!(tmp = (uint32_t *) sqlite3_realloc64(grams, size * sizeof(*grams)))) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            grams = tmp;
+        }
+        grams[count++] = gram;
+    }
+    sqlite3_reset(stmt);
+
+    stmt = db->stmt[DBOP_DELGRAM];
+    for (idx = 0; idx < count && rc == SQLITE_DONE; idx++) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, grams[idx]);
+        sqlite3_bind_int64(stmt, 2, set->fid);
+        rc = sqlite3_step(stmt);
+    }
+
+    sqlite3_free(grams);
+    dropolds(set);
+
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 读取游标当前行的pattern或compact，同一行的两列只读取一次code表
+ * @param cur     游标
+ * @param compact 非0读取compact，否则读取pattern
+ * @return        文本，不存在时返回NULL
+ */
+static const char *codetext(cursor_t cur, int compact)
+{
+    int64_t fid = sqlite3_column_int64(cur->stmt, FIELD_MAX);
+    int64_t cid = sqlite3_column_int64(cur->stmt, FIELD_IDX_PATTERN);
+    sqlite3_stmt *stmt = cur->db->stmt[DBOP_GETCODE];
+
+    if (!cur->code || cur->fid != fid || cur->cid != cid) {
+        sqlite3_free(cur->code);
+        cur->code = NULL;
+        sqlite3_bind_int64(stmt, 1, fid);
+        sqlite3_bind_int64(stmt, 2, cid);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            cur->code = sqlite3_mprintf("%s%c%s", sqlite3_column_text(stmt, 0), 0, sqlite3_column_text(stmt, 1));
+        sqlite3_reset(stmt);
+        cur->fid = fid;
+        cur->cid = cid;
+    }
+
+    if (!cur->code)
+        return NULL;
+
+    return compact ? cur->code + strlen(cur->code) + 1 : cur->code;
+}
+
+/**
+ * 获取文件的显示路径，设置了视图目录时为相对视图目录的转义路径，否则为绝对路径
+ * 同一文件只在第一次出现时转换，之后查缓存
+ * @param db  数据库句柄
+ * @param fid 文件id
+ * @param key file表中的键
+ * @return    显示路径，失败返回NULL
+ */
+static const char *showpath(db_t db, int64_t fid, const char *key)
+{
+    char *show;
+    struct pathcache *item;
+    char tmp[PATH_MAX + 1] = {0};
+    char rel[PATH_MAX * 2 + 1] = {0};
+    char buf[(PATH_MAX + 1) * 3] = {0};
+
+    if (!key)
+        return NULL;
+
+    item = &db->cache[fid & (PATHCACHE_SIZE - 1)];
+    if (item->key && item->fid == fid && strcmp(item->key, key) == 0)
+        return item->show;
+
+    if (!normpath(db->path, key, tmp))
+        return NULL;
+
+    show = db->view ? pathescape(relpath(db->view, tmp, rel), buf) : tmp;
+    if (!show || !(show = sqlite3_mprintf("%s%c%s", key, 0, show)))
+        return NULL;
+
+    sqlite3_free(item->key);
+    item->fid = fid;
+    item->key = show;
+    item->show = show + strlen(show) + 1;
+
+    return item->show;
+}
+
+/**
+ * 清空路径缓存
+ * @param db 数据库句柄
+ */
+static void clearcache(db_t db)
+{
+    for (int idx = 0; idx < PATHCACHE_SIZE; idx++) {
+        sqlite3_free(db->cache[idx].key);
+        db->cache[idx].key = NULL;
+    }
+}
+
+/**
+ * 创建游标
+ * @param db      数据库句柄
+ * @param mode    数据库模式
+ * @param stmt    查询语句
+ * @param owned   游标结束时是否释放查询语句，否则仅重置
+ * @param pathcol 路径所在列，文件id在最后一列
+ * @param tags    是否为tags查询，其dict列需转换为文本
+ * @return        创建成功返回游标，否则返回NULL
+ */
+static cursor_t dbcursor(db_t db, unsigned char mode, sqlite3_stmt *stmt, int owned, int pathcol, int tags)
+{
+    cursor_t cur;
+
+    assert(db && db->db3 && stmt);
+
+    if (!(cur = (cursor_t) sqlite3_malloc(sizeof(*cur)))) {
+        if (owned)
+            sqlite3_finalize(stmt);
+        return NULL;
+    }
+
+    // 自定义函数在sqlite3_step时读取模式
+    db->mode = mode;
+
+    cur->db = db;
+    cur->stmt = stmt;
+    cur->owned = owned;
+    cur->pathcol = pathcol;
+    cur->tags = tags;
+    cur->held = 0;
+    cur->code = NULL;
+
+    return cur;
+}
+
+/**
+ * 开始新的事务
+ * @param db 数据库句柄
+ * @return   事务开始成功返回0，否则返回非0
+ */
+int dbbegin(db_t db)
+{
+    assert(db && db->db3);
+    return sqlite3_exec(db->db3, "BEGIN;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 提交由dbbegin开始的事务
+ * @param db 数据库句柄
+ * @return   提交成功返回0，否则返回非0
+ */
+int dbcommit(db_t db)
+{
+    assert(db && db->db3);
+
+    if (flushtags(db) != 0)
+        return -1;
+
+    dropcodes(&db->codes);
+
+    if (flushgrams(db) != 0 || sqlite3_exec(db->db3, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+        return -1;
+
+    db->dict.added = 0;
+
+    return 0;
+}
+
+/**
+ * 回滚由dbbegin开始的事务
+ * @param db 数据库句柄
+ * @return   回滚成功返回0，否则返回非0
+ */
+int dbrollback(db_t db)
+{
+    assert(db && db->db3);
+    dropolds(&db->olds);
+    dropgrams(db);
+    dropcodes(&db->codes);
+    if (db->dict.added)
+        dictdrop(&db->dict);
+    return sqlite3_exec(db->db3, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 在当前事务中设置保存点，没有进行中的事务时会开始新的事务
+ * @param db 数据库句柄
+ * @return   设置成功返回0，否则返回非0
+ */
+int dbsavepoint(db_t db)
+{
+    assert(db && db->db3);
+    return sqlite3_exec(db->db3, "SAVEPOINT file;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 释放由dbsavepoint设置的保存点，保留其后的修改
+ * @param db 数据库句柄
+ * @return   释放成功返回0，否则返回非0
+ */
+int dbrelease(db_t db)
+{
+    assert(db && db->db3);
+    // 写入失败时撤销到保存点，否则保存点一直未释放
+    if (flushtags(db) != 0 || flushgrams(db) != 0) {
+        dbrevert(db);
+        return -1;
+    }
+    dropcodes(&db->codes);
+    return sqlite3_exec(db->db3, "RELEASE file;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 撤销由dbsavepoint设置的保存点之后的修改，并释放该保存点
+ * @param db 数据库句柄
+ * @return   撤销成功返回0，否则返回非0
+ */
+int dbrevert(db_t db)
+{
+    assert(db && db->db3);
+    dropolds(&db->olds);
+    dropgrams(db);
+    dropcodes(&db->codes);
+    if (db->dict.added)
+        dictdrop(&db->dict);
+    return sqlite3_exec(db->db3, "ROLLBACK TO file; RELEASE file;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 遍历所有文件
+ * @param db   数据库句柄
+ * @param func 查找到文件时的回调函数，参数为此文件相关属性
+ * @param ctx  回调函数上下文
+ * @return     遍历成功返回0，否则返回非0
+ */
+int dballfile(db_t db, void (*func)(int64_t fid, const char *path, int64_t size, int64_t time, void *ctx), void *ctx)
+{
+    int rc;
+    int64_t fid, size, time;
+    const unsigned char *path;
+
+    assert(db && db->stmt[DBOP_ALLFILE]);
+
+    sqlite3_reset(db->stmt[DBOP_ALLFILE]);
+
+    while ((rc = sqlite3_step(db->stmt[DBOP_ALLFILE])) == SQLITE_ROW) {
+        fid = sqlite3_column_int64(db->stmt[DBOP_ALLFILE], 0);
+        path = sqlite3_column_text(db->stmt[DBOP_ALLFILE], 1);
+        size = sqlite3_column_int64(db->stmt[DBOP_ALLFILE], 2);
+        time = sqlite3_column_int64(db->stmt[DBOP_ALLFILE], 3);
+        func(fid, (char *) path, size, time, ctx);
+    }
+
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 获取文件属性
+ * @param db   数据库句柄
+ * @param path 文件绝对路径
+ * @param size 返回的文件字节数
+ * @param time 返回的文件修改时间
+ * @return     获取成功返回0，否则返回非0
+ */
+int64_t dbgetfile(db_t db, const char *path, int64_t *size, int64_t *time, int64_t *hash)
+{
+    int64_t id = 0;
+    char buf[PATH_MAX * 2 + 1] = {0};
+
+    assert(db && db->db3 && db->stmt[DBOP_GETFILE] && path);
+
+    if (!pathkey(db, path, buf))
+        return -1;
+
+    sqlite3_reset(db->stmt[DBOP_GETFILE]);
+
+    sqlite3_bind_text(db->stmt[DBOP_GETFILE], 1, buf, -1, NULL);
+
+    if (sqlite3_step(db->stmt[DBOP_GETFILE]) == SQLITE_ROW) {
+        id = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 0);
+        if (size)
+            *size = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 1);
+        if (time)
+            *time = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 2);
+        if (hash)
+            *hash = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 3);
+    }
+
+    return id;
+}
+
+/**
+ * 添加或修改文件属性信息，已有的文件保留id并读入其原有的tag，之后添加的tag与之比较
+ * @param db   数据库句柄
+ * @param path 文件绝对路径
+ * @param size 文件字节数
+ * @param time 文件修改时间
+ * @param hash 文件内容哈希，0表示未知
+ * @return     设置成功返回文件id，否则返回0或-1
+ */
+int64_t dbsetfile(db_t db, const char *path, int64_t size, int64_t time, int64_t hash)
+{
+    int64_t fid = 0;
+    char buf[PATH_MAX * 2 + 1] = {0};
+    sqlite3_stmt *stmt;
+
+    assert(db && db->db3 && db->stmt[DBOP_SETFILE] && path);
+
+    if (flushtags(db) != 0 || !pathkey(db, path, buf))
+        return -1;
+
+    // 批量导入时库中没有已有的文件
+    if (!(db->mode & DB_BULK)) {
+        sqlite3_reset(db->stmt[DBOP_GETFILE]);
+        sqlite3_bind_text(db->stmt[DBOP_GETFILE], 1, buf, -1, NULL);
+        if (sqlite3_step(db->stmt[DBOP_GETFILE]) == SQLITE_ROW)
+            fid = sqlite3_column_int64(db->stmt[DBOP_GETFILE], 0);
+        sqlite3_reset(db->stmt[DBOP_GETFILE]);
+    }
+
+    stmt = db->stmt[fid ? DBOP_UPDFILE : DBOP_SETFILE];
+
+    sqlite3_reset(stmt);
+
+    sqlite3_bind_text(stmt, 1, buf, -1, NULL);
+    sqlite3_bind_int64(stmt, 2, size);
+    sqlite3_bind_int64(stmt, 3, time);
+    sqlite3_bind_int64(stmt, 4, hash);
+
+    if (fid)
+        sqlite3_bind_int64(stmt, 5, fid);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sqlite3_reset(stmt);
+        return 0;
+    }
+
+    sqlite3_reset(stmt);
+
+    if (!fid)
+        return sqlite3_last_insert_rowid(db->db3);
+
+    return loadfile(db, fid) == 0 ? fid : 0;
+}
+
+/**
+ * 只更新文件的修改时间，用于内容未变的文件
+ * @param db   数据库句柄
+ * @param fid  文件id
+ * @param time 文件修改时间
+ * @return     更新成功返回0，否则返回非0
+ */
+int dbsettime(db_t db, int64_t fid, int64_t time)
+{
+    assert(db && db->stmt[DBOP_SETTIME]);
+
+    sqlite3_reset(db->stmt[DBOP_SETTIME]);
+
+    sqlite3_bind_int64(db->stmt[DBOP_SETTIME], 1, time);
+    sqlite3_bind_int64(db->stmt[DBOP_SETTIME], 2, fid);
+
+    return sqlite3_step(db->stmt[DBOP_SETTIME]) == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 从数据库中删除文件（文件里的tags也会清除）
+ * @param db   数据库句柄
+ * @param path 文件绝对路径
+ * @return     删除成功返回0，否则返回非0
+ */
+int dbdelfile(db_t db, const char *path)
+{
+    char buf[PATH_MAX * 2 + 1] = {0};
+
+    assert(db && db->stmt[DBOP_DELFILE] && path);
+
+    if (!pathkey(db, path, buf))
+        return -1;
+
+    sqlite3_reset(db->stmt[DBOP_DELFILE]);
+
+    sqlite3_bind_text(db->stmt[DBOP_DELFILE], 1, buf, -1, NULL);
+
+    return sqlite3_step(db->stmt[DBOP_DELFILE]) == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 按id批量删除文件（文件里的tags也会清除）
+ * @param db    数据库句柄
+ * @param fids  文件id
+ * @param count 文件个数
+ * @return      删除成功返回0，否则返回非0
+ */
+int dbdelfiles(db_t db, const int64_t fids[], int count)
+{
+    int rc, idx;
+    sqlite3_stmt *stmt = NULL;
+
+    assert(db && db->db3 && (fids || count == 0));
+
+    if (count <= 0)
+        return 0;
+
+    // 先把id写入临时表，再用一条DELETE删除，避免逐条删除时反复级联查找tag
+    if (sqlite3_exec(db->db3, "SAVEPOINT gone;" SQL_GONE, NULL, NULL, NULL) != SQLITE_OK)
+        return -1;
+
+    rc = sqlite3_prepare_v2(db->db3, SQL_ADDGONE, -1, &stmt, NULL);
+
+    for (idx = 0; rc == SQLITE_OK && idx < count; idx++) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, fids[idx]);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_OK)
+        rc = sqlite3_exec(db->db3, SQL_DELGONE "DELETE FROM temp.gone; RELEASE gone;", NULL, NULL, NULL);
+
+    if (rc != SQLITE_OK)
+        sqlite3_exec(db->db3, "ROLLBACK TO gone; RELEASE gone;", NULL, NULL, NULL);
+
+    return rc == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 从数据库中删除目录下的所有文件（文件里的tags也会清除）
+ * 目录下的键都以“目录键/”开头，按键的范围删除，可以使用file表的唯一索引
+ * @param db   数据库句柄
+ * @param path 目录绝对路径
+ * @return     删除成功返回0，否则返回非0
+ */
+int dbdeldir(db_t db, const char *path)
+{
+    size_t len;
+    char buf[PATH_MAX * 2 + 2] = {0};
+
+    assert(db && db->stmt[DBOP_DELDIR] && path);
+
+    if (!pathkey(db, path, buf) || strcmp(buf, ".") == 0)
+        return -1;
+
+    // [键/, 键0)恰好是以“键/”开头的全部键，'0'是PATHSEP的下一个字符
+    len = strlen(buf);
+
+    sqlite3_reset(db->stmt[DBOP_DELDIR]);
+
+    buf[len] = PATHSEP[0];
+    sqlite3_bind_text(db->stmt[DBOP_DELDIR], 1, buf, len + 1, SQLITE_TRANSIENT);
+    buf[len] = PATHSEP[0] + 1;
+    sqlite3_bind_text(db->stmt[DBOP_DELDIR], 2, buf, len + 1, SQLITE_TRANSIENT);
+
+    return sqlite3_step(db->stmt[DBOP_DELDIR]) == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 向数据库添加一条tag
+ * @param db     数据库句柄
+ * @param fid    待添加的tag所属的文件id
+ * @param func   包含此tag的最内层函数的起始行，不在函数中时为0
+ * @param fields tag内容，用户必须保证以NULL结尾
+ * @return       添加成功返回0，否则返回非0
+ */
+int dbaddatag(db_t db, int64_t fid, int64_t func, char *const *fields)
+{
+    int idx, col;
+    size_t len = 0, keylen = 0;
+    int64_t word, cid = 0, nums[TAGCOL_MAX] = {0};
+    const char *item, *pattern, *compact, *texts[TAGCOL_MAX] = {0};
+    char num[32];
+    struct oldtag *old = NULL;
+    sqlite3_stmt *stmt = db->stmt[DBOP_ADDTAGS];
+
+    assert(db && db->stmt[DBOP_ADDTAGS] && fields);
+
+    // 切换到新文件时先写入上一个文件的差异和trigram
+    if (fid != db->grams.fid) {
+        if ((db->olds.fid && db->olds.fid != fid && flushtags(db) != 0) || flushgrams(db) != 0)
+            return -1;
+        db->grams.fid = fid;
+    }
+
+    // 先求出各列的值，texts为NULL的列写入NULL，为空串的列写入nums中的整数
+    for (idx = 0; idx < FIELD_MAX; idx++) {
+        if (db->slots[idx] <= 0)
+            continue;
+        item = fields[idx] && strcmp(fields[idx], "-") != 0 ? fields[idx] : "";
+        if (idx == FIELD_IDX_LINE || idx == FIELD_IDX_ENDL)
+            nums[idx] = strtoll(item, NULL, 10), texts[idx] = "";
+        else if (*item == '\0' || (dictcol[idx] && (word = wordid(db, item)) <= 0))
+            continue;
+        else if (dictcol[idx])
+            nums[idx] = word, texts[idx] = "";
+        else {
+            texts[idx] = item;
+            if (idx == FIELD_IDX_NAME)
+                addgrams(&db->grams, item);
+        }
+    }
+
+    // pattern和compact按行去重后保存在code表中，缺少任一项时cid为NULL，与原来的NOT NULL约束一致
+    pattern = fields[FIELD_IDX_PATTERN];
+    compact = fields[FIELD_IDX_COMPACT];
+    if (pattern && *pattern && strcmp(pattern, "-") != 0 && compact && *compact && strcmp(compact, "-") != 0)
+        cid = codeid(db, fid, pattern, compact);
+
+    if (cid > 0)
+        nums[TAGCOL_CID] = cid, texts[TAGCOL_CID] = "";
+    nums[TAGCOL_FUNC] = func, texts[TAGCOL_FUNC] = "";
+
+    // 重新解析的文件：内容相同的原有tag保持不动，键相同的原有tag就地更新，其余插入
+    if (db->olds.fid == fid && db->olds.count) {
+        for (col = 0; col < (int) (sizeof(sigcols) / sizeof(*sigcols)); col++) {
+            idx = sigcols[col];
+            if (texts[idx] && !*texts[idx])
+                sqlite3_snprintf(sizeof(num), num, "%lld", (sqlite3_int64) nums[idx]);
+            if (sigcol(&db->olds, &len, !texts[idx] ? NULL : *texts[idx] ? texts[idx] : num) != 0)
+                return -1;
+            if (col == SIG_KEYS - 1)
+                keylen = len;
+        }
+        if ((old = findold(&db->olds, len, 0))) {
+            old->used = 1;
+            return 0;
+        }
+        if ((old = findold(&db->olds, keylen, 1))) {
+            old->used = 1;
+            stmt = db->stmt[DBOP_UPDTAGS];
+        }
+    }
+
+    sqlite3_reset(stmt);
+
+    if (old)
+        sqlite3_bind_int64(stmt, db->rowslot, old->rowid);
+
+    sqlite3_bind_int64(stmt, db->fidslot, fid);
+
+    // 字段值在调用者的缓冲区中，执行完成前不会改变，无需复制
+    for (idx = 0; idx < TAGCOL_MAX; idx++) {
+        col = idx == TAGCOL_CID ? db->cidslot : idx == TAGCOL_FUNC ? db->funcslot : db->slots[idx];
+        if (col <= 0)
+            continue;
+        if (!texts[idx])
+            sqlite3_bind_null(stmt, col);
+        else if (!*texts[idx])
+            sqlite3_bind_int64(stmt, col, nums[idx]);
+        else
+            sqlite3_bind_text(stmt, col, texts[idx], -1, SQLITE_STATIC);
+    }
+
+    return sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 读取不同操作码对应的tags
+ * @param db      数据库句柄
+ * @param mode    数据库模式
+ * @param opcode  查找操作码
+ * @param pattern 对应操作码的模式
+ * @return        查找成功返回游标，否则返回NULL
+ */
+cursor_t dbreadtags(db_t db, unsigned char mode, unsigned char opcode, const char *pattern)
+{
+    int cnt = 0, owned = 0;
+    uint32_t grams[GRAM_MAX];
+    sqlite3_stmt *stmt;
+
+    assert(((QUERY_SYMBOL <= opcode && opcode <= QUERY_ASSIGN) || opcode == QUERY_CALLERS || opcode == QUERY_CALLEES) &&
+           db && db->stmt[opcode] && pattern);
+
+    char lo[strlen(pattern) + 1], hi[strlen(pattern) + 1];
+
+    if (db->range[opcode] && namerange(mode, pattern, lo, hi)) {
+        stmt = db->range[opcode];
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 2, lo, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, hi, -1, SQLITE_TRANSIENT);
+    } else if (db->trigram && gramsql[opcode] && (cnt = patgrams(mode, pattern, grams, GRAM_MAX)) > 0 &&
+               (stmt = gramstmt(db, opcode, grams, cnt))) {
+        owned = 1;
+    } else {
+        stmt = db->stmt[opcode];
+        sqlite3_reset(stmt);
+    }
+
+    // 游标存续期间pattern可能已失效，需要复制
+    sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
+
+    if (opcode == QUERY_CALLERS || opcode == QUERY_CALLEES)
+        sqlite3_bind_int(stmt, 4, db->depth);
+
+    return dbcursor(db, mode, stmt, owned, FIELD_IDX_PATH, 1);
+}
+
+/**
+ * 根据路径模式查找文件路径
+ * @param db      数据库句柄
+ * @param mode    数据库模式
+ * @param pattern 查找模式
+ * @return        查找成功返回游标，否则返回NULL
+ */
+cursor_t dbfindpath(db_t db, unsigned char mode, const char *pattern)
+{
+    assert(db && db->stmt[QUERY_FPATH] && pattern);
+
+    sqlite3_reset(db->stmt[QUERY_FPATH]);
+    sqlite3_bind_text(db->stmt[QUERY_FPATH], 1, pattern, -1, SQLITE_TRANSIENT);
+
+    return dbcursor(db, mode, db->stmt[QUERY_FPATH], 0, 0, 0);
+}
+
+/**
+ * 根据where参数查找tags
+ * @param db    数据库句柄
+ * @param mode  数据库模式
+ * @param where 查询条件
+ * @return      查找成功返回游标，否则返回NULL
+ */
+cursor_t dbfindtags(db_t db, unsigned char mode, const char *where)
+{
+    char *sql;
+    sqlite3_stmt *stmt = NULL;
+
+    assert(db && db->db3 && where);
+
+    // 条件作用于SQL_TAGTEXT，其中的dict列已是文本，游标原样输出
+    if ((sql = sqlite3_mprintf(SQL_QUERYFROM(SQL_TAGTEXT) "WHERE %s " SQL_TEXTSORT, where))) {
+        if (sqlite3_prepare_v2(db->db3, sql, -1, &stmt, NULL) != SQLITE_OK && stmt)
+            stmt = (sqlite3_finalize(stmt), NULL);
+        sqlite3_free(sql);
+    }
+
+    return stmt ? dbcursor(db, mode, stmt, 1, FIELD_IDX_PATH, 1) : NULL;
+}
+
+/**
+ * 统计游标的结果行数，在游标读取第一行之前调用；以绑定参数后的语句为子查询执行COUNT(*)，不读取各列
+ * 计数前设置保存点，在dbfinish之前其他连接提交的修改不可见，行数与之后读取的行一致
+ * @param cur 游标
+ * @return    成功返回行数，否则返回-1
+ */
+int64_t dbcount(cursor_t cur)
+{
+    int64_t rows = -1;
+    size_t len;
+    char *text, *sql = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    assert(cur && cur->stmt);
+
+    if (!(text = sqlite3_expanded_sql(cur->stmt)))
+        return -1;
+
+    // 不在事务中时保存点开始一个事务，第一次读取时取得共享锁，直到释放保存点
+    if (!cur->held) {
+        if (sqlite3_exec(cur->db->db3, "SAVEPOINT query;", NULL, NULL, NULL) != SQLITE_OK) {
+            sqlite3_free(text);
+            return -1;
+        }
+        cur->held = 1;
+    }
+
+    for (len = strlen(text); len > 0 && (text[len - 1] == ';' || isspace((unsigned char) text[len - 1])); len--);
+
+    if ((sql = sqlite3_mprintf("SELECT count(*) FROM (%.*s);", (int) len, text)) &&
+        sqlite3_prepare_v2(cur->db->db3, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        rows = sqlite3_column_int64(stmt, 0);
+
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    sqlite3_free(text);
+
+    return rows;
+}
+
+/**
+ * 读取游标的下一行
+ * @param cur 游标
+ * @return    读到一行返回1，没有更多行返回0，出错返回-1
+ */
+int dbstep(cursor_t cur)
+{
+    int rc;
+
+    assert(cur && cur->stmt);
+
+    rc = sqlite3_step(cur->stmt);
+
+    return rc == SQLITE_ROW ? 1 : rc == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * 获取游标当前行指定列的文本，读取下一行或结束游标后失效
+ * 路径列返回显示路径，参见dbview
+ * @param cur 游标
+ * @param col 列号，tags查询为FIELD_IDX_*，路径查询为0
+ * @return    列的文本，列值为NULL或列号越界时返回NULL
+ */
+const char *dbcoltext(cursor_t cur, int col)
+{
+    assert(cur && cur->stmt);
+
+    if (col == cur->pathcol)
+        return showpath(cur->db, sqlite3_column_int64(cur->stmt, sqlite3_column_count(cur->stmt) - 1),
+                        (const char *) sqlite3_column_text(cur->stmt, col));
+
+    if (cur->tags && (col == FIELD_IDX_PATTERN || col == FIELD_IDX_COMPACT))
+        return codetext(cur, col == FIELD_IDX_COMPACT);
+
+    // dict列值为NULL时无需查询
+    if (cur->tags && col < FIELD_MAX && dictcol[col] && sqlite3_column_type(cur->stmt, col) == SQLITE_INTEGER)
+        return wordtext(cur->db, sqlite3_column_int64(cur->stmt, col));
+
+    return col < sqlite3_column_count(cur->stmt) ? (const char *) sqlite3_column_text(cur->stmt, col) : NULL;
+}
+
+/**
+ * 获取游标当前行指定列的整数值
+ * @param cur 游标
+ * @param col 列号，tags查询为FIELD_IDX_*，路径查询为0
+ * @return    列的整数值，列值为NULL或列号越界时返回0
+ */
+int64_t dbcolint(cursor_t cur, int col)
+{
+    assert(cur && cur->stmt);
+    return col < sqlite3_column_count(cur->stmt) ? sqlite3_column_int64(cur->stmt, col) : 0;
+}
+
+/**
+ * 结束由dbreadtags/dbfindpath/dbfindtags返回的游标
+ * @param cur 游标
+ */
+void dbfinish(cursor_t cur)
+{
+    assert(cur && cur->stmt);
+
+    if (cur->owned)
+        sqlite3_finalize(cur->stmt);
+    else {
+        sqlite3_reset(cur->stmt);
+        sqlite3_clear_bindings(cur->stmt);
+    }
+
+    if (cur->held)
+        sqlite3_exec(cur->db->db3, "RELEASE query;", NULL, NULL, NULL);
+
+    sqlite3_free(cur->code);
+    sqlite3_free(cur);
+}
+
+/**
+ * 设置查询结果中路径的视图目录，之后路径列返回相对此目录的转义路径
+ * @param db  数据库句柄
+ * @param dir 视图目录绝对路径，NULL表示返回绝对路径
+ * @return    设置成功返回0，否则返回非0
+ */
+int dbview(db_t db, const char *dir)
+{
+    assert(db);
+
+    clearcache(db);
+    sqlite3_free(db->view);
+
+    db->view = dir ? sqlite3_mprintf("%s", dir) : NULL;
+
+    return !dir || db->view ? 0 : -1;
+}
+
+/**
+ * 设置调用图查询扩展的层数
+ * @param db    数据库句柄
+ * @param depth 层数，至少为1
+ * @return      设置成功返回0，否则返回非0
+ */
+int dbdepth(db_t db, int depth)
+{
+    assert(db);
+
+    if (depth < 1)
+        return -1;
+
+    db->depth = depth;
+
+    return 0;
+}
+
+/**
+ * 获取SQLite的内存使用和连接的页缓存统计，db为NULL时只获取内存使用
+ * @param db 数据库句柄
+ * @param st 返回统计结果
+ * @return   成功返回0，否则返回非0
+ */
+int dbstatus(db_t db, struct dbstat *st)
+{
+    int cur, high;
+    sqlite3_int64 cur64, high64;
+
+    if (!st)
+        return -1;
+
+    memset(st, 0, sizeof(*st));
+
+    if (sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur64, &high64, 0) != SQLITE_OK)
+        return -1;
+    st->memused = cur64;
+    st->memhigh = high64;
+
+    if (sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &cur64, &high64, 0) == SQLITE_OK)
+        st->mallocs = cur64;
+
+    if (!db)
+        return 0;
+
+    if (sqlite3_db_status(db->db3, SQLITE_DBSTATUS_CACHE_USED, &cur, &high, 0) == SQLITE_OK)
+        st->cacheused = cur;
+    if (sqlite3_db_status(db->db3, SQLITE_DBSTATUS_CACHE_HIT, &cur, &high, 0) == SQLITE_OK)
+        st->cachehit = cur;
+    if (sqlite3_db_status(db->db3, SQLITE_DBSTATUS_CACHE_MISS, &cur, &high, 0) == SQLITE_OK)
+        st->cachemiss = cur;
+    if (sqlite3_db_status(db->db3, SQLITE_DBSTATUS_CACHE_WRITE, &cur, &high, 0) == SQLITE_OK)
+        st->cachewrite = cur;
+    if (sqlite3_db_status(db->db3, SQLITE_DBSTATUS_STMT_USED, &cur, &high, 0) == SQLITE_OK)
+        st->stmtused = cur;
+
+    return 0;
+}
+
+/**
+ * 为旧版本数据库增加列（如file表的hash列），须在预编译语句之前完成
+ * @param db  数据库句柄
+ * @param has 检查列是否存在的语句
+ * @param add 增加列的语句
+ * @return    成功返回0，否则返回非0
+ */
+static int addcolumn(db_t db, const char *has, const char *add)
+{
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db->db3, has, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+
+    return sqlite3_exec(db->db3, add, NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * 重建旧版本数据库的tag表：取值较少的列换成dict表中的id，pattern和compact按行去重后移入code表
+ * tag表的列改变后预编译语句才能通过，须在预编译语句之前完成；只读连接无法重建，须先以读写方式打开一次
+ * @param db 数据库句柄
+ * @return   成功返回0，否则返回非0
+ */
+static int retag(db_t db)
+{
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db->db3, SQL_HASCID, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+
+    if (dbbegin(db) != 0)
+        return -1;
+
+    if (sqlite3_exec(db->db3, SQL_RETAG, NULL, NULL, NULL) != SQLITE_OK) {
+        dbrollback(db);
+        return -1;
+    }
+
+    return dbcommit(db);
+}
+
+/**
+ * 升级旧版本数据库：为已有tags建立gram表，求出func列
+ * 升级失败（如数据库只读）时查询不使用gram表
+ * @param db 数据库句柄
+ * @return   升级成功返回0，否则返回非0
+ */
+static int upgrade(db_t db)
+{
+    int rc, version = 0;
+    char sql[64];
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db->db3, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (version >= DB_VERSION)
+        return 0;
+
+    if (sqlite3_db_readonly(db->db3, "main") != 0 || dbbegin(db) != 0)
+        return -1;
+
+    // 版本1增加了gram表，版本2的hash列已由addcolumn添加，版本3、4的tag表已由retag重建，版本5增加了func列
+    if (version >= 1)
+        rc = SQLITE_DONE;
+    else if ((rc = sqlite3_prepare_v2(db->db3, SQL_ALLGRAM, -1, &stmt, NULL)) == SQLITE_OK) {
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (sqlite3_column_int64(stmt, 0) != db->grams.fid) {
+                if (flushgrams(db) != 0)
+                    break;
+                db->grams.fid = sqlite3_column_int64(stmt, 0);
+            }
+            addgrams(&db->grams, (const char *) sqlite3_column_text(stmt, 1));
+            addgrams(&db->grams, (const char *) sqlite3_column_text(stmt, 2));
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (rc == SQLITE_DONE && version < 5 && sqlite3_exec(db->db3, SQL_SETFUNC, NULL, NULL, NULL) != SQLITE_OK)
+        rc = SQLITE_ERROR;
+
+    sqlite3_snprintf(sizeof(sql), sql, "PRAGMA user_version = %d;", DB_VERSION);
+
+    if (rc != SQLITE_DONE || sqlite3_exec(db->db3, sql, NULL, NULL, NULL) != SQLITE_OK) {
+        dbrollback(db);
+        return -1;
+    }
+
+    return dbcommit(db);
+}
+
+/**
+ * 结束批量导入：一次建立导入期间推迟的索引，再检查全部外键，之后恢复外键检查
+ * @param db 以DB_BULK模式打开的数据库句柄
+ * @return   成功返回0，有违反外键的行或建立索引失败返回非0
+ */
+int dbindex(db_t db)
+{
+    int rc;
+    sqlite3_stmt *stmt;
+
+    assert(db && db->db3);
+
+    if (!(db->mode & DB_BULK))
+        return 0;
+
+    if (sqlite3_exec(db->db3, SQL_INDEXES SQL_FUNCINDEX, NULL, NULL, NULL) != SQLITE_OK)
+        return -1;
+
+    if (!sensitivefs)
+        sqlite3_exec(db->db3, SQL_NOCASE, NULL, NULL, NULL);
+
+    if (sqlite3_prepare_v2(db->db3, SQL_FKCHECK, -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE || sqlite3_exec(db->db3, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL) != SQLITE_OK)
+        return -1;
+
+    db->mode &= ~DB_BULK;
+
+    return 0;
 }
 
 /**
  * 打开数据库
+ * 模式包含DB_RDONLY时以只读方式打开已有的数据库，不建表，只能用于查询；
+ * 模式包含DB_BULK时用于向新建的数据库批量导入，结束时须调用dbindex建立索引
  * @param base 打开数据库所处目录
  * @param path 数据库文件路径
  * @param mode 数据库模式
@@ -530,38 +2466,87 @@ db_t dbopen(const char *base, const char *path, unsigned char mode)
 
     memset(db, 0, sizeof(*db));
     db->mode = mode;
+    db->depth = GRAPH_DEPTH;
 
     if (!abspath(NULL, base, db->path) && !getcwd(db->path, sizeof(db->path))) {
         sqlite3_free(db);
         return NULL;
     }
 
-    if (sqlite3_open(path, &db->db3) != SQLITE_OK ||
+    if (sqlite3_open_v2(path, &db->db3, mode & DB_RDONLY ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
         sqlite3_create_function(db->db3, "match", 2, SQLITE_UTF8, &db->mode, strmatch, NULL, NULL) != SQLITE_OK ||
         sqlite3_create_function(db->db3, "regexp", 2, SQLITE_UTF8, &db->mode, strregexp, NULL, NULL) != SQLITE_OK ||
         sqlite3_create_function(db->db3, "abspath", 1, SQLITE_UTF8, db->path, toabspath, NULL, NULL) != SQLITE_OK ||
-        sqlite3_create_function(db->db3, "relpath", 1, SQLITE_UTF8, db->path, torelpath, NULL, NULL) != SQLITE_OK ||
-        sqlite3_exec(db->db3, SQL_INIT, NULL, NULL, NULL) != SQLITE_OK) {
+        (!(mode & DB_RDONLY) && (sqlite3_exec(db->db3, mode & DB_BULK ? SQL_BULKINIT : SQL_INIT, NULL, NULL, NULL) != SQLITE_OK ||
+                                 addcolumn(db, SQL_HASCOL, SQL_ADDCOL) != 0 || retag(db) != 0 ||
+                                 addcolumn(db, SQL_HASFUNC, SQL_ADDFUNC) != 0 ||
+                                 (!(mode & DB_BULK) && sqlite3_exec(db->db3, SQL_FUNCINDEX, NULL, NULL, NULL) != SQLITE_OK)))) {
         sqlite3_close(db->db3);
         sqlite3_free(db);
         return NULL;
     }
 
+    // 已有仅大小写不同的路径时无法建立唯一索引，此时退化为逐行比较
+    if (!sensitivefs && !(mode & (DB_RDONLY | DB_BULK)))
+        sqlite3_exec(db->db3, SQL_NOCASE, NULL, NULL, NULL);
+
+    // 只读连接与其他进程的写入并发，遇到写锁时等待而不是直接失败
+    if (mode & DB_RDONLY)
+        sqlite3_busy_timeout(db->db3, DB_TIMEOUT);
+
     rc = sqlite3_prepare_v2(db->db3, SQL_ADDTAGS, -1, &db->stmt[DBOP_ADDTAGS], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_SYMBOL, -1, &db->stmt[QUERY_SYMBOL], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_DEFINE, -1, &db->stmt[QUERY_DEFINE], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_CALLER, -1, &db->stmt[QUERY_CALLER], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_REFER, -1, &db->stmt[QUERY_REFER], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_STRING, -1, &db->stmt[QUERY_STRING], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_PATTERN, -1, &db->stmt[QUERY_PATTERN], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_SYMBOL(SQL_BYNAME), -1, &db->stmt[QUERY_SYMBOL], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_DEFINE(SQL_BYNAME), -1, &db->stmt[QUERY_DEFINE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_CALLER(SQL_BYNAME), -1, &db->stmt[QUERY_CALLER], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_REFER(SQL_BYNAME), -1, &db->stmt[QUERY_REFER], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_STRING(SQL_BYNAME), -1, &db->stmt[QUERY_STRING], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_PATTERN(SQL_BYTEXT), -1, &db->stmt[QUERY_PATTERN], NULL) |
          sqlite3_prepare_v2(db->db3, SQL_INFILE, -1, &db->stmt[QUERY_INFILE], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_INCLUDE, -1, &db->stmt[QUERY_INCLUDE], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_ASSIGN, -1, &db->stmt[QUERY_ASSIGN], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_INCLUDE(SQL_BYNAME), -1, &db->stmt[QUERY_INCLUDE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_ASSIGN(SQL_BYNAME), -1, &db->stmt[QUERY_ASSIGN], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_SYMBOL(SQL_BYRANGE), -1, &db->range[QUERY_SYMBOL], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_DEFINE(SQL_BYRANGE), -1, &db->range[QUERY_DEFINE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_CALLER(SQL_BYRANGE), -1, &db->range[QUERY_CALLER], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_REFER(SQL_BYRANGE), -1, &db->range[QUERY_REFER], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_STRING(SQL_BYRANGE), -1, &db->range[QUERY_STRING], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_INCLUDE(SQL_BYRANGE), -1, &db->range[QUERY_INCLUDE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_ASSIGN(SQL_BYRANGE), -1, &db->range[QUERY_ASSIGN], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_GRAPH(SQL_BYNAME, "", SQL_CALLERS), -1, &db->stmt[QUERY_CALLERS], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_GRAPH(SQL_BYNAME, "", SQL_CALLEES), -1, &db->stmt[QUERY_CALLEES], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_GRAPH(SQL_BYRANGE, "+", SQL_CALLERS), -1, &db->range[QUERY_CALLERS], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_GRAPH(SQL_BYRANGE, "+", SQL_CALLEES), -1, &db->range[QUERY_CALLEES], NULL) |
          sqlite3_prepare_v2(db->db3, SQL_FPATH, -1, &db->stmt[QUERY_FPATH], NULL) |
          sqlite3_prepare_v2(db->db3, SQL_ALLFILE, -1, &db->stmt[DBOP_ALLFILE], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_GETFILE, -1, &db->stmt[DBOP_GETFILE], NULL) |
+         sqlite3_prepare_v2(db->db3, sensitivefs ? SQL_GETFILE("") : SQL_GETFILE(" COLLATE NOCASE"), -1, &db->stmt[DBOP_GETFILE], NULL) |
          sqlite3_prepare_v2(db->db3, SQL_SETFILE, -1, &db->stmt[DBOP_SETFILE], NULL) |
-         sqlite3_prepare_v2(db->db3, SQL_DELFILE, -1, &db->stmt[DBOP_DELFILE], NULL);
+         sqlite3_prepare_v2(db->db3, SQL_UPDFILE, -1, &db->stmt[DBOP_UPDFILE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_SETTIME, -1, &db->stmt[DBOP_SETTIME], NULL) |
+         sqlite3_prepare_v2(db->db3, sensitivefs ? SQL_DELFILE("") : SQL_DELFILE(" COLLATE NOCASE"), -1, &db->stmt[DBOP_DELFILE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_DELDIR, -1, &db->stmt[DBOP_DELDIR], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_ADDGRAM, -1, &db->stmt[DBOP_ADDGRAM], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_GETDICT, -1, &db->stmt[DBOP_GETDICT], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_FINDDICT, -1, &db->stmt[DBOP_FINDDICT], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_ADDDICT, -1, &db->stmt[DBOP_ADDDICT], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_GETCODE, -1, &db->stmt[DBOP_GETCODE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_LASTCODE, -1, &db->stmt[DBOP_LASTCODE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_ADDCODE, -1, &db->stmt[DBOP_ADDCODE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_UPDTAGS, -1, &db->stmt[DBOP_UPDTAGS], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_OLDTAGS, -1, &db->stmt[DBOP_OLDTAGS], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_OLDCODES, -1, &db->stmt[DBOP_OLDCODES], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_OLDGRAMS, -1, &db->stmt[DBOP_OLDGRAMS], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_DELTAG, -1, &db->stmt[DBOP_DELTAG], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_DELCODE, -1, &db->stmt[DBOP_DELCODE], NULL) |
+         sqlite3_prepare_v2(db->db3, SQL_DELGRAM, -1, &db->stmt[DBOP_DELGRAM], NULL);
+
+    if (rc == SQLITE_OK) {
+        db->fidslot = sqlite3_bind_parameter_index(db->stmt[DBOP_ADDTAGS], "$fid");
+        db->cidslot = sqlite3_bind_parameter_index(db->stmt[DBOP_ADDTAGS], "$cid");
+        db->funcslot = sqlite3_bind_parameter_index(db->stmt[DBOP_ADDTAGS], "$func");
+        db->rowslot = sqlite3_bind_parameter_index(db->stmt[DBOP_UPDTAGS], "$rowid");
+        for (int idx = 0; idx < FIELD_MAX; idx++)
+            db->slots[idx] = bindname[idx] ? sqlite3_bind_parameter_index(db->stmt[DBOP_ADDTAGS], bindname[idx]) : 0;
+        db->trigram = upgrade(db) == 0;
+    }
 
     return rc == SQLITE_OK ? db : (dbclose(db), NULL);
 }
@@ -580,5 +2565,27 @@ int dbclose(db_t db)
             sqlite3_finalize(db->stmt[idx]);
     }
 
-    return sqlite3_close(db->db3) == SQLITE_OK ? (sqlite3_free(db), 0) : -1;
+    for (int idx = 0; idx <= QUERY_CALLEES; idx++) {
+        if (db->range[idx])
+            sqlite3_finalize(db->range[idx]);
+    }
+
+    if (sqlite3_close(db->db3) != SQLITE_OK)
+        return -1;
+
+    clearcache(db);
+    sqlite3_free(db->view);
+    sqlite3_free(db->grams.slots);
+    dropcodes(&db->codes);
+    sqlite3_free(db->codes.slots);
+    sqlite3_free(db->olds.tags);
+    sqlite3_free(db->olds.hash);
+    sqlite3_free(db->olds.keys);
+    sqlite3_free(db->olds.text);
+    dictdrop(&db->dict);
+    sqlite3_free(db->dict.texts);
+    sqlite3_free(db->dict.slots);
+    sqlite3_free(db);
+
+    return 0;
 }
\ No newline at end of file
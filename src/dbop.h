@@ -7,6 +7,11 @@
 #define DB_MATCH                2
 #define DB_REGEX                4
 #define DB_EXREG                8
+#define DB_RDONLY               16
+#define DB_BULK                 32
+
+// 调用图查询默认扩展的层数
+#define GRAPH_DEPTH             3
 
 #define FIELD_STR_PATH          "path"
 #define FIELD_STR_MARK          "mark"
@@ -68,31 +73,75 @@ enum {
     FIELD_MAX
 };
 
+/**
+ * SQLite的内存使用和页缓存统计，缓存命中、未命中和写入为页数
+ */
+struct dbstat {
+    int64_t memused;
+    int64_t memhigh;
+    int64_t mallocs;
+    int64_t cacheused;
+    int64_t cachehit;
+    int64_t cachemiss;
+    int64_t cachewrite;
+    int64_t stmtused;
+};
+
 typedef struct tagDB *db_t;
 
+typedef struct tagCursor *cursor_t;
+
 int dbbegin(db_t db);
 
 int dbcommit(db_t db);
 
 int dbrollback(db_t db);
 
+int dbsavepoint(db_t db);
+
+int dbrelease(db_t db);
+
+int dbrevert(db_t db);
+
 int dballfile(db_t db, void (*func)(int64_t fid, const char *path, int64_t size, int64_t time, void *ctx), void *ctx);
 
-int64_t dbgetfile(db_t db, const char *path, int64_t *size, int64_t *time);
+int64_t dbgetfile(db_t db, const char *path, int64_t *size, int64_t *time, int64_t *hash);
 
-int64_t dbsetfile(db_t db, const char *path, int64_t size, int64_t time);
+int64_t dbsetfile(db_t db, const char *path, int64_t size, int64_t time, int64_t hash);
+
+int dbsettime(db_t db, int64_t fid, int64_t time);
 
 int dbdelfile(db_t db, const char *path);
 
-int dbaddatag(db_t db, int64_t fid, char *const *fields);
+int dbdelfiles(db_t db, const int64_t fids[], int count);
+
+int dbdeldir(db_t db, const char *path);
+
+int dbaddatag(db_t db, int64_t fid, int64_t func, char *const *fields);
+
+cursor_t dbreadtags(db_t db, unsigned char mode, unsigned char opcode, const char *pattern);
+
+cursor_t dbfindpath(db_t db, unsigned char mode, const char *pattern);
+
+cursor_t dbfindtags(db_t db, unsigned char mode, const char *where);
+
+int64_t dbcount(cursor_t cur);
+
+int dbstep(cursor_t cur);
+
+const char *dbcoltext(cursor_t cur, int col);
+
+int64_t dbcolint(cursor_t cur, int col);
+
+void dbfinish(cursor_t cur);
 
-char **dbreadtags(db_t db, unsigned char mode, unsigned char opcode, const char *pattern, int *rows, int *cols);
+int dbview(db_t db, const char *dir);
 
-char **dbfindpath(db_t db, unsigned char mode, const char *pattern, int *rows, int *cols);
+int dbdepth(db_t db, int depth);
 
-char **dbfindtags(db_t db, unsigned char mode, const char *where, int *rows, int *cols);
+int dbindex(db_t db);
 
-void dbfree(char **table);
+int dbstatus(db_t db, struct dbstat *st);
 
 db_t dbopen(const char *base, const char *path, unsigned char mode);
 
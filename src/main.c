@@ -7,10 +7,26 @@
 #include <limits.h>
 #include <getopt.h>
 #include <dirent.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include "path.h"
 #include "task.h"
 #include "dbop.h"
+#include "walk.h"
+#include "sweep.h"
+#include "snap.h"
+#include "watch.h"
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#include <sys/resource.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #define NULLFILE                        "NUL"
@@ -19,8 +35,23 @@
 #endif
 
 #define BUFSIZE                         (PATH_MAX + 16)
+#define READSIZE                        (256 * 1024)
+#define WORKER_DEPTH                    8
+#define GROUP_QUEUE                     64
+#define OUTSIZE                         (64 * 1024)
 
 #define DBNAME                          "tag.db"
+#define SOCKEXT                         ".sock"
+#define BULKEXT                         ".new"
+#define PROMPT                          ">> "
+
+#define BATCH_FILES                     1000
+#define BATCH_TAGS                      100000
+#define BATCH_MSEC                      2000
+#define SERVE_JOBS                      4
+#define WALK_JOBS                       4
+#define WATCH_MSEC                      100
+#define WATCH_MAX                       2000
 
 #define GROUPSEP                        "\x1D"
 #define FIELDSEP                        "\x1E"
@@ -30,6 +61,8 @@
 #define FIELDTXT(k, v)                  FIELDCTX(T, k, v)
 #define GROUPEND                        GROUPSEP "\n"
 
+#define _STR(x)                         #x
+#define STR(x)                          _STR(x)
 #define ch2code(chr)                    (chr - '0' + (chr < '5'))
 #define boolean(str)                    (!str || strcasecmp(str, "yes") == 0 || strcasecmp(str, "true") == 0 || strcasecmp(str, "1") == 0 ? 1 : 0)
 #define echomsg(args...)                fprintf(stdout, PROGRAM_NAME ": " args)
@@ -53,18 +86,43 @@ Option:\n\
   -8PATTERN                    search file including this file.\n\
   -9PATTERN                    search assignment.\n\
   -rPATTERN                    search matched path.\n\
+  --callers=PATTERN            search functions calling the function\n\
+                               transitively.\n\
+  --callees=PATTERN            search functions called by the function\n\
+                               transitively.\n\
+  --depth=N                    expand --callers and --callees to N levels,\n\
+                               default is " STR(GRAPH_DEPTH) ".\n\
   -ePATTERN                    search pattern, using basic regexp.\n\
   -EPATTERN                    search pattern, using advanced regexp.\n\
+                               PATTERN is an SQL condition on tags, language,\n\
+                               roles, kind, access, scopeKind and extras are\n\
+                               compared as text, e.g. \"kind = 'function'\".\n\
   -f FILE                      the path of database file.\n\
   -L FILE                      read file list from the file, if FILE is '-',\n\
                                read stdin instead.\n\
   -o FILE                      output tags to the file.\n\
   -P DIR                       the prefix path when generating database.\n\
+  -j N, --jobs=N               run N ctags processes in parallel, and walk\n\
+                               directories with N threads, default is 1 ctags\n\
+                               process and " STR(WALK_JOBS) " threads.\n\
+  --batch=FILES[,TAGS[,MSEC]]  commit a transaction after FILES files, TAGS tags\n\
+                               or MSEC milliseconds, 0 means no limit,\n\
+                               default is 1 file when updating, otherwise\n\
+                               " STR(BATCH_FILES) "," STR(BATCH_TAGS) "," STR(BATCH_MSEC) ".\n\
   -p FORMAT, --print=FORMAT    print with the format.\n\
   -u                           update incrementally.\n\
   -d                           update incrementally, not check the database.\n\
   -C                           ignore case when search.\n\
   -l                           Line-oriented interface.\n\
+  --serve[=SOCKET]             serve the line-oriented interface on the unix\n\
+                               socket, default is the database path with\n\
+                               '" SOCKEXT "', any number of clients can connect,\n\
+                               -j N sets the number of queries run at once,\n\
+                               default is " STR(SERVE_JOBS) ".\n\
+  --connect[=SOCKET]           line-oriented interface through the server.\n\
+  --watch                      keep updating the database as FILES change,\n\
+                               changes within " STR(WATCH_MSEC) "ms are updated together,\n\
+                               can be used with --serve.\n\
   -s                           output format of cscope.\n\
   -c                           output format of ctags.\n\
   -x                           output format of xref.\n\
@@ -75,6 +133,17 @@ Option:\n\
   -v, --version                print version.\n\
   -h, --help                   print help message.\n\
   --fs-sensitive[=true|false]  treat path as the sensitive setting of fs.\n\
+  --export-snapshot=FILE       write all tags into a read-only snapshot FILE\n\
+                               after updating the database.\n\
+  --snapshot=FILE              answer -0, -1 and -3 from the snapshot FILE\n\
+                               without opening or updating the database.\n\
+  --rebuild                    build the database again from FILES.\n\
+                               a new, empty or rebuilt database is bulk loaded\n\
+                               into '" BULKEXT "' with indexes built at the end,\n\
+                               and replaces the database only when it succeeds.\n\
+  --stats[=json]               print time spent in each phase, counters and\n\
+                               sqlite memory and cache usage to stderr at exit,\n\
+                               json prints one bare JSON object on a line.\n\
   --output-encoding[=ENCODING] output encoding of tags,\n\
                                which need the support of ctags.\n\
 \n\
@@ -103,8 +172,247 @@ enum {
     TAGCOUNT
 };
 
+/**
+ * 已发送给ctags进程、等待结果的文件
+ */
+struct pending {
+    char *path;
+    int64_t size;
+    int64_t time;
+    int64_t hash;
+};
+
+/**
+ * ctags子进程，pending按发送顺序保存在途的文件，buf及之后的成员仅由读取线程使用
+ */
+struct worker {
+    int pid;
+    FILE *si;
+    FILE *so;
+    int dead;
+    int head;
+    int count;
+    struct pending pending[WORKER_DEPTH];
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    size_t scan;
+};
+
+/**
+ * 读取线程解析出的一个文件的全部tag，每个tag的字段按FIELD_IDX_*排列
+ * funcs为每个tag所在的最内层函数的起始行，文件中没有函数时为NULL
+ */
+struct group {
+    struct worker *worker;
+    char *data;
+    char *(*tags)[FIELD_MAX];
+    int64_t *funcs;
+    size_t count;
+    struct group *next;
+};
+
+/**
+ * 读取线程交给主线程写入的队列，队列满时读取线程等待
+ */
+struct reader {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    struct group *head;
+    struct group *tail;
+    int count;
+};
+
+/**
+ * 批量写入的事务，文件数、tag数或时间任一达到上限时提交
+ */
+struct batch {
+    int files;
+    int tags;
+    int msec;
+    int nfile;
+    int ntag;
+    int64_t start;
+};
+
+/**
+ * findfile回调函数的上下文，lost为因ctags进程退出等原因没有解析的文件数
+ */
+struct context {
+    db_t db;
+    const char *pwd;
+    const char *cwd;
+    int count;
+    struct worker *workers;
+    struct reader reader;
+    struct batch batch;
+    walk_t walk;
+    int jobs;
+    uint64_t files;
+    uint64_t tags;
+    uint64_t lost;
+};
+
+/**
+ * 行模式的会话状态，同一连接的命令之间保留
+ */
+struct session {
+    unsigned char mode;
+    int depth;
+};
+
+/**
+ * 服务端的一个连接，fd只由分派线程读取，buf中为已读入但尚未执行的命令
+ * busy表示line正在由服务线程执行，done表示连接结束，均由分派线程关闭和释放
+ */
+struct client {
+    int fd;
+    FILE *in;
+    FILE *out;
+    char *buf;
+    size_t len;
+    size_t size;
+    char *line;
+    int eof;
+    int busy;
+    int done;
+    struct session session;
+    struct client *next;
+    struct client *link;
+};
+
+/**
+ * 服务参数：分派线程等待连接和命令，完整的一行命令放入队列，由count个服务线程执行
+ * 每个服务线程使用独立的只读数据库连接，执行完一条命令后通过wake唤醒分派线程
+ */
+struct server {
+    int sock;
+    int count;
+    const char *pwd;
+    const char *cwd;
+    const char *dbpath;
+    unsigned char mode;
+    int depth;
+    int wake[2];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct client *clients;
+    struct client *head;
+    struct client *tail;
+};
+
+/**
+ * 服务线程的参数，db为servesock在启动前打开的只读数据库连接，由该线程独占
+ */
+struct servedb {
+    struct server *server;
+    db_t db;
+};
+
+/**
+ * 监视模式下一批待处理的变更路径，rescan表示有变更丢失需要重新扫描
+ */
+struct change {
+    char **paths;
+    int count;
+    int size;
+    int rescan;
+};
+
+/**
+ * 查询结果的输出缓冲区，data中的UTF-8内容攒满OUTSIZE后整块转换到conv再写出，size为已写出的字节数
+ */
+struct output {
+    FILE *fp;
+    iconv_t cd;
+    char *data;
+    char *conv;
+    size_t len;
+    uint64_t size;
+};
+
+/**
+ * 编译后的输出格式中的一项：field为-1时是literal中[pos, pos + len)的字面文本，
+ * 否则是一个字段，按width对齐，left表示左对齐
+ */
+struct fmtop {
+    int field;
+    int width;
+    int left;
+    size_t pos;
+    size_t len;
+};
+
+/**
+ * 编译后的输出格式，used标记格式中用到的字段，只有这些字段需要从游标读取
+ */
+struct template {
+    struct fmtop *ops;
+    int count;
+    char *literal;
+    unsigned char used[FIELD_MAX];
+};
+
+/**
+ * --stats统计的阶段，各阶段时间只统计主线程，互不重叠
+ */
+enum {
+    STAT_OTHER,
+    STAT_SPAWN,
+    STAT_WALK,
+    STAT_SWEEP,
+    STAT_CHECK,
+    STAT_HASH,
+    STAT_WAIT,
+    STAT_INSERT,
+    STAT_COMMIT,
+    STAT_INDEX,
+    STAT_EXPORT,
+    STAT_QUERY,
+    STAT_FORMAT,
+    STAT_COUNT
+};
+
+/**
+ * --stats的统计结果，mode为0时不统计；
+ * phase为主线程当前所处的阶段，mark为进入该阶段的时间，parse只由读取线程累加
+ */
+struct stats {
+    int mode;
+    pthread_t owner;
+    int phase;
+    int64_t mark;
+    int64_t start;
+    int64_t time[STAT_COUNT];
+    int64_t parse;
+    int64_t ctags;
+    uint64_t visited;
+    uint64_t rows;
+    uint64_t bytes;
+};
+
 static int debugmode = 0;
 static int recursive = 0;
+static struct stats stats = {0};
+
+static const char *const statnames[STAT_COUNT] = {
+        [STAT_OTHER] = "other",
+        [STAT_SPAWN] = "spawn",
+        [STAT_WALK] = "walk",
+        [STAT_SWEEP] = "sweep",
+        [STAT_CHECK] = "check",
+        [STAT_HASH] = "hash",
+        [STAT_WAIT] = "wait",
+        [STAT_INSERT] = "insert",
+        [STAT_COMMIT] = "commit",
+        [STAT_INDEX] = "index",
+        [STAT_EXPORT] = "export",
+        [STAT_QUERY] = "query",
+        [STAT_FORMAT] = "format"
+};
 
 static const char *tagformats[TAGCOUNT] = {
         [TAGPATH] = "%" FIELD_CHR_PATH "\n",
@@ -113,6 +421,27 @@ static const char *tagformats[TAGCOUNT] = {
         [TAGCSCOPE] = "%" FIELD_CHR_PATH " %" FIELD_CHR_NAME " %" FIELD_CHR_LINE " %" FIELD_CHR_COMPACT "\n"
 };
 
+// ctags输出中各字段的顺序，须与main中--_xformat的字段顺序一致
+static const int xfields[] = {
+        FIELD_IDX_MARK,
+        FIELD_IDX_NAME,
+        FIELD_IDX_PATTERN,
+        FIELD_IDX_COMPACT,
+        FIELD_IDX_LINE,
+        FIELD_IDX_ENDL,
+        FIELD_IDX_LANG,
+        FIELD_IDX_ROLE,
+        FIELD_IDX_KIND,
+        FIELD_IDX_TYPE,
+        FIELD_IDX_SIGN,
+        FIELD_IDX_ACCESS,
+        FIELD_IDX_INHERIT,
+        FIELD_IDX_IMPL,
+        FIELD_IDX_KSCOPE,
+        FIELD_IDX_NSCOPE,
+        FIELD_IDX_EXTRAS
+};
+
 __attribute__((weak)) ssize_t getline(char **lineptr, size_t *n, FILE *fp)
 {
     int ch;
@@ -148,274 +477,1140 @@ __attribute__((weak)) ssize_t getline(char **lineptr, size_t *n, FILE *fp)
     return rc;
 }
 
-static inline char *torelpath(const char *cwd, const char *path, char buf[])
+/**
+ * 获取单调时钟的毫秒数
+ * @return 毫秒数
+ */
+static inline int64_t mstime(void)
 {
-    char pathbuf[PATH_MAX * 2 + 1] = {0};
-    return pathescape(relpath(cwd, path, pathbuf), buf);
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /**
- * findfile的回调函数，将文件路径写入数据库
- * @param path 文件路径
- * @param len  路径字符串长度
- * @param size 文件字节数
- * @param time 文件修改时间
- * @param ctx  上下文
+ * 获取单调时钟的纳秒数
+ * @return 纳秒数
  */
-static void writepath(char *path, int len, int64_t size, int64_t time, void *ctx)
+static inline int64_t nstime(void)
 {
-    int idx;
-    size_t linecap = 0;
-    uint64_t fid, cnt = 0;
-    void **data = (void **) ctx;
-    FILE *si = (FILE *) data[0];
-    FILE *so = (FILE *) data[1];
-    db_t db = (db_t) data[2];
-    char *temp, *token, *fields[FIELD_MAX], *line = NULL;
-
-    dbbegin(db);
-
-    if (!(fid = dbsetfile(db, path, size, time))) {
-        dbrollback(db);
-        return;
-    }
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    path[len] = '\n';
-    fwrite(path, len + 1, 1, so);
-    fflush(so);
-    path[len] = '\0';
+/**
+ * 判断当前线程是否需要统计，服务线程中的查询不统计
+ * @return 需要统计返回非0
+ */
+static inline int statmine(void)
+{
+    return stats.mode && pthread_equal(stats.owner, pthread_self());
+}
 
-    while (getline(&line, &linecap, si) > 0 && strcmp(line, GROUPEND) != 0) {
-        memset(fields, 0, sizeof(fields));
-        for (idx = 0, temp = line; (token = strsep(&temp, FIELDEND)) && *token++ == *FIELDSEP; idx++)
-            fields[idx] = token;
-        if (dbaddatag(db, fid, fields) == 0)
-            cnt++;
-    }
+/**
+ * 切换主线程所处的阶段，之前阶段经过的时间计入该阶段
+ * @param phase 新的阶段
+ * @return      之前的阶段，用于恢复
+ */
+static inline int statphase(int phase)
+{
+    int prev;
+    int64_t now;
 
-    free(line);
+    if (!statmine())
+        return phase;
 
-    if (cnt == 0)
-        dbrollback(db);
-    else
-        dbcommit(db);
+    now = nstime();
+    stats.time[stats.phase] += now - stats.mark;
+    stats.mark = now;
+    prev = stats.phase;
+    stats.phase = phase;
 
-    if (debugmode && cnt)
-        echomsg("parsed %s, size=%llu, tags=%llu\n", path, size, cnt);
+    return prev;
 }
 
 /**
- * findfile回调函数，仅写入数据中不存在或变更的文件
- * @param path 文件路径
- * @param len  文件字符串长度
- * @param size 文件字节数
- * @param time 文件修改时间
- * @param ctx  上下文
+ * 开始批量事务，已有进行中的批量事务时直接使用
+ * @param ctx 上下文
  */
-static void checkpath(char *path, int len, int64_t size, int64_t time, void *ctx)
+static void beginbatch(struct context *ctx)
 {
-    int64_t fsize, ftime;
-    void **data = (void **) ctx;
-    db_t db = (db_t) data[2];
-
-    if (!dbgetfile(db, path, &fsize, &ftime) || fsize != size || ftime != time)
-        writepath(path, len, size, time, ctx);
+    if (!ctx->batch.start && dbbegin(ctx->db) == 0)
+        ctx->batch.start = mstime();
 }
 
 /**
- * 检查数据文件变更情况
- * @param fid  文件id
- * @param path 文件路径
- * @param size 文件字节数
- * @param time 文件修改时间
- * @param ctx  上下文
+ * 提交进行中的批量事务
+ * @param ctx 上下文
  */
-static void checkfile(int64_t fid, const char *path, int64_t size, int64_t time, void *ctx)
+static void commitbatch(struct context *ctx)
 {
-    void **data = (void **) ctx;
-    db_t db = (db_t) data[2];
-    struct stat info = {0};
+    int prev = statphase(STAT_COMMIT);
 
-    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
-        dbdelfile(db, path);
-        if (debugmode)
-            echomsg("delete %s\n", path);
-    }
+    if (ctx->batch.start && dbcommit(ctx->db) != 0)
+        dbrollback(ctx->db);
+
+    statphase(prev);
+
+    ctx->batch.nfile = 0;
+    ctx->batch.ntag = 0;
+    ctx->batch.start = 0;
 }
 
-static inline void _findfile(char *path, int len, write_t func, void *ctx)
+/**
+ * 按FIELDEND切分一行，一次比较16字节查找分隔符
+ * @param line  行内容，分隔符替换为'\0'
+ * @param len   行长度
+ * @param items 返回各字段的起始位置
+ * @param max   最多字段数
+ * @return      字段数
+ */
+static int splitline(char *line, size_t len, char *items[], int max)
 {
-    int tmp;
-    DIR *dir;
-    struct stat info;
-    struct dirent *entry;
+    int cnt = 0;
+    size_t pos = 0, start = 0;
+
+#if defined(__SSE2__)
+    unsigned mask;
+    const __m128i sep = _mm_set1_epi8(*FIELDEND);
+
+    for (; pos + 16 <= len && cnt < max; pos += 16) {
+        mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (line + pos)), sep));
+        for (; mask && cnt < max; mask &= mask - 1) {
+            line[pos + __builtin_ctz(mask)] = '\0';
+            items[cnt++] = line + start;
+            start = pos + __builtin_ctz(mask) + 1;
+        }
+    }
+#endif
 
-    if ((dir = opendir(path))) {
-        while ((entry = readdir(dir))) {
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
-                (tmp = snprintf(path + len, BUFSIZE - len, PATHSEP "%s", entry->d_name)) > 0 &&
-                (tmp += len, stat(path, &info)) == 0) {
-                if (S_ISREG(info.st_mode))
-                    func(path, tmp, info.st_size, info.st_mtime, ctx);
-                else if (S_ISDIR(info.st_mode) && recursive)
-                    _findfile(path, tmp, func, ctx);
-            }
+    for (; pos < len && cnt < max; pos++) {
+        if (line[pos] == *FIELDEND) {
+            line[pos] = '\0';
+            items[cnt++] = line + start;
+            start = pos + 1;
         }
-        path[len] = '\0';
-        closedir(dir);
     }
+
+    return cnt;
 }
 
 /**
- * 查找文件
- * @param path 文件路径
- * @param len  文件字符串长度
- * @param func 查找到文件时的处理函数
- * @param ctx  传给回调函数的上下文
+ * 读取ctags进程已输出的内容，未完整的组保留在缓冲区中
+ * @param worker ctags进程
+ * @return       读取的字节数，进程已退出或出错时返回0或-1
  */
-static void findfile(char *path, int len, write_t func, void *ctx)
+static ssize_t fillbuf(struct worker *worker)
 {
-    struct stat info = {0};
+    char *buf;
+    ssize_t cnt;
+
+    if (worker->pos > 0) {
+        memmove(worker->buf, worker->buf + worker->pos, worker->len - worker->pos);
+        worker->len -= worker->pos;
+        worker->scan -= worker->pos;
+        worker->pos = 0;
+    }
 
-    if (stat(path, &info) == 0) {
-        if (S_ISREG(info.st_mode))
-            func(path, len, info.st_size, info.st_mtime, ctx);
-        else if (S_ISDIR(info.st_mode))
-            _findfile(path, len, func, ctx);
+    if (worker->cap - worker->len < READSIZE / 2) {
+        if (!(buf = (char *) realloc(worker->buf, worker->cap + READSIZE)))
+            return -1;
+        worker->buf = buf;
+        worker->cap += READSIZE;
     }
+
+    while ((cnt = read(fileno(worker->si), worker->buf + worker->len, worker->cap - worker->len)) < 0 && errno == EINTR);
+    if (cnt > 0)
+        worker->len += cnt;
+
+    return cnt;
 }
 
 /**
- * 根据编码，按指定格式将字符串写入文件
- * @param fp  文件句柄
- * @param cd  编码句柄
- * @param fmt 格式字符串
- * @param ...
+ * 按第一个元素（行号）排序的比较函数
+ * @param a 第一个元素
+ * @param b 第二个元素
+ * @return  a小于、等于、大于b时分别返回负数、0、正数
  */
-static void print(FILE *fp, iconv_t cd, const char *fmt, ...)
+static int cmpspan(const void *a, const void *b)
 {
-    int len;
-    va_list ap;
-    size_t ret, insize, outsize;
-    char tmpbuf[BUFSIZE], *inbuf, *outbuf, *buf = NULL;
+    const int64_t *x = (const int64_t *) a, *y = (const int64_t *) b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
 
-    va_start(ap, fmt);
+/**
+ * 求出组中每个tag所在的最内层函数，即包含tag所在行且起始行最大的函数
+ * 函数按起始行、tags按行排序后扫描一遍：起始行不大于当前行的函数依次入栈，
+ * 栈顶已结束的函数出栈，剩下的栈顶就是所求的函数
+ * @param grp 组
+ */
+static void scopegroup(struct group *grp)
+{
+    size_t idx, cnt = 0, top = 0, pos = 0;
+    int64_t (*spans)[2], (*lines)[2], **stack;
+    const char *kind;
+
+    for (idx = 0; idx < grp->count; idx++) {
+        kind = grp->tags[idx][FIELD_IDX_KIND];
+        cnt += kind && strcmp(kind, "function") == 0;
+    }
 
-    if (!cd || cd == (iconv_t) (-1))
-        vfprintf(fp, fmt, ap);
-    else if ((len = vasprintf(&buf, fmt, ap)) > 0) {
-        inbuf = buf;
-        insize = len;
-        do {
-            outbuf = tmpbuf;
-            outsize = sizeof(tmpbuf);
-            ret = iconv(cd, &inbuf, &insize, &outbuf, &outsize);
-            len = sizeof(tmpbuf) - outsize;
-            if (len > 0) {
-                fwrite(tmpbuf, len, 1, fp);
-                fflush(fp);
+    if (cnt == 0)
+        return;
+
+    spans = (int64_t (*)[2]) malloc(cnt * sizeof(*spans));
+    lines = (int64_t (*)[2]) malloc(grp->count * sizeof(*lines));
+    stack = (int64_t **) malloc(cnt * sizeof(*stack));
+
+    if (spans && lines && stack && (grp->funcs = (int64_t *) calloc(grp->count, sizeof(*grp->funcs)))) {
+        for (cnt = idx = 0; idx < grp->count; idx++) {
+            lines[idx][0] = grp->tags[idx][FIELD_IDX_LINE] ? strtoll(grp->tags[idx][FIELD_IDX_LINE], NULL, 10) : 0;
+            lines[idx][1] = (int64_t) idx;
+            kind = grp->tags[idx][FIELD_IDX_KIND];
+            // 没有结束行的函数不包含任何tag
+            if (kind && strcmp(kind, "function") == 0 && grp->tags[idx][FIELD_IDX_ENDL]) {
+                spans[cnt][0] = lines[idx][0];
+                spans[cnt][1] = strtoll(grp->tags[idx][FIELD_IDX_ENDL], NULL, 10);
+                cnt += spans[cnt][1] >= spans[cnt][0];
             }
-        } while (ret == (size_t) (-1) && !outsize);
-        free(buf);
+        }
+
+        qsort(spans, cnt, sizeof(*spans), cmpspan);
+        qsort(lines, grp->count, sizeof(*lines), cmpspan);
+
+        for (idx = 0; idx < grp->count; idx++) {
+            for (; pos < cnt && spans[pos][0] <= lines[idx][0]; pos++)
+                stack[top++] = spans[pos];
+            for (; top > 0 && stack[top - 1][1] < lines[idx][0]; top--);
+            grp->funcs[lines[idx][1]] = top > 0 ? stack[top - 1][0] : 0;
+        }
     }
 
-    va_end(ap);
+    free(stack);
+    free(lines);
+    free(spans);
 }
 
 /**
- * 按指定格式输出tag
- * @param fp     文件句柄
- * @param cd     编码句柄
- * @param fmt    格式字符串
- * @param fields tag内容
+ * 从缓冲区中取出一个完整的组并切分各tag的字段
+ * @param worker ctags进程
+ * @return       解析出的组，没有完整的组时返回NULL
  */
-static void echofmt(FILE *fp, iconv_t cd, const char *cwd, const char *fmt, char **fields)
+static struct group *cutgroup(struct worker *worker)
 {
-    int idx, len;
-    char ch, buf[32];
-    const char *p, *q, *k;
-    char *field, pathbuf[(PATH_MAX + 1) * 3] = {0};
+    int idx, cnt;
+    size_t len, cap = 0;
+    char *end, *line, *next, *value, *items[FIELD_MAX], *(*tags)[FIELD_MAX];
+    struct group *grp;
+
+    // 组以单独一行的GROUPSEP结束，已查找过的部分不再重复查找
+    for (worker->scan = worker->scan > worker->pos ? worker->scan : worker->pos;; worker->scan = end + 1 - worker->buf) {
+        if (!(end = memchr(worker->buf + worker->scan, *GROUPSEP, worker->len - worker->scan))) {
+            worker->scan = worker->len;
+            return NULL;
+        }
+        if (end + 1 == worker->buf + worker->len) {
+            worker->scan = end - worker->buf;
+            return NULL;
+        }
+        if ((end == worker->buf + worker->pos || end[-1] == '\n') && end[1] == '\n')
+            break;
+    }
 
-    if (!fields[FIELD_IDX_MARK] ||
-        !fields[FIELD_IDX_PATH] ||
-        !fields[FIELD_IDX_NAME] ||
-        !fields[FIELD_IDX_KIND] ||
-        !fields[FIELD_IDX_LINE] ||
-        !fields[FIELD_IDX_PATTERN] ||
-        !fields[FIELD_IDX_COMPACT])
-        return;
+    len = end - (worker->buf + worker->pos);
+    if (!(grp = (struct group *) calloc(1, sizeof(*grp))) || !(grp->data = (char *) malloc(len + 1))) {
+        free(grp);
+        return NULL;
+    }
 
-    for (idx = -1, q = NULL, p = fmt; *p; idx = -1, p++) {
-        switch (*p) {
-            case *FIELD_CHR_PATH:
-                idx = FIELD_IDX_PATH;
-                break;
-            case *FIELD_CHR_MARK:
-                idx = FIELD_IDX_MARK;
-                break;
-            case *FIELD_CHR_NAME:
-                idx = FIELD_IDX_NAME;
-                break;
-            case *FIELD_CHR_PATTERN:
-                idx = FIELD_IDX_PATTERN;
-                break;
-            case *FIELD_CHR_COMPACT:
-                idx = FIELD_IDX_COMPACT;
-                break;
-            case *FIELD_CHR_LINE:
-                idx = FIELD_IDX_LINE;
-                break;
-            case *FIELD_CHR_ENDL:
-                idx = FIELD_IDX_ENDL;
-                break;
-            case *FIELD_CHR_LANG:
-                idx = FIELD_IDX_LANG;
-                break;
-            case *FIELD_CHR_ROLE:
-                idx = FIELD_IDX_ROLE;
-                break;
-            case *FIELD_CHR_KIND:
-                idx = FIELD_IDX_KIND;
-                break;
-            case *FIELD_CHR_TYPE:
-                idx = FIELD_IDX_TYPE;
-                break;
-            case *FIELD_CHR_SIGN:
-                idx = FIELD_IDX_SIGN;
-                break;
-            case *FIELD_CHR_ACCESS:
-                idx = FIELD_IDX_ACCESS;
-                break;
-            case *FIELD_CHR_INHERIT:
-                idx = FIELD_IDX_INHERIT;
-                break;
-            case *FIELD_CHR_IMPL:
-                idx = FIELD_IDX_IMPL;
-                break;
-            case *FIELD_CHR_KSCOPE:
-                idx = FIELD_IDX_KSCOPE;
-                break;
-            case *FIELD_CHR_NSCOPE:
-                idx = FIELD_IDX_NSCOPE;
-                break;
-            case *FIELD_CHR_EXTRAS:
-                idx = FIELD_IDX_EXTRAS;
-                break;
-            case '%':
-                q = q ? NULL : p;
-                break;
-            default:
+    memcpy(grp->data, worker->buf + worker->pos, len);
+    grp->data[len] = '\0';
+    grp->worker = worker;
+    worker->pos = worker->scan = end + 2 - worker->buf;
+
+    for (line = grp->data; line < grp->data + len; line = next + 1) {
+        if (!(next = memchr(line, '\n', grp->data + len - line)))
+            next = grp->data + len;
+        *next = '\0';
+        if (grp->count >= cap) {
+            if (!(tags = realloc(grp->tags, (cap * 2 + 64) * sizeof(*tags))))
                 break;
+            grp->tags = tags;
+            cap = cap * 2 + 64;
         }
-        if (!q) {
-            ch = *p;
-            if (ch == '\\')
-                switch (*++p) {
-                    case 'a':
-                        ch = '\a';
-                        break;
-                    case 'b':
-                        ch = '\b';
+        memset(grp->tags[grp->count], 0, sizeof(*grp->tags));
+        cnt = splitline(line, next - line, items, sizeof(xfields) / sizeof(*xfields));
+        for (idx = 0; idx < cnt; idx++) {
+            if (items[idx][0] == *FIELDSEP && (value = strchr(items[idx], '=')))
+                grp->tags[grp->count][xfields[idx]] = value + 1;
+        }
+        grp->count++;
+    }
+
+    scopegroup(grp);
+
+    return grp;
+}
+
+/**
+ * 读取线程，持续读取各ctags进程的输出并解析成组，使ctags不会因输出管道写满而等待写入
+ * @param arg 上下文
+ * @return    NULL
+ */
+static void *readthread(void *arg)
+{
+    int idx, alive;
+    int64_t start = 0;
+    struct group *grp;
+    struct worker *worker;
+    struct context *ctx = (struct context *) arg;
+    struct reader *rd = &ctx->reader;
+    FILE *fps[ctx->count];
+
+    for (;;) {
+        for (alive = idx = 0; idx < ctx->count; idx++) {
+            fps[idx] = ctx->workers[idx].dead ? NULL : ctx->workers[idx].si;
+            alive += fps[idx] != NULL;
+        }
+        if (!alive || (idx = taskpoll(fps, ctx->count)) < 0)
+            break;
+
+        worker = &ctx->workers[idx];
+
+        if (fillbuf(worker) <= 0) {
+            pthread_mutex_lock(&rd->lock);
+            worker->dead = 1;
+            pthread_cond_signal(&rd->ready);
+            pthread_mutex_unlock(&rd->lock);
+            continue;
+        }
+
+        for (;;) {
+            if (stats.mode)
+                start = nstime();
+            grp = cutgroup(worker);
+            if (stats.mode)
+                stats.parse += nstime() - start;
+            if (!grp)
+                break;
+            pthread_mutex_lock(&rd->lock);
+            while (rd->count >= GROUP_QUEUE)
+                pthread_cond_wait(&rd->space, &rd->lock);
+            if (rd->tail)
+                rd->tail->next = grp;
+            else
+                rd->head = grp;
+            rd->tail = grp;
+            rd->count++;
+            pthread_cond_signal(&rd->ready);
+            pthread_mutex_unlock(&rd->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 写入读取线程解析出的一组tag，队列为空时等待
+ * 同一ctags进程的组与发送顺序一致，依次对应其在途的文件
+ * @param ctx 上下文
+ * @return    写入一组返回0，没有在途的文件返回-1
+ */
+static int readgroup(struct context *ctx)
+{
+    int idx, busy, prev;
+    int64_t fid;
+    size_t tag;
+    uint64_t tags = 0;
+    struct group *grp = NULL;
+    struct pending *pend;
+    struct worker *worker = NULL;
+    struct reader *rd = &ctx->reader;
+
+    prev = statphase(STAT_WAIT);
+
+    pthread_mutex_lock(&rd->lock);
+
+    for (;;) {
+        if ((grp = rd->head)) {
+            if (!(rd->head = grp->next))
+                rd->tail = NULL;
+            rd->count--;
+            pthread_cond_signal(&rd->space);
+            worker = grp->worker;
+            break;
+        }
+        // 已退出的ctags进程不会再返回结果，其在途的文件按没有tag处理
+        for (busy = idx = 0; !worker && idx < ctx->count; idx++) {
+            busy += ctx->workers[idx].count;
+            if (ctx->workers[idx].dead && ctx->workers[idx].count > 0)
+                worker = &ctx->workers[idx];
+        }
+        if (worker || !busy)
+            break;
+        pthread_cond_wait(&rd->ready, &rd->lock);
+    }
+
+    pthread_mutex_unlock(&rd->lock);
+
+    if (!worker) {
+        statphase(prev);
+        return -1;
+    }
+
+    statphase(STAT_INSERT);
+
+    pend = &worker->pending[worker->head];
+    worker->head = (worker->head + 1) % WORKER_DEPTH;
+    worker->count--;
+
+    beginbatch(ctx);
+
+    // 每个文件使用独立的保存点，没有tag的文件可以单独回滚而不影响同一批次的其它文件
+    dbsavepoint(ctx->db);
+
+    fid = dbsetfile(ctx->db, pend->path, pend->size, pend->time, pend->hash);
+
+    for (tag = 0; grp && fid > 0 && tag < grp->count; tag++) {
+        if (dbaddatag(ctx->db, fid, grp->funcs ? grp->funcs[tag] : 0, grp->tags[tag]) == 0)
+            tags++;
+    }
+
+    if (tags == 0)
+        dbrevert(ctx->db);
+    else
+        dbrelease(ctx->db);
+
+    if (debugmode && tags)
+        echomsg("parsed %s, size=%llu, tags=%llu\n", pend->path, pend->size, tags);
+
+    free(pend->path);
+    pend->path = NULL;
+
+    if (grp) {
+        free(grp->funcs);
+        free(grp->tags);
+        free(grp->data);
+        free(grp);
+    }
+
+    ctx->files += tags > 0;
+    ctx->tags += tags;
+    ctx->lost += !grp;
+    ctx->batch.nfile++;
+    ctx->batch.ntag += tags;
+
+    if ((ctx->batch.files && ctx->batch.nfile >= ctx->batch.files) ||
+        (ctx->batch.tags && ctx->batch.ntag >= ctx->batch.tags) ||
+        (ctx->batch.msec && mstime() - ctx->batch.start >= ctx->batch.msec))
+        commitbatch(ctx);
+
+    statphase(prev);
+
+    return 0;
+}
+
+/**
+ * 获取在途文件最少且未满的worker，若都已满则先写入一组结果
+ * @param ctx 上下文
+ * @return    可发送文件的worker，失败返回NULL
+ */
+static struct worker *idleworker(struct context *ctx)
+{
+    int idx;
+    struct worker *worker;
+
+    do {
+        worker = NULL;
+        pthread_mutex_lock(&ctx->reader.lock);
+        for (idx = 0; idx < ctx->count; idx++) {
+            if (!ctx->workers[idx].dead && ctx->workers[idx].count < WORKER_DEPTH &&
+                (!worker || ctx->workers[idx].count < worker->count))
+                worker = &ctx->workers[idx];
+        }
+        pthread_mutex_unlock(&ctx->reader.lock);
+    } while (!worker && readgroup(ctx) == 0);
+
+    return worker;
+}
+
+/**
+ * 等待所有worker返回结果并写入数据库
+ * @param ctx 上下文
+ */
+static void flushpath(struct context *ctx)
+{
+    while (readgroup(ctx) == 0);
+
+    commitbatch(ctx);
+}
+
+/**
+ * findfile的回调函数，将文件路径交给在途文件最少的worker解析，结果由readgroup写入数据库
+ * 每个worker最多有WORKER_DEPTH个在途文件，主线程写入数据库时ctags仍在解析
+ * @param path 文件路径
+ * @param len  路径字符串长度
+ * @param size 文件字节数
+ * @param time 文件修改时间
+ * @param ctx  上下文
+ */
+static void writepath(char *path, int len, int64_t size, int64_t time, void *ctx)
+{
+    int prev;
+    struct pending *pend;
+    struct worker *worker = idleworker((struct context *) ctx);
+
+    pend = worker ? &worker->pending[(worker->head + worker->count) % WORKER_DEPTH] : NULL;
+    if (!pend || !(pend->path = strdup(path))) {
+        ((struct context *) ctx)->lost++;
+        return;
+    }
+
+    // 在ctags读取之前计算哈希，之后的修改会使修改时间再次变化
+    pend->size = size;
+    pend->time = time;
+    prev = statphase(STAT_HASH);
+    pend->hash = sweephash(path);
+    statphase(prev);
+    worker->count++;
+
+    path[len] = '\n';
+    fwrite(path, len + 1, 1, worker->so);
+    fflush(worker->so);
+    path[len] = '\0';
+}
+
+/**
+ * findfile回调函数，仅写入数据中不存在或变更的文件
+ * @param path 文件路径
+ * @param len  文件字符串长度
+ * @param size 文件字节数
+ * @param time 文件修改时间
+ * @param ctx  上下文
+ */
+static void checkpath(char *path, int len, int64_t size, int64_t time, void *ctx)
+{
+    int prev, same = 0;
+    int64_t fid, fsize, ftime, fhash = 0;
+    db_t db = ((struct context *) ctx)->db;
+
+    prev = statphase(STAT_CHECK);
+    fid = dbgetfile(db, path, &fsize, &ftime, &fhash);
+    statphase(prev);
+
+    if (fid > 0 && fsize == size && ftime == time)
+        return;
+
+    // 只有修改时间变化而内容相同（如切换分支后又切回）时只更新时间，不重新解析
+    if (fid > 0 && fsize == size && fhash) {
+        prev = statphase(STAT_HASH);
+        same = sweephash(path) == fhash;
+        statphase(prev);
+    }
+
+    if (same) {
+        beginbatch((struct context *) ctx);
+        dbsettime(db, fid, time);
+        if (debugmode)
+            echomsg("touch %s\n", path);
+        return;
+    }
+
+    writepath(path, len, size, time, ctx);
+}
+
+/**
+ * 数据库中待检查的文件
+ */
+struct sweep {
+    struct sweepfile *files;
+    int count;
+    int size;
+};
+
+/**
+ * 收集数据库中的文件
+ * @param fid  文件id
+ * @param path 文件路径
+ * @param size 文件字节数
+ * @param time 文件修改时间
+ * @param ctx  收集结果
+ */
+static void addfile(int64_t fid, const char *path, int64_t size, int64_t time, void *ctx)
+{
+    struct sweep *swp = (struct sweep *) ctx;
+    struct sweepfile *files;
+
+    if (!path)
+        return;
+
+    if (swp->count >= swp->size) {
+        if (!(files = (struct sweepfile *) realloc(swp->files, (swp->size * 2 + 64) * sizeof(*files))))
+            return;
+        swp->files = files;
+        swp->size = swp->size * 2 + 64;
+    }
+
+    files = &swp->files[swp->count];
+    if (!(files->path = strdup(path)))
+        return;
+
+    files->fid = fid;
+    files->len = (int) strlen(path);
+    files->size = size;
+    files->time = time;
+    files->state = SWEEP_SAME;
+    swp->count++;
+}
+
+/**
+ * 检查数据文件变更情况，已不存在的文件一次全部删除
+ * @param ctx  上下文
+ * @param func 已修改文件的处理函数，为NULL时只删除
+ */
+static void sweepdb(struct context *ctx, write_t func)
+{
+    int idx, gone = 0;
+    int64_t *fids;
+    struct sweep swp = {0};
+    int prev = statphase(STAT_SWEEP);
+
+    if (dballfile(ctx->db, addfile, &swp) == 0 && sweepstat(swp.files, swp.count, ctx->jobs) == 0 &&
+        (fids = (int64_t *) malloc((swp.count + 1) * sizeof(*fids)))) {
+        for (idx = 0; idx < swp.count; idx++) {
+            if (swp.files[idx].state == SWEEP_GONE) {
+                fids[gone++] = swp.files[idx].fid;
+                if (debugmode)
+                    echomsg("delete %s\n", swp.files[idx].path);
+            }
+        }
+
+        dbdelfiles(ctx->db, fids, gone);
+        free(fids);
+
+        for (idx = 0; func && idx < swp.count; idx++) {
+            if (swp.files[idx].state == SWEEP_CHANGED)
+                func(swp.files[idx].path, swp.files[idx].len, swp.files[idx].size, swp.files[idx].time, ctx);
+        }
+    }
+
+    for (idx = 0; idx < swp.count; idx++)
+        free(swp.files[idx].path);
+    free(swp.files);
+
+    statphase(prev);
+}
+
+static inline void _findfile(char *path, int len, write_t func, void *ctx)
+{
+    int tmp;
+    DIR *dir;
+    struct stat info;
+    struct dirent *entry;
+
+    if ((dir = opendir(path))) {
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+                (tmp = snprintf(path + len, BUFSIZE - len, PATHSEP "%s", entry->d_name)) > 0 &&
+                (tmp += len, stat(path, &info)) == 0) {
+                if (S_ISREG(info.st_mode)) {
+                    stats.visited++;
+                    func(path, tmp, info.st_size, info.st_mtime, ctx);
+                } else if (S_ISDIR(info.st_mode) && recursive)
+                    _findfile(path, tmp, func, ctx);
+            }
+        }
+        path[len] = '\0';
+        closedir(dir);
+    }
+}
+
+/**
+ * 查找文件
+ * @param path 文件路径
+ * @param len  文件字符串长度
+ * @param func 查找到文件时的处理函数
+ * @param ctx  传给回调函数的上下文
+ */
+static void findfile(char *path, int len, write_t func, void *ctx)
+{
+    struct stat info = {0};
+
+    if (stat(path, &info) == 0) {
+        if (S_ISREG(info.st_mode)) {
+            stats.visited++;
+            func(path, len, info.st_size, info.st_mtime, ctx);
+        } else if (S_ISDIR(info.st_mode))
+            _findfile(path, len, func, ctx);
+    }
+}
+
+/**
+ * 查找文件，由遍历线程并行遍历，同时处理已找到的文件
+ * 不能并行遍历时退化为findfile；
+ * @param ctx  上下文
+ * @param path 文件路径，NULL表示等待之前添加的路径全部遍历完
+ * @param len  文件字符串长度
+ * @param func 查找到文件时的处理函数
+ */
+static void findpath(struct context *ctx, char *path, int len, write_t func)
+{
+    int64_t size, time;
+    char buf[BUFSIZE];
+    int prev = statphase(STAT_WALK);
+
+    if (path && (!ctx->walk || walkpush(ctx->walk, path) != 0))
+        findfile(path, len, func, ctx);
+
+    while ((len = walknext(ctx->walk, !path, buf, &size, &time)) > 0) {
+        stats.visited++;
+        func(buf, len, size, time, ctx);
+    }
+
+    statphase(prev);
+}
+
+/**
+ * watchread的回调函数，记录变更的路径，同一批次内的重复路径在处理时去除
+ * @param path 变更的路径，NULL表示有变更丢失
+ * @param ctx  待处理的变更
+ */
+static void addchange(const char *path, void *ctx)
+{
+    int size;
+    char **paths;
+    struct change *chg = (struct change *) ctx;
+
+    if (!path) {
+        chg->rescan = 1;
+        return;
+    }
+
+    if (chg->count == chg->size) {
+        size = chg->size ? chg->size * 2 : 64;
+        if (!(paths = (char **) realloc(chg->paths, size * sizeof(*paths)))) {
+            chg->rescan = 1;
+            return;
+        }
+        chg->paths = paths;
+        chg->size = size;
+    }
+
+    if ((chg->paths[chg->count] = strdup(path)))
+        chg->count++;
+    else
+        chg->rescan = 1;
+}
+
+static int cmppath(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * 按路径的当前状态更新数据库，整批变更在同一个批量事务中提交
+ * 文件按大小和修改时间检查是否需要重新解析，不存在的路径按文件和目录都删除一次，
+ * 新出现的目录加入监视并扫描其下的文件；
+ * @param ctx   上下文
+ * @param watch 监视句柄
+ * @param chg   待处理的变更
+ * @param roots 监视的根路径
+ * @param count 根路径个数
+ * @param skip  数据库文件的绝对路径，以此开头的路径都不处理
+ */
+static void applychange(struct context *ctx, watch_t watch, struct change *chg,
+                        char *const roots[], int count, const char *skip)
+{
+    int idx, len;
+    struct stat info;
+    char buf[BUFSIZE];
+    char tmp[PATH_MAX + 1];
+
+    beginbatch(ctx);
+
+    if (chg->rescan) {
+        for (idx = 0; idx < count; idx++) {
+            watchadd(watch, roots[idx], recursive);
+            if ((len = snprintf(buf, BUFSIZE, "%s", roots[idx])) > 0)
+                findpath(ctx, buf, len, checkpath);
+        }
+        findpath(ctx, NULL, 0, checkpath);
+        flushpath(ctx);
+        sweepdb(ctx, NULL);
+    } else {
+        qsort(chg->paths, chg->count, sizeof(*chg->paths), cmppath);
+        for (idx = 0; idx < chg->count; idx++) {
+            if ((idx > 0 && strcmp(chg->paths[idx], chg->paths[idx - 1]) == 0) ||
+                !normpath(ctx->cwd, chg->paths[idx], tmp) || strncmp(tmp, skip, strlen(skip)) == 0 ||
+                (len = snprintf(buf, BUFSIZE, "%s", chg->paths[idx])) <= 0 || len >= BUFSIZE)
+                continue;
+            // 已删除的路径无法解析符号链接，按字面转换的绝对路径删除
+            if (stat(buf, &info) != 0) {
+                dbdelfile(ctx->db, tmp);
+                dbdeldir(ctx->db, tmp);
+                if (debugmode)
+                    echomsg("delete %s\n", buf);
+            } else if (S_ISREG(info.st_mode))
+                checkpath(buf, len, info.st_size, info.st_mtime, ctx);
+            else if (S_ISDIR(info.st_mode) && recursive && watchadd(watch, buf, recursive) > 0)
+                findpath(ctx, buf, len, checkpath);
+        }
+        findpath(ctx, NULL, 0, checkpath);
+    }
+
+    flushpath(ctx);
+
+    for (idx = 0; idx < chg->count; idx++)
+        free(chg->paths[idx]);
+    chg->count = 0;
+    chg->rescan = 0;
+}
+
+/**
+ * 监视根路径下的变更并持续更新数据库
+ * 收到变更后继续收集，直到WATCH_MSEC内没有新的变更或累计超过WATCH_MAX，再一起更新；
+ * @param ctx    上下文
+ * @param roots  监视的根路径
+ * @param count  根路径个数
+ * @param dbpath 数据库文件路径
+ * @return       监视失败返回非0，否则不返回
+ */
+static int watchtree(struct context *ctx, char *const roots[], int count, const char *dbpath)
+{
+    int idx, rc;
+    int64_t start;
+    watch_t watch;
+    struct change chg = {0};
+    char skip[PATH_MAX + 1];
+
+    if (!normpath(ctx->cwd, dbpath, skip) || !(watch = watchopen())) {
+        echoerr("watch is not supported.\n");
+        return 1;
+    }
+
+    for (idx = 0; idx < count; idx++) {
+        if (watchadd(watch, roots[idx], recursive) < 0)
+            echoerr("watch '%s' failed.\n", roots[idx]);
+        else if (debugmode)
+            echomsg("watch %s\n", roots[idx]);
+    }
+
+    while ((rc = watchread(watch, -1, addchange, &chg)) >= 0) {
+        for (start = mstime(); rc > 0 && mstime() - start < WATCH_MAX;)
+            rc = watchread(watch, WATCH_MSEC, addchange, &chg);
+        if (chg.count || chg.rescan)
+            applychange(ctx, watch, &chg, roots, count, skip);
+    }
+
+    for (idx = 0; idx < chg.count; idx++)
+        free(chg.paths[idx]);
+    free(chg.paths);
+    watchclose(watch);
+
+    echoerr("watch failed.\n");
+
+    return 1;
+}
+
+/**
+ * 打开输出缓冲区，内容按OUTSIZE大小的块转换编码并写出
+ * @param out 输出缓冲区
+ * @param fp  文件句柄
+ * @param cd  编码句柄，为NULL或无效时不转换
+ * @return    成功返回0，否则返回非0
+ */
+static int openout(struct output *out, FILE *fp, iconv_t cd)
+{
+    out->fp = fp;
+    out->cd = cd == (iconv_t) (-1) ? NULL : cd;
+    out->len = 0;
+    out->size = 0;
+    out->conv = NULL;
+
+    if (!(out->data = (char *) malloc(OUTSIZE)))
+        return -1;
+
+    if (out->cd && !(out->conv = (char *) malloc(OUTSIZE * 2))) {
+        free(out->data);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 将已转换编码的内容写入文件，并累计写出的字节数
+ * @param out  输出缓冲区
+ * @param data 内容
+ * @param len  字节数
+ */
+static inline void putraw(struct output *out, const char *data, size_t len)
+{
+    fwrite(data, 1, len, out->fp);
+    out->size += len;
+}
+
+/**
+ * 转换并写出缓冲区中的块，一个块只调用一次iconv；
+ * 块尾被切开的字符留在缓冲区中与下一块一起转换，无法转换的字节被丢弃
+ * @param out   输出缓冲区
+ * @param final 是否为最后一块，为真时不再保留不完整的字符，并复位转换状态
+ */
+static void writeout(struct output *out, int final)
+{
+    size_t ret, insize, outsize;
+    char *inbuf, *outbuf;
+
+    if (!out->cd) {
+        if (out->len > 0)
+            putraw(out, out->data, out->len);
+        out->len = 0;
+        return;
+    }
+
+    for (inbuf = out->data, insize = out->len; insize > 0;) {
+        outbuf = out->conv;
+        outsize = OUTSIZE * 2;
+        ret = iconv(out->cd, &inbuf, &insize, &outbuf, &outsize);
+        if (outbuf > out->conv)
+            putraw(out, out->conv, outbuf - out->conv);
+        if (ret != (size_t) (-1) || errno == E2BIG)
+            continue;
+        if (errno == EINVAL && !final)
+            break;
+        inbuf++;
+        insize--;
+    }
+
+    if (final) {
+        outbuf = out->conv;
+        outsize = OUTSIZE * 2;
+        iconv(out->cd, NULL, NULL, &outbuf, &outsize);
+        if (outbuf > out->conv)
+            putraw(out, out->conv, outbuf - out->conv);
+    }
+
+    memmove(out->data, inbuf, insize);
+    out->len = insize;
+}
+
+/**
+ * 关闭输出缓冲区，写出剩余内容并刷新文件，不关闭文件
+ * @param out 输出缓冲区
+ */
+static void closeout(struct output *out)
+{
+    writeout(out, 1);
+    fflush(out->fp);
+    free(out->data);
+    free(out->conv);
+    out->data = NULL;
+    out->conv = NULL;
+}
+
+/**
+ * 向输出缓冲区追加文本，块满时写出
+ * @param out  输出缓冲区
+ * @param text 文本
+ * @param len  文本字节数
+ */
+static void putbuf(struct output *out, const char *text, size_t len)
+{
+    size_t size;
+
+    while (len > 0) {
+        size = OUTSIZE - out->len < len ? OUTSIZE - out->len : len;
+        memcpy(out->data + out->len, text, size);
+        out->len += size;
+        text += size;
+        len -= size;
+        if (out->len == OUTSIZE)
+            writeout(out, 0);
+    }
+}
+
+/**
+ * 向输出缓冲区追加字符串，NULL与printf一样输出为"(null)"
+ * @param out  输出缓冲区
+ * @param text 字符串
+ */
+static inline void putstr(struct output *out, const char *text)
+{
+    text = text ? text : "(null)";
+    putbuf(out, text, strlen(text));
+}
+
+/**
+ * 按宽度对齐追加字符串，与printf的"%[-]WIDTHs"相同
+ * @param out   输出缓冲区
+ * @param text  字符串
+ * @param width 宽度
+ * @param left  是否左对齐
+ */
+static void putpad(struct output *out, const char *text, int width, int left)
+{
+    static const char spaces[] = "                                ";
+    size_t len, pad, size;
+
+    text = text ? text : "(null)";
+    len = strlen(text);
+    pad = (size_t) width > len ? width - len : 0;
+
+    if (left)
+        putbuf(out, text, len);
+    for (; pad > 0; pad -= size) {
+        size = pad < sizeof(spaces) - 1 ? pad : sizeof(spaces) - 1;
+        putbuf(out, spaces, size);
+    }
+    if (!left)
+        putbuf(out, text, len);
+}
+
+/**
+ * 按指定格式向输出缓冲区追加字符串
+ * @param out 输出缓冲区
+ * @param fmt 格式字符串
+ * @param ...
+ */
+static void putfmt(struct output *out, const char *fmt, ...)
+{
+    int len;
+    va_list ap;
+    char *buf = NULL;
+
+    va_start(ap, fmt);
+
+    if ((len = vasprintf(&buf, fmt, ap)) >= 0) {
+        putbuf(out, buf, len);
+        free(buf);
+    }
+
+    va_end(ap);
+}
+
+/**
+ * 向编译后的格式添加一项
+ * @param tpl   编译后的格式
+ * @param field 字段，-1表示字面文本
+ * @param width 宽度
+ * @param left  是否左对齐
+ * @param pos   字面文本的位置
+ * @param len   字面文本的字节数
+ */
+static void addop(struct template *tpl, int field, int width, int left, size_t pos, size_t len)
+{
+    struct fmtop *ops;
+
+    // 连续的字面文本合并为一项
+    if (field < 0 && tpl->count > 0 && tpl->ops[tpl->count - 1].field < 0) {
+        tpl->ops[tpl->count - 1].len += len;
+        return;
+    }
+
+    if (!(ops = (struct fmtop *) realloc(tpl->ops, (tpl->count + 1) * sizeof(*ops))))
+        return;
+
+    tpl->ops = ops;
+    tpl->ops[tpl->count].field = field;
+    tpl->ops[tpl->count].width = width;
+    tpl->ops[tpl->count].left = left;
+    tpl->ops[tpl->count].pos = pos;
+    tpl->ops[tpl->count].len = len;
+    tpl->count++;
+}
+
+/**
+ * 编译输出格式，规则与逐字符解释时相同：
+ * "%[-][WIDTH]X"输出字段X，"%%"输出'%'，'\\'转义，其余字符原样输出，不完整的说明符被忽略
+ * @param fmt 格式字符串
+ * @param tpl 编译后的格式，用freefmt释放
+ * @return    编译成功返回0，否则返回非0
+ */
+static int compilefmt(const char *fmt, struct template *tpl)
+{
+    int idx;
+    size_t len = 0;
+    char ch;
+    const char *p, *q, *k;
+
+    memset(tpl, 0, sizeof(*tpl));
+
+    // 字面文本不会比格式字符串长
+    if (!(tpl->literal = (char *) malloc(strlen(fmt) + 1)))
+        return -1;
+
+    for (idx = -1, q = NULL, p = fmt; *p; idx = -1, p++) {
+        switch (*p) {
+            case *FIELD_CHR_PATH:
+                idx = FIELD_IDX_PATH;
+                break;
+            case *FIELD_CHR_MARK:
+                idx = FIELD_IDX_MARK;
+                break;
+            case *FIELD_CHR_NAME:
+                idx = FIELD_IDX_NAME;
+                break;
+            case *FIELD_CHR_PATTERN:
+                idx = FIELD_IDX_PATTERN;
+                break;
+            case *FIELD_CHR_COMPACT:
+                idx = FIELD_IDX_COMPACT;
+                break;
+            case *FIELD_CHR_LINE:
+                idx = FIELD_IDX_LINE;
+                break;
+            case *FIELD_CHR_ENDL:
+                idx = FIELD_IDX_ENDL;
+                break;
+            case *FIELD_CHR_LANG:
+                idx = FIELD_IDX_LANG;
+                break;
+            case *FIELD_CHR_ROLE:
+                idx = FIELD_IDX_ROLE;
+                break;
+            case *FIELD_CHR_KIND:
+                idx = FIELD_IDX_KIND;
+                break;
+            case *FIELD_CHR_TYPE:
+                idx = FIELD_IDX_TYPE;
+                break;
+            case *FIELD_CHR_SIGN:
+                idx = FIELD_IDX_SIGN;
+                break;
+            case *FIELD_CHR_ACCESS:
+                idx = FIELD_IDX_ACCESS;
+                break;
+            case *FIELD_CHR_INHERIT:
+                idx = FIELD_IDX_INHERIT;
+                break;
+            case *FIELD_CHR_IMPL:
+                idx = FIELD_IDX_IMPL;
+                break;
+            case *FIELD_CHR_KSCOPE:
+                idx = FIELD_IDX_KSCOPE;
+                break;
+            case *FIELD_CHR_NSCOPE:
+                idx = FIELD_IDX_NSCOPE;
+                break;
+            case *FIELD_CHR_EXTRAS:
+                idx = FIELD_IDX_EXTRAS;
+                break;
+            case '%':
+                q = q ? NULL : p;
+                break;
+            default:
+                break;
+        }
+        if (!q) {
+            ch = *p;
+            if (ch == '\\')
+                switch (*++p) {
+                    case 'a':
+                        ch = '\a';
+                        break;
+                    case 'b':
+                        ch = '\b';
                         break;
                     case 'f':
                         ch = '\f';
@@ -444,319 +1639,988 @@ static void echofmt(FILE *fp, iconv_t cd, const char *cwd, const char *fmt, char
                     case '\\':
                         ch = '\\';
                         break;
+                    case '\0':
+                        // 末尾单独的'\\'，不能越过结束符
+                        p--;
+                        ch = '?';
+                        break;
                     default:
                         ch = '?';
                         break;
                 }
-            print(fp, cd, "%c", ch);
+            tpl->literal[len] = ch;
+            addop(tpl, -1, 0, 0, len++, 1);
         } else if (idx >= 0) {
             for (k = q + 1 + (q[1] == '-'); k < p && isdigit(*k); k++);
-            if (k == p && (len = p - q) < sizeof(buf) - 2) {
-                strncpy(buf, q, len);
-                strcpy(buf + len, "s");
-                field = fields[idx];
-                if (idx == FIELD_IDX_PATH)
-                    field = torelpath(cwd, field, pathbuf);
-                print(fp, cd, buf, field);
+            if (k == p && p - q < 30) {
+                addop(tpl, idx, (int) strtol(q + 1 + (q[1] == '-'), NULL, 10), q[1] == '-', 0, 0);
+                tpl->used[idx] = 1;
             }
             q = NULL;
         }
     }
+
+    return 0;
+}
+
+/**
+ * 释放编译后的格式
+ * @param tpl 编译后的格式
+ */
+static void freefmt(struct template *tpl)
+{
+    free(tpl->ops);
+    free(tpl->literal);
+    memset(tpl, 0, sizeof(*tpl));
+}
+
+/**
+ * 按编译后的格式输出tag
+ * @param out    输出缓冲区
+ * @param tpl    编译后的格式
+ * @param fields tag内容，未用到的字段可以为NULL
+ */
+static void echofmt(struct output *out, const struct template *tpl, char **fields)
+{
+    const struct fmtop *op;
+
+    if (!fields[FIELD_IDX_MARK] ||
+        !fields[FIELD_IDX_PATH] ||
+        !fields[FIELD_IDX_NAME] ||
+        !fields[FIELD_IDX_KIND] ||
+        !fields[FIELD_IDX_LINE] ||
+        (tpl->used[FIELD_IDX_PATTERN] && !fields[FIELD_IDX_PATTERN]) ||
+        (tpl->used[FIELD_IDX_COMPACT] && !fields[FIELD_IDX_COMPACT]))
+        return;
+
+    for (op = tpl->ops; op < tpl->ops + tpl->count; op++) {
+        if (op->field < 0)
+            putbuf(out, tpl->literal + op->pos, op->len);
+        else if (op->width > 0)
+            putpad(out, fields[op->field], op->width, op->left);
+        else
+            putstr(out, fields[op->field]);
+    }
+}
+
+/**
+ * 输出xml格式tag
+ * @param out    输出缓冲区
+ * @param fields tag内容
+ */
+static void echoxml(struct output *out, char **fields)
+{
+    const char *path = fields[FIELD_IDX_PATH];
+    const char *mark = fields[FIELD_IDX_MARK];
+    const char *name = fields[FIELD_IDX_NAME];
+    const char *pattern = fields[FIELD_IDX_PATTERN];
+    const char *compact = fields[FIELD_IDX_COMPACT];
+    const char *line = fields[FIELD_IDX_LINE];
+    const char *endl = fields[FIELD_IDX_ENDL];
+    const char *lang = fields[FIELD_IDX_LANG];
+    const char *role = fields[FIELD_IDX_ROLE];
+    const char *kind = fields[FIELD_IDX_KIND];
+    const char *type = fields[FIELD_IDX_TYPE];
+    const char *sign = fields[FIELD_IDX_SIGN];
+    const char *access = fields[FIELD_IDX_ACCESS];
+    const char *inherit = fields[FIELD_IDX_INHERIT];
+    const char *impl = fields[FIELD_IDX_IMPL];
+    const char *kscope = fields[FIELD_IDX_KSCOPE];
+    const char *nscope = fields[FIELD_IDX_NSCOPE];
+    const char *extras = fields[FIELD_IDX_EXTRAS];
+
+    if (!mark || !path || !name || !kind || !line || !pattern || !compact)
+        return;
+
+    putstr(out, "<tag mark=\"");
+    putstr(out, mark);
+    putstr(out, "\"><path>");
+    putstr(out, path);
+    putstr(out, "</path><name>");
+    putstr(out, name);
+    putstr(out, "</name><pattern>");
+    putstr(out, pattern);
+    putstr(out, "</pattern><compact>");
+    putstr(out, compact);
+    putstr(out, "</compact><kind>");
+    putstr(out, kind);
+    putstr(out, "</kind><line>");
+    putstr(out, line);
+    putstr(out, "</line>");
+    if (endl && strtoull(endl, NULL, 10)) {
+        putstr(out, "<endl>");
+        putstr(out, endl);
+        putstr(out, "</endl>");
+    }
+    if (lang && *lang) {
+        putstr(out, "<language>");
+        putstr(out, lang);
+        putstr(out, "</language>");
+    }
+    if (kscope && *kscope && nscope && *nscope) {
+        putstr(out, "<scope><kind>");
+        putstr(out, kscope);
+        putstr(out, "</kind><name>");
+        putstr(out, nscope);
+        putstr(out, "</name></scope>");
+    }
+    if (type && *type) {
+        putstr(out, "<type>");
+        putstr(out, type);
+        putstr(out, "</type>");
+    }
+    if (inherit && *inherit) {
+        putstr(out, "<inherits>");
+        putstr(out, inherit);
+        putstr(out, "</inherits>");
+    }
+    if (access && *access) {
+        putstr(out, "<access>");
+        putstr(out, access);
+        putstr(out, "</access>");
+    }
+    if (impl && *impl) {
+        putstr(out, "<implementation>");
+        putstr(out, impl);
+        putstr(out, "</implementation>");
+    }
+    if (sign && *sign) {
+        putstr(out, "<signature>");
+        putstr(out, sign);
+        putstr(out, "</signature>");
+    }
+    if (role && *role) {
+        putstr(out, "<roles>");
+        putstr(out, role);
+        putstr(out, "</roles>");
+    }
+    if (extras && *extras) {
+        putstr(out, "<extras>");
+        putstr(out, extras);
+        putstr(out, "</extras>");
+    }
+    putstr(out, "</tag>\n");
+}
+
+/**
+ * 输出ctags格式tag
+ * @param out    输出缓冲区
+ * @param fields tag内容
+ */
+static void echotag(struct output *out, char **fields)
+{
+    const char *path = fields[FIELD_IDX_PATH];
+    const char *name = fields[FIELD_IDX_NAME];
+    const char *pattern = fields[FIELD_IDX_PATTERN];
+    const char *line = fields[FIELD_IDX_LINE];
+    const char *endl = fields[FIELD_IDX_ENDL];
+    const char *lang = fields[FIELD_IDX_LANG];
+    const char *role = fields[FIELD_IDX_ROLE];
+    const char *kind = fields[FIELD_IDX_KIND];
+    const char *type = fields[FIELD_IDX_TYPE];
+    const char *sign = fields[FIELD_IDX_SIGN];
+    const char *access = fields[FIELD_IDX_ACCESS];
+    const char *inherit = fields[FIELD_IDX_INHERIT];
+    const char *impl = fields[FIELD_IDX_IMPL];
+    const char *kscope = fields[FIELD_IDX_KSCOPE];
+    const char *nscope = fields[FIELD_IDX_NSCOPE];
+    const char *extras = fields[FIELD_IDX_EXTRAS];
+
+    if (!path || !name || !kind || !line || !pattern)
+        return;
+
+    putstr(out, name);
+    putstr(out, "\t");
+    putstr(out, path);
+    putstr(out, "\t");
+    putstr(out, pattern);
+    putstr(out, ";\"\tkind:");
+    putstr(out, kind);
+    putstr(out, "\tline:");
+    putstr(out, line);
+    if (lang && *lang) {
+        putstr(out, "\tlanguage:");
+        putstr(out, lang);
+    }
+    if (kscope && *kscope && nscope && *nscope) {
+        putstr(out, "\tscope:");
+        putstr(out, kscope);
+        putstr(out, ":");
+        putstr(out, nscope);
+    }
+    if (type && *type) {
+        putstr(out, "\t");
+        putstr(out, type);
+    }
+    if (extras && strstr(extras, "fileScope"))
+        putstr(out, "\tfile:");
+    if (inherit && *inherit) {
+        putstr(out, "\tinherits:");
+        putstr(out, inherit);
+    }
+    if (access && *access) {
+        putstr(out, "\taccess:");
+        putstr(out, access);
+    }
+    if (impl && *impl) {
+        putstr(out, "\timplementation:");
+        putstr(out, impl);
+    }
+    if (sign && *sign) {
+        putstr(out, "\tsignature:");
+        putstr(out, sign);
+    }
+    if (role && *role) {
+        putstr(out, "\troles:");
+        putstr(out, role);
+    }
+    if (extras && *extras) {
+        putstr(out, "\textras:");
+        putstr(out, extras);
+    }
+    if (endl && strtoull(endl, NULL, 10)) {
+        putstr(out, "\tend:");
+        putstr(out, endl);
+    }
+    putstr(out, "\n");
+}
+
+/**
+ * 获取数据库游标或快照游标当前行指定列的文本
+ * @param cur  数据库游标，scur为NULL时使用
+ * @param scur 快照游标
+ * @param col  列号
+ * @return     列的文本
+ */
+static inline char *coltext(cursor_t cur, snapcur_t scur, int col)
+{
+    return (char *) (scur ? snapcoltext(scur, col) : dbcoltext(cur, col));
+}
+
+/**
+ * 按指定格式输出游标的当前行，只读取格式用到的字段
+ * @param out    输出缓冲区
+ * @param tpl    编译后的格式，tagfmt为TAGPATH、TAGXML、TAGCTAGS时不使用
+ * @param tagfmt tag输出格式
+ * @param cur    数据库游标
+ * @param scur   快照游标，不为NULL时代替cur
+ */
+static void echorow(struct output *out, const struct template *tpl, unsigned char tagfmt, cursor_t cur, snapcur_t scur)
+{
+    int idx;
+    char *fields[FIELD_MAX];
+
+    switch (tagfmt) {
+        case TAGPATH:
+            if ((fields[0] = coltext(cur, scur, 0))) {
+                putstr(out, fields[0]);
+                putstr(out, "\n");
+            }
+            break;
+        case TAGXML:
+            for (idx = 0; idx < FIELD_MAX; idx++)
+                fields[idx] = coltext(cur, scur, idx);
+            echoxml(out, fields);
+            break;
+        case TAGCTAGS:
+            for (idx = 0; idx < FIELD_MAX; idx++)
+                fields[idx] = idx == FIELD_IDX_MARK || idx == FIELD_IDX_COMPACT ? NULL : coltext(cur, scur, idx);
+            echotag(out, fields);
+            break;
+        default:
+            for (idx = 0; idx < FIELD_MAX; idx++) {
+                if (tpl->used[idx] || idx == FIELD_IDX_MARK || idx == FIELD_IDX_PATH || idx == FIELD_IDX_NAME ||
+                    idx == FIELD_IDX_KIND || idx == FIELD_IDX_LINE)
+                    fields[idx] = coltext(cur, scur, idx);
+                else
+                    fields[idx] = NULL;
+            }
+            echofmt(out, tpl, fields);
+            break;
+    }
+}
+
+/**
+ * 将数据库指定内容转储到输出缓冲区，结果逐行读取和输出，内存占用与结果集大小无关
+ * @param out    输出缓冲区
+ * @param db     数据库句柄
+ * @param snap   快照句柄，不为NULL时由快照回答查询，opcode须满足SNAP_OPCODE
+ * @param mode   数据库模式
+ * @param total  是否显示tags条数
+ * @param tagfmt tag输出格式
+ * @param opcode 查询操作码
+ * @param search 查询内容
+ */
+static void dumptag(struct output *out, db_t db, snap_t snap,
+                    unsigned char mode,
+                    unsigned char total,
+                    unsigned char tagfmt,
+                    unsigned char opcode,
+                    const char *search)
+{
+    int64_t count = 0;
+    int rows = 0;
+    int prev = statphase(STAT_QUERY);
+    cursor_t cur = NULL;
+    snapcur_t scur = NULL;
+    struct template tpl;
+
+    if (snap)
+        scur = snapfind(snap, mode, opcode, search);
+    else if (!opcode)
+        cur = dbfindtags(db, mode, search);
+    else if (opcode == 10)
+        cur = dbfindpath(db, mode, search);
+    else
+        cur = dbreadtags(db, mode, opcode, search);
+
+    if (!cur && !scur) {
+        statphase(prev);
+        return;
+    }
+
+    if (opcode == 10)
+        tagfmt = TAGPATH;
+
+    // 总行数需在结果之前输出，先单独统计行数，结果仍逐行输出，两者在dbcount开始的同一读事务中
+    if (total && (count = scur ? snapcount(scur) : dbcount(cur)) < 0) {
+        if (scur)
+            snapfinish(scur);
+        else
+            dbfinish(cur);
+        statphase(prev);
+        return;
+    }
+
+    // 格式只编译一次，之后每行按编译结果输出
+    if (compilefmt(tagformats[tagfmt] ? tagformats[tagfmt] : "", &tpl)) {
+        if (scur)
+            snapfinish(scur);
+        else
+            dbfinish(cur);
+        statphase(prev);
+        return;
+    }
+
+    statphase(STAT_FORMAT);
+
+    if (total) {
+        switch (tagfmt) {
+            case TAGXML:
+                putstr(out, "xml: ");
+                break;
+            case TAGXREF:
+                putstr(out, "xref: ");
+                break;
+            case TAGCTAGS:
+                putstr(out, "ctags: ");
+                break;
+            case TAGCSCOPE:
+                putstr(out, "cscope: ");
+                break;
+            default:
+                putstr(out, "total: ");
+                break;
+        }
+        putfmt(out, "%lld lines\n", (long long) count);
+    }
+
+    // 统计时每行在查询和格式化两个阶段之间切换，不统计时statphase直接返回
+    statphase(STAT_QUERY);
+
+    while ((scur ? snapstep(scur) : dbstep(cur)) > 0) {
+        statphase(STAT_FORMAT);
+        echorow(out, &tpl, tagfmt, cur, scur);
+        statphase(STAT_QUERY);
+        rows++;
+    }
+
+    freefmt(&tpl);
+    if (scur)
+        snapfinish(scur);
+    else
+        dbfinish(cur);
+
+    if (statmine())
+        stats.rows += rows;
+
+    statphase(prev);
+}
+
+/**
+ * 将查询结果输出到文件或标准输出，输出到文件时按格式加上文件头和文件尾
+ * @param db     数据库句柄
+ * @param snap   快照句柄，参见dumptag
+ * @param output 输出文件路径，NULL表示标准输出
+ * @param encode 输出编码，NULL表示UTF-8
+ * @param mode   数据库模式
+ * @param total  是否显示tags条数
+ * @param tagfmt tag输出格式
+ * @param opcode 查询操作码
+ * @param search 查询内容
+ */
+static void dumpout(db_t db, snap_t snap, const char *output, const char *encode,
+                    unsigned char mode,
+                    unsigned char total,
+                    unsigned char tagfmt,
+                    unsigned char opcode,
+                    const char *search)
+{
+    FILE *fp = output ? fopen(output, "w") : NULL;
+    iconv_t cd = fp && encode ? iconv_open(encode, "UTF-8") : NULL;
+    struct output dump;
+
+    if (!openout(&dump, fp ? fp : stdout, cd)) {
+        if (fp && tagfmt == TAGXML) {
+            putfmt(&dump, "<?xml version=\"1.0\" encoding=\"%s\">\n", encode ? encode : "UTF-8");
+            putstr(&dump, "<tags>\n");
+        } else if (fp && tagfmt == TAGCTAGS) {
+            if (encode)
+                putfmt(&dump, "!_TAG_FILE_ENCODING\t%s\t//\n", encode);
+            putstr(&dump, "!_TAG_FILE_FORMAT\t2\t/extended format; --format=1 will not append ;\" to lines/\n");
+            putstr(&dump, "!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted, 2=foldcase/\n");
+        }
+
+        dumptag(&dump, db, snap, mode, total, tagfmt, opcode, search);
+
+        if (fp && tagfmt == TAGXML)
+            putstr(&dump, "</tags>");
+        closeout(&dump);
+        if (statmine())
+            stats.bytes += dump.size;
+    }
+
+    if (fp)
+        fclose(fp);
+    if (cd && cd != (iconv_t) (-1))
+        iconv_close(cd);
+}
+
+/**
+ * 行模式接口：执行一条查询命令，结果按cscope行模式格式输出
+ * @param line    命令，执行时会被修改
+ * @param out     结果输出
+ * @param err     错误信息输出
+ * @param db      数据库句柄
+ * @param session 会话状态，查询模式和调用图层数在命令之间保留
+ * @return        收到退出命令返回非0，否则返回0
+ */
+static int servecmd(char *line, FILE *out, FILE *err, db_t db, struct session *session)
+{
+    int tmp, depth;
+    char opcode;
+    char regexp = (session->mode & DB_REGEX) != 0;
+    char exmode = (session->mode & DB_EXREG) != 0;
+    char caseless = (session->mode & DB_ICASE) != 0;
+    char *temp, *search;
+    struct output output;
+
+    for (temp = line + strlen(line); temp > line && isspace(temp[-1]); temp--);
+    for (temp[0] = '\0', temp = line; *temp && isspace(*temp); temp++);
+    for (opcode = 0, search = NULL; *temp && *temp == '5'; temp++)
+        regexp = 1;
+    tmp = *temp++;
+    switch (tmp) {
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '6':
+        case '8':
+        case '9':
+            opcode = ch2code(tmp);
+            exmode = opcode == 6;
+            search = temp;
+            break;
+        case '7':
+            opcode = 10;
+            search = temp;
+            break;
+        case 'r':
+            opcode = 7;
+            search = temp;
+            break;
+        case '<':
+            opcode = 11;
+            search = temp;
+            break;
+        case '>':
+            opcode = 12;
+            search = temp;
+            break;
+        case 'D':
+            if ((depth = atoi(temp)) < 1)
+                fprintf(err, PROGRAM_NAME ": invalid depth '%s'.\n", temp);
+            else
+                session->depth = depth;
+            break;
+        case 'e':
+            regexp = 1;
+            exmode = 0;
+            opcode = 0;
+            search = temp;
+            break;
+        case 'E':
+            regexp = 1;
+            exmode = 1;
+            opcode = 0;
+            search = temp;
+            break;
+        case 'c':
+            caseless = !caseless;
+            break;
+        case 'C':
+            caseless = 1;
+            break;
+        case 'R':
+            regexp = 0;
+            exmode = 0;
+            caseless = 0;
+            break;
+        case 'F':
+            break;
+        case 'q':
+            return 1;
+        default:
+            if (tmp)
+                fprintf(err, PROGRAM_NAME ": unknown command '%c%s'.\n", tmp, search ? search : "");
+            break;
+    }
+
+    session->mode = (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0);
+
+    if ((opcode || search) && !openout(&output, out, NULL)) {
+        dbdepth(db, session->depth);
+        dumptag(&output, db, NULL, session->mode | DB_MATCH, 1, TAGCSCOPE, opcode, search);
+        closeout(&output);
+        if (statmine())
+            stats.bytes += output.size;
+    }
+
+    return 0;
 }
 
 /**
- * 输出xml格式tag
- * @param fp      文件句柄
- * @param cd      编码句柄
- * @param path    tag所属文件路径
- * @param mark    tag标记
- * @param name    tag名称
- * @param pattern tag地址模式
- * @param compact tag上下文信息
- * @param line    tag开始行
- * @param endl    tag结束行
- * @param lang    tag所属语言
- * @param role    tag角色
- * @param kind    tag类型
- * @param type    tag类型名称
- * @param sign    tag签名
- * @param access  tag访问属性
- * @param inherit tag继承属性
- * @param impl    tag实现
- * @param kscope  tag作用域类型
- * @param nscope  tag作用域名称
- * @param extras  tag额外信息
- */
-static void echoxml(FILE *fp, iconv_t cd, const char *cwd,
-                    const char *path,
-                    const char *mark,
-                    const char *name,
-                    const char *pattern,
-                    const char *compact,
-                    const char *line,
-                    const char *endl,
-                    const char *lang,
-                    const char *role,
-                    const char *kind,
-                    const char *type,
-                    const char *sign,
-                    const char *access,
-                    const char *inherit,
-                    const char *impl,
-                    const char *kscope,
-                    const char *nscope,
-                    const char *extras)
+ * 行模式接口：逐行读取查询命令，结果按cscope行模式格式输出
+ * @param in    命令输入
+ * @param out   结果输出
+ * @param db    数据库句柄
+ * @param mode  初始的查询模式
+ * @param depth 初始的调用图层数
+ */
+static void serveline(FILE *in, FILE *out, db_t db, unsigned char mode, int depth)
 {
-    char pathbuf[(PATH_MAX + 1) * 3] = {0};
+    size_t linesz = 0;
+    char *line = NULL;
+    struct session session = {.mode = mode, .depth = depth};
 
-    if (!mark || !path || !name || !kind || !line || !pattern || !compact)
-        return;
+    while ((fprintf(out, PROMPT), fflush(out), getline(&line, &linesz, in)) > 0 &&
+           !servecmd(line, out, stderr, db, &session));
 
-    path = torelpath(cwd, path, pathbuf);
-
-    print(fp, cd, "<tag mark=\"%s\">", mark);
-    print(fp, cd,
-          "<path>%s</path>"
-          "<name>%s</name>"
-          "<pattern>%s</pattern>"
-          "<compact>%s</compact>"
-          "<kind>%s</kind>"
-          "<line>%s</line>",
-          path,
-          name,
-          pattern,
-          compact,
-          kind,
-          line);
-    if (endl && strtoull(endl, NULL, 10))
-        print(fp, cd, "<endl>%s</endl>", endl);
-    if (lang && *lang)
-        print(fp, cd, "<language>%s</language>", lang);
-    if (kscope && *kscope && nscope && *nscope) {
-        print(fp, cd, "<scope>");
-        print(fp, cd, "<kind>%s</kind>", kscope);
-        print(fp, cd, "<name>%s</name>", nscope);
-        print(fp, cd, "</scope>");
-    }
-    if (type && *type)
-        print(fp, cd, "<type>%s</type>", type);
-    if (inherit && *inherit)
-        print(fp, cd, "<inherits>%s</inherits>", inherit);
-    if (access && *access)
-        print(fp, cd, "<access>%s</access>", access);
-    if (impl && *impl)
-        print(fp, cd, "<implementation>%s</implementation>", impl);
-    if (sign && *sign)
-        print(fp, cd, "<signature>%s</signature>", sign);
-    if (role && *role)
-        print(fp, cd, "<roles>%s</roles>", role);
-    if (extras && *extras)
-        print(fp, cd, "<extras>%s</extras>", extras);
-    print(fp, cd, "</tag>\n");
+    free(line);
 }
 
 /**
- * 输出ctags格式tag
- * @param fp      文件句柄
- * @param cd      编码句柄
- * @param path    tag所属文件路径
- * @param mark    tag标记
- * @param name    tag名称
- * @param pattern tag地址模式
- * @param compact tag上下文信息
- * @param line    tag开始行
- * @param endl    tag结束行
- * @param lang    tag所属语言
- * @param role    tag角色
- * @param kind    tag类型
- * @param type    tag类型名称
- * @param sign    tag签名
- * @param access  tag访问属性
- * @param inherit tag继承属性
- * @param impl    tag实现
- * @param kscope  tag作用域类型
- * @param nscope  tag作用域名称
- * @param extras  tag额外信息
- */
-static void echotag(FILE *fp, iconv_t cd, const char *cwd,
-                    const char *path,
-                    const char *name,
-                    const char *pattern,
-                    const char *line,
-                    const char *endl,
-                    const char *lang,
-                    const char *role,
-                    const char *kind,
-                    const char *type,
-                    const char *sign,
-                    const char *access,
-                    const char *inherit,
-                    const char *impl,
-                    const char *kscope,
-                    const char *nscope,
-                    const char *extras)
+ * 从连接已读入的内容中取出一行命令，连接已关闭时最后不完整的一行也作为命令
+ * @param client 连接
+ * @return       取出命令返回1，没有完整的命令返回0，内存不足返回-1
+ */
+static int takeline(struct client *client)
 {
-    char pathbuf[(PATH_MAX + 1) * 3] = {0};
+    size_t len;
+    char *end = client->len ? (char *) memchr(client->buf, '\n', client->len) : NULL;
 
-    if (!path || !name || !kind || !line || !pattern)
-        return;
+    if (!end && !(client->eof && client->len))
+        return 0;
 
-    path = torelpath(cwd, path, pathbuf);
+    len = end ? (size_t) (end - client->buf) + 1 : client->len;
 
-    print(fp, cd, "%s\t%s\t%s;\"\tkind:%s\tline:%s", name, path, pattern, kind, line);
-    if (lang && *lang)
-        print(fp, cd, "\tlanguage:%s", lang);
-    if (kscope && *kscope && nscope && *nscope)
-        print(fp, cd, "\tscope:%s:%s", kscope, nscope);
-    if (type && *type)
-        print(fp, cd, "\t%s", type);
-    if (extras && strstr(extras, "fileScope"))
-        print(fp, cd, "\tfile:");
-    if (inherit && *inherit)
-        print(fp, cd, "\tinherits:%s", inherit);
-    if (access && *access)
-        print(fp, cd, "\taccess:%s", access);
-    if (impl && *impl)
-        print(fp, cd, "\timplementation:%s", impl);
-    if (sign && *sign)
-        print(fp, cd, "\tsignature:%s", sign);
-    if (role && *role)
-        print(fp, cd, "\troles:%s", role);
-    if (extras && *extras)
-        print(fp, cd, "\textras:%s", extras);
-    if (endl && strtoull(endl, NULL, 10))
-        print(fp, cd, "\tend:%s", endl);
-    print(fp, cd, "\n");
+    if (!(client->line = (char *) malloc(len + 1)))
+        return -1;
+
+    memcpy(client->line, client->buf, len);
+    client->line[len] = '\0';
+    memmove(client->buf, client->buf + len, client->len - len);
+    client->len -= len;
+
+    return 1;
 }
 
 /**
- * 将数据库指定内容转储到文件
- * @param fp     文件句柄
- * @param cd     编码句柄
- * @param db     数据库句柄
- * @param mode   数据库模式
- * @param total  是否显示tags条数
- * @param tagfmt tag输出格式
- * @param opcode 查询操作码
- * @param search 查询内容
+ * 读入连接上可读的内容
+ * @param client 连接
  */
-static void dumptag(FILE *fp, iconv_t cd, db_t db,
-                    unsigned char mode,
-                    unsigned char total,
-                    unsigned char tagfmt,
-                    unsigned char opcode,
-                    const char *search,
-                    const char *cwd)
+static void readclient(struct client *client)
 {
-    int row, rows = 0, cols = 0;
-    char **table = NULL;
+    ssize_t len;
+    size_t size;
+    char *buf;
+
+    if (client->len + BUFSIZ > client->size) {
+        size = client->size ? client->size * 2 : BUFSIZ * 2;
+        if (!(buf = (char *) realloc(client->buf, size))) {
+            client->done = 1;
+            return;
+        }
+        client->buf = buf;
+        client->size = size;
+    }
 
-    if (!opcode)
-        table = dbfindtags(db, mode, search, &rows, &cols);
-    else if (opcode > 9)
-        table = dbfindpath(db, mode, search, &rows, &cols);
+    while ((len = read(client->fd, client->buf + client->len, client->size - client->len)) < 0 && errno == EINTR);
+
+    if (len > 0)
+        client->len += len;
     else
-        table = dbreadtags(db, mode, opcode, search, &rows, &cols);
+        client->eof = 1;
+}
 
-    if (!table)
-        return;
+/**
+ * 服务线程：用自己的只读数据库连接依次执行队列中各连接的一行命令，结果和错误信息写回连接
+ * @param arg 服务线程的参数
+ * @return    NULL
+ */
+static void *servethread(void *arg)
+{
+    int quit;
+    struct client *client;
+    db_t db = ((struct servedb *) arg)->db;
+    struct server *server = ((struct servedb *) arg)->server;
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->head)
+            pthread_cond_wait(&server->ready, &server->lock);
+        client = server->head;
+        if (!(server->head = client->link))
+            server->tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        if (!(quit = servecmd(client->line, client->out, client->out, db, &client->session)))
+            fputs(PROMPT, client->out);
+        fflush(client->out);
+
+        free(client->line);
+        client->line = NULL;
+
+        pthread_mutex_lock(&server->lock);
+        client->busy = 0;
+        client->done = quit || ferror(client->out);
+        pthread_mutex_unlock(&server->lock);
+
+        // 唤醒分派线程重新等待此连接
+        while (write(server->wake[1], "", 1) < 0 && errno == EINTR);
+    }
 
-    if (total) {
-        switch (tagfmt) {
-            case TAGXML:
-                print(fp, cd, "xml: ");
-                break;
-            case TAGXREF:
-                print(fp, cd, "xref: ");
-                break;
-            case TAGCTAGS:
-                print(fp, cd, "ctags: ");
-                break;
-            case TAGCSCOPE:
-                print(fp, cd, "cscope: ");
+    dbclose(db);
+
+    return NULL;
+}
+
+/**
+ * 分派线程：等待新的连接和空闲连接上的命令，每读到完整的一行命令就放入队列，
+ * 同一连接同时只有一条命令在执行，结果写完后才读取它的下一条命令
+ * @param arg 服务参数
+ * @return    NULL
+ */
+static void *servepoll(void *arg)
+{
+    int cnt, idx, size = 0;
+    int *fds = NULL;
+    char *ready = NULL, buf[64];
+    FILE *in, *out;
+    struct client *client, **prev, **polled = NULL;
+    struct server *server = (struct server *) arg;
+
+    for (;;) {
+        cnt = 0;
+        pthread_mutex_lock(&server->lock);
+        for (prev = &server->clients; (client = *prev);) {
+            if (!client->busy && !client->done && (idx = takeline(client)) != 0) {
+                if (idx < 0) {
+                    client->done = 1;
+                } else {
+                    client->busy = 1;
+                    client->link = NULL;
+                    if (server->tail)
+                        server->tail->link = client;
+                    else
+                        server->head = client;
+                    server->tail = client;
+                    pthread_cond_signal(&server->ready);
+                }
+            }
+            if (!client->busy && (client->done || client->eof)) {
+                *prev = client->next;
+                fclose(client->in);
+                fclose(client->out);
+                free(client->buf);
+                free(client);
+                continue;
+            }
+            prev = &client->next;
+            if (!client->busy)
+                cnt++;
+        }
+
+        if (cnt + 2 > size) {
+            size = (cnt + 2) * 2;
+            fds = (int *) realloc(fds, size * sizeof(*fds));
+            ready = (char *) realloc(ready, size);
+            polled = (struct client **) realloc(polled, size * sizeof(*polled));
+            if (!fds || !ready || !polled) {
+                pthread_mutex_unlock(&server->lock);
                 break;
-            default:
-                print(fp, cd, "total: ");
+            }
+        }
+
+        fds[0] = server->sock;
+        fds[1] = server->wake[0];
+        for (cnt = 2, client = server->clients; client; client = client->next) {
+            if (!client->busy) {
+                polled[cnt] = client;
+                fds[cnt++] = client->fd;
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        if (taskselect(fds, ready, cnt) < 0)
+            break;
+
+        if (ready[1])
+            while (read(server->wake[0], buf, sizeof(buf)) < 0 && errno == EINTR);
+
+        // 空闲的连接只由本线程访问，读取时无需加锁
+        for (idx = 2; idx < cnt; idx++) {
+            if (ready[idx])
+                readclient(polled[idx]);
+        }
+
+        if (ready[0] && taskaccept(server->sock, &in, &out) == 0) {
+            if (!(client = (struct client *) calloc(1, sizeof(*client)))) {
+                fclose(in);
+                fclose(out);
+                continue;
+            }
+            client->fd = fileno(in);
+            client->in = in;
+            client->out = out;
+            client->session.mode = server->mode;
+            client->session.depth = server->depth;
+            fputs(PROMPT, out);
+            fflush(out);
+            pthread_mutex_lock(&server->lock);
+            client->next = server->clients;
+            server->clients = client;
+            pthread_mutex_unlock(&server->lock);
+        }
+    }
+
+    echoerr("serve stopped.\n");
+
+    free(fds);
+    free(ready);
+    free(polled);
+
+    return NULL;
+}
+
+/**
+ * 在本地套接字上提供行模式接口，连接数不限，count个服务线程按行执行各连接的命令
+ * 各服务线程的只读数据库连接在监听之前打开，一个都打不开时不提供服务，以免队列中的命令无人执行
+ * @param server 服务参数
+ * @param path   套接字文件路径
+ * @param block  非0时当前线程作为分派线程，不再返回
+ * @return       打开数据库、监听或创建服务线程失败返回非0，否则返回0
+ */
+static int servesock(struct server *server, const char *path, int block)
+{
+    int idx, count = 0;
+    pthread_t tid;
+    struct servedb *dbs;
+
+    // 服务线程不会退出，dbs及其中的连接一直使用到进程结束
+    dbs = (struct servedb *) calloc(server->count, sizeof(*dbs));
+    for (idx = 0; dbs && idx < server->count; idx++) {
+        if ((dbs[count].db = dbopen(server->pwd, server->dbpath, (server->mode & DB_ICASE) | DB_RDONLY))) {
+            dbs[count].server = server;
+            dbview(dbs[count].db, server->cwd);
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        echoerr("open database failed.\n");
+        free(dbs);
+        return 1;
+    }
+
+    if ((server->sock = tasklisten(path)) < 0 || taskpipe(server->wake) != 0) {
+        echoerr("listen on '%s' failed.\n", path);
+        for (idx = 0; idx < count; idx++)
+            dbclose(dbs[idx].db);
+        free(dbs);
+        return 1;
+    }
+
+    if (debugmode)
+        echomsg("serve on %s\n", path);
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->ready, NULL);
+
+    for (idx = 0, server->count = 0; idx < count; idx++) {
+        if (pthread_create(&tid, NULL, servethread, &dbs[idx]) == 0) {
+            pthread_detach(tid);
+            server->count++;
+        } else
+            dbclose(dbs[idx].db);
+    }
+
+    if (server->count == 0) {
+        echoerr("create serve thread failed.\n");
+        free(dbs);
+        return 1;
+    }
+
+    if (block)
+        servepoll(server);
+    else if (pthread_create(&tid, NULL, servepoll, server) == 0)
+        pthread_detach(tid);
+
+    return block;
+}
+
+/**
+ * 通过服务端的行模式接口查询：转发标准输入的命令，将结果原样写到标准输出
+ * 行首出现提示符表示结果已输出完毕，之后才读取下一条命令
+ * @param path 套接字文件路径
+ * @return     连接成功返回0，否则返回非0
+ */
+static int connectsock(const char *path)
+{
+    int ch;
+    FILE *in, *out;
+    size_t linesz = 0;
+    char *line = NULL;
+    const char *prompt = PROMPT, *p = prompt;
+
+    if (taskconnect(path, &in, &out) != 0) {
+        echoerr("connect to '%s' failed.\n", path);
+        return 1;
+    }
+
+    while ((ch = fgetc(in)) != EOF) {
+        fputc(ch, stdout);
+        // p为NULL表示当前不在行首，不可能是提示符
+        p = p && ch == *p ? p + 1 : ch == '\n' ? prompt : NULL;
+        if (p && !*p) {
+            fflush(stdout);
+            if (getline(&line, &linesz, stdin) <= 0) {
+                fputs("q\n", out);
+                fflush(out);
                 break;
+            }
+            fputs(line, out);
+            fflush(out);
+            p = prompt;
         }
-        print(fp, cd, "%d lines\n", rows);
     }
 
-    if (opcode > 9)
-        tagfmt = TAGPATH;
+    free(line);
+    fclose(in);
+    fclose(out);
 
-    switch (tagfmt) {
-        case TAGXML:
-            for (row = 1; row <= rows; row++)
-                echoxml(fp, cd, cwd,
-                        table[row * cols + FIELD_IDX_PATH],
-                        table[row * cols + FIELD_IDX_MARK],
-                        table[row * cols + FIELD_IDX_NAME],
-                        table[row * cols + FIELD_IDX_PATTERN],
-                        table[row * cols + FIELD_IDX_COMPACT],
-                        table[row * cols + FIELD_IDX_LINE],
-                        table[row * cols + FIELD_IDX_ENDL],
-                        table[row * cols + FIELD_IDX_LANG],
-                        table[row * cols + FIELD_IDX_ROLE],
-                        table[row * cols + FIELD_IDX_KIND],
-                        table[row * cols + FIELD_IDX_TYPE],
-                        table[row * cols + FIELD_IDX_SIGN],
-                        table[row * cols + FIELD_IDX_ACCESS],
-                        table[row * cols + FIELD_IDX_INHERIT],
-                        table[row * cols + FIELD_IDX_IMPL],
-                        table[row * cols + FIELD_IDX_KSCOPE],
-                        table[row * cols + FIELD_IDX_NSCOPE],
-                        table[row * cols + FIELD_IDX_EXTRAS]);
-            break;
-        case TAGCTAGS:
-            for (row = 1; row <= rows; row++)
-                echotag(fp, cd, cwd,
-                        table[row * cols + FIELD_IDX_PATH],
-                        table[row * cols + FIELD_IDX_NAME],
-                        table[row * cols + FIELD_IDX_PATTERN],
-                        table[row * cols + FIELD_IDX_LINE],
-                        table[row * cols + FIELD_IDX_ENDL],
-                        table[row * cols + FIELD_IDX_LANG],
-                        table[row * cols + FIELD_IDX_ROLE],
-                        table[row * cols + FIELD_IDX_KIND],
-                        table[row * cols + FIELD_IDX_TYPE],
-                        table[row * cols + FIELD_IDX_SIGN],
-                        table[row * cols + FIELD_IDX_ACCESS],
-                        table[row * cols + FIELD_IDX_INHERIT],
-                        table[row * cols + FIELD_IDX_IMPL],
-                        table[row * cols + FIELD_IDX_KSCOPE],
-                        table[row * cols + FIELD_IDX_NSCOPE],
-                        table[row * cols + FIELD_IDX_EXTRAS]);
-            break;
-        default:
-            for (row = 1; row <= rows; row++)
-                echofmt(fp, cd, cwd, tagformats[tagfmt], &table[row * cols]);
-            break;
+    return 0;
+}
+
+/**
+ * 输出--stats的统计结果到标准错误，mode为1时输出可读的摘要，为2时输出JSON
+ * @param db  数据库句柄，为NULL时只输出SQLite的内存使用
+ * @param ctx 上下文，为NULL时表示没有建立索引
+ */
+static void echostats(db_t db, const struct context *ctx)
+{
+    int idx;
+    size_t len;
+    char phases[STAT_COUNT * 32];
+    struct dbstat st;
+    uint64_t files = ctx ? ctx->files : 0;
+    uint64_t tags = ctx ? ctx->tags : 0;
+
+    if (!stats.mode)
+        return;
+
+    // 结束当前阶段，使其时间计入统计
+    statphase(STAT_OTHER);
+    dbstatus(db, &st);
+
+    // JSON供程序解析，不加程序名前缀，整个对象在一行中
+    if (stats.mode == 2) {
+        for (idx = 0, len = 0; idx < STAT_COUNT && len < sizeof(phases); idx++)
+            len += snprintf(phases + len, sizeof(phases) - len, "%s\"%s\": %.3f",
+                            idx ? ", " : "", statnames[idx], stats.time[idx] / 1e6);
+        fprintf(stderr, "{\"total_ms\": %.3f, \"phases_ms\": {%s}, \"parse_ms\": %.3f, \"ctags_cpu_ms\": %.3f, "
+                        "\"files_visited\": %llu, \"files_parsed\": %llu, \"tags_inserted\": %llu, "
+                        "\"rows_returned\": %llu, \"bytes_written\": %llu, "
+                        "\"sqlite\": {\"memory_used\": %lld, \"memory_high\": %lld, \"mallocs\": %lld, "
+                        "\"cache_used\": %lld, \"cache_hit\": %lld, \"cache_miss\": %lld, "
+                        "\"cache_write\": %lld, \"stmt_used\": %lld}}\n",
+                (stats.mark - stats.start) / 1e6, phases, stats.parse / 1e6, stats.ctags / 1e6,
+                (unsigned long long) stats.visited, (unsigned long long) files, (unsigned long long) tags,
+                (unsigned long long) stats.rows, (unsigned long long) stats.bytes,
+                (long long) st.memused, (long long) st.memhigh, (long long) st.mallocs,
+                (long long) st.cacheused, (long long) st.cachehit, (long long) st.cachemiss,
+                (long long) st.cachewrite, (long long) st.stmtused);
+        return;
     }
 
-    dbfree(table);
+    echoerr("total %.3fms\n", (stats.mark - stats.start) / 1e6);
+    for (idx = 0; idx < STAT_COUNT; idx++) {
+        if (stats.time[idx])
+            echoerr("  %-8s %12.3fms\n", statnames[idx], stats.time[idx] / 1e6);
+    }
+    if (stats.parse)
+        echoerr("  %-8s %12.3fms (reader thread)\n", "parse", stats.parse / 1e6);
+    if (stats.ctags)
+        echoerr("  %-8s %12.3fms (cpu of child processes)\n", "ctags", stats.ctags / 1e6);
+    echoerr("files visited %llu, parsed %llu, tags inserted %llu, rows returned %llu, bytes written %llu\n",
+            (unsigned long long) stats.visited, (unsigned long long) files, (unsigned long long) tags,
+            (unsigned long long) stats.rows, (unsigned long long) stats.bytes);
+    echoerr("sqlite memory %lld bytes, peak %lld bytes, %lld allocations, statements %lld bytes\n",
+            (long long) st.memused, (long long) st.memhigh, (long long) st.mallocs, (long long) st.stmtused);
+    if (db)
+        echoerr("sqlite cache %lld bytes, hit %lld, miss %lld, write %lld pages\n",
+                (long long) st.cacheused, (long long) st.cachehit, (long long) st.cachemiss,
+                (long long) st.cachewrite);
 }
 
 int main(int argc, char *const argv[])
 {
     db_t db = NULL;
     FILE *fp = NULL;
-    FILE *si = NULL;
-    FILE *so = NULL;
     char regexp = 0;
     char exmode = 0;
     char opcode = 0;
     char tagfmt = 0;
     char update = 0;
+    char rebuild = 0;
+    char bulk = 0;
     char caseless = 0;
     char linemode = 0;
     char buf[BUFSIZE];
     char cwd[BUFSIZE];
     char pwd[BUFSIZE];
-    int tmp, idx, pid;
+    char sock[BUFSIZE];
+    char bulkpath[BUFSIZE];
+    int tmp, idx;
+    int jobs = 0;
+    int depth = GRAPH_DEPTH;
+    int walkers;
+    int64_t start;
+    char *batch = NULL;
     size_t linesz = 0;
     write_t writeline;
-    iconv_t cd = NULL;
     char *temp = NULL;
     char *line = NULL;
     char *encode = NULL;
@@ -765,14 +2629,37 @@ int main(int argc, char *const argv[])
     char *inpath = NULL;
     char *output = NULL;
     char *prefix = NULL;
-    void *data[5] = {0};
+    char *serve = NULL;
+    char *client = NULL;
+    char *exportsnap = NULL;
+    char *snapshot = NULL;
+    char watch = 0;
+    snap_t snap;
+    struct worker *worker;
+    struct server server = {0};
+    struct context context = {0};
     char *args[argc + 10];
     struct stat info = {0};
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    struct rusage usage;
+#endif
     const struct option opts[] = {
             {"output-encoding", optional_argument, NULL, 't'},
             {"fs-sensitive",    optional_argument, NULL, 'z'},
             {"recurse",         optional_argument, NULL, 'R'},
+            {"jobs",            required_argument, NULL, 'j'},
+            {"batch",           required_argument, NULL, 'b'},
+            {"serve",           optional_argument, NULL, 'S'},
+            {"connect",         optional_argument, NULL, 'K'},
+            {"watch",           no_argument,       NULL, 'W'},
             {"print",           required_argument, NULL, 'p'},
+            {"callers",         required_argument, NULL, 'A'},
+            {"callees",         required_argument, NULL, 'B'},
+            {"depth",           required_argument, NULL, 'D'},
+            {"export-snapshot", required_argument, NULL, 'N'},
+            {"snapshot",        required_argument, NULL, 'M'},
+            {"rebuild",         no_argument,       NULL, 'Y'},
+            {"stats",           optional_argument, NULL, 'T'},
             {"verbose",         no_argument,       NULL, 'V'},
             {"version",         no_argument,       NULL, 'v'},
             {"help",            no_argument,       NULL, 'h'},
@@ -781,7 +2668,7 @@ int main(int argc, char *const argv[])
 
     args[idx = 0] = "ctags";
 
-    while ((tmp = getopt_long(argc, argv, ":50:1:2:3:4:6:7:8:9:r:e:E:f:L:o:P:p:scgxXudClVRvh", opts, NULL)) != -1) {
+    while ((tmp = getopt_long(argc, argv, ":50:1:2:3:4:6:7:8:9:r:e:E:f:L:o:P:p:j:scgxXudClVRvh", opts, NULL)) != -1) {
         switch (tmp) {
             case '?':
                 args[++idx] = argv[optind - 1];
@@ -809,6 +2696,17 @@ int main(int argc, char *const argv[])
                 opcode = 7;
                 search = optarg;
                 break;
+            case 'A':
+                opcode = 11;
+                search = optarg;
+                break;
+            case 'B':
+                opcode = 12;
+                search = optarg;
+                break;
+            case 'D':
+                depth = (tmp = atoi(optarg)) > 0 ? tmp : GRAPH_DEPTH;
+                break;
             case 'e':
                 regexp = 1;
                 exmode = 0;
@@ -836,6 +2734,33 @@ int main(int argc, char *const argv[])
             case 'P':
                 prefix = optarg;
                 break;
+            case 'j':
+                jobs = (tmp = atoi(optarg)) > 0 ? tmp : 0;
+                break;
+            case 'b':
+                batch = optarg;
+                break;
+            case 'S':
+                serve = optarg ? optarg : sock;
+                break;
+            case 'K':
+                client = optarg ? optarg : sock;
+                break;
+            case 'W':
+                watch = 1;
+                break;
+            case 'N':
+                exportsnap = optarg;
+                break;
+            case 'M':
+                snapshot = optarg;
+                break;
+            case 'Y':
+                rebuild = 1;
+                break;
+            case 'T':
+                stats.mode = optarg && strcmp(optarg, "json") == 0 ? 2 : 1;
+                break;
             case 'p':
                 tagformats[TAGCUSTOM] = optarg;
                 tagfmt = TAGCUSTOM;
@@ -890,6 +2815,11 @@ int main(int argc, char *const argv[])
         }
     }
 
+    if (stats.mode) {
+        stats.owner = pthread_self();
+        stats.start = stats.mark = nstime();
+    }
+
     if (!getcwd(cwd, BUFSIZE)) {
         echoerr("current directory doesn't exist.\n");
         return 1;
@@ -912,11 +2842,46 @@ int main(int argc, char *const argv[])
         echomsg("prefix %s\n", pwd);
     }
 
-    if (!(db = dbopen(pwd, dbpath, caseless ? DB_ICASE : 0))) {
+    snprintf(sock, sizeof(sock), "%s" SOCKEXT, dbpath);
+
+    // 客户端不打开数据库，也不启动ctags
+    if (client)
+        return connectsock(client);
+
+    // 快照能回答的查询不打开数据库，也不检查文件，快照打开失败时仍查询数据库
+    if (snapshot && search && SNAP_OPCODE(opcode) && !linemode && !serve && !watch && !inpath && optind == argc &&
+        !exportsnap) {
+        if ((snap = snapopen(snapshot))) {
+            if (!tagfmt)
+                tagfmt = TAGCTAGS;
+            snapview(snap, cwd);
+            dumpout(NULL, snap, output, encode,
+                    (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0) | DB_MATCH,
+                    debugmode, tagfmt, opcode, search);
+            snapclose(snap);
+            echostats(NULL, NULL);
+            return 0;
+        }
+        if (debugmode)
+            echomsg("open snapshot %s failed.\n", snapshot);
+    }
+
+    // 新建、为空或要求重建的数据库在临时文件中批量导入，全部完成后才替换原数据库
+    bulk = !watch && (optind < argc || inpath) &&
+           (rebuild || stat(dbpath, &info) != 0 || info.st_size == 0);
+    if (bulk && snprintf(bulkpath, sizeof(bulkpath), "%s" BULKEXT, dbpath) < (int) sizeof(bulkpath))
+        remove(bulkpath);
+    else
+        bulk = 0;
+
+    if (!(db = dbopen(pwd, bulk ? bulkpath : dbpath, (caseless ? DB_ICASE : 0) | (bulk ? DB_BULK : 0)))) {
         echoerr("open database failed.\n");
         return 1;
     }
 
+    dbview(db, cwd);
+    dbdepth(db, depth);
+
     if (encode)
         args[++idx] = "--output-encoding=UTF-8";
 
@@ -927,6 +2892,7 @@ int main(int argc, char *const argv[])
     args[++idx] = "--extras=*";
     args[++idx] = "--pseudo-tags=";
     args[++idx] = "--filter-terminator=" GROUPEND;
+    // 字段顺序须与xfields一致
     args[++idx] = "--_xformat=" \
         FIELDTXT(FIELD_STR_MARK, FIELD_CHR_MARK) \
         FIELDTXT(FIELD_STR_NAME, FIELD_CHR_NAME) \
@@ -948,25 +2914,79 @@ int main(int argc, char *const argv[])
         "";
     args[++idx] = NULL;
 
-    pid = taskexec(abspath(NULL, getenv("CTAGSPATH"), buf), args, pwd, &si, &so);
-    if (pid <= 0 || !si || !so) {
+    context.db = db;
+    context.pwd = pwd;
+    context.cwd = cwd;
+    context.batch.files = update && !watch && !bulk ? 1 : BATCH_FILES;
+    context.batch.tags = update && !watch && !bulk ? 0 : BATCH_TAGS;
+    context.batch.msec = update && !watch && !bulk ? 0 : BATCH_MSEC;
+
+    if (batch)
+        sscanf(batch, "%d,%d,%d", &context.batch.files, &context.batch.tags, &context.batch.msec);
+
+    server.pwd = pwd;
+    server.cwd = cwd;
+    server.dbpath = dbpath;
+    server.mode = (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0);
+    server.depth = depth;
+    server.count = jobs ? jobs : SERVE_JOBS;
+    walkers = jobs ? jobs : WALK_JOBS;
+    jobs = jobs ? jobs : 1;
+
+    statphase(STAT_SPAWN);
+
+    context.workers = (struct worker *) calloc(jobs, sizeof(*context.workers));
+
+    for (temp = abspath(NULL, getenv("CTAGSPATH"), buf); context.workers && context.count < jobs; context.count++) {
+        worker = &context.workers[context.count];
+        worker->pid = taskexec(temp, args, pwd, &worker->si, &worker->so);
+        if (worker->pid <= 0 || !worker->si || !worker->so)
+            break;
+    }
+
+    pthread_mutex_init(&context.reader.lock, NULL);
+    pthread_cond_init(&context.reader.ready, NULL);
+    pthread_cond_init(&context.reader.space, NULL);
+
+    // 读取线程同样在所有ctags进程启动之后创建
+    if (context.count < jobs || pthread_create(&context.reader.tid, NULL, readthread, &context) != 0) {
+        for (idx = 0; context.workers && idx <= context.count && idx < jobs; idx++) {
+            worker = &context.workers[idx];
+            if (worker->si)
+                fclose(worker->si);
+            if (worker->so)
+                fclose(worker->so);
+            if (worker->pid > 0)
+                taskwait(worker->pid);
+        }
+        free(context.workers);
         dbclose(db);
+        if (bulk)
+            remove(bulkpath);
         echoerr("execute '%s' failed.\n", args[0]);
         return 1;
     }
 
-    data[0] = si;
-    data[1] = so;
-    data[2] = db;
-    data[3] = pwd;
-    data[4] = cwd;
+    // 遍历线程在ctags进程启动之后创建，fork时只有当前线程
+    context.walk = walkopen(walkers, recursive);
+    context.jobs = walkers;
+
+    statphase(STAT_OTHER);
 
-    writeline = update ? checkpath : writepath;
+    // 批量导入时数据库为空，所有文件都是新增的
+    writeline = update && !bulk ? checkpath : writepath;
+    start = mstime();
+
+    // 先检查数据库中已有的文件并等待修改的文件入库，遍历时checkpath只会遇到新增的文件
+    if (update != 2 && !bulk) {
+        sweepdb(&context, update ? checkpath : NULL);
+        flushpath(&context);
+    }
 
     for (idx = optind; idx < argc; idx++) {
         tmp = snprintf(buf, BUFSIZE, "%s", argv[idx]);
         if (tmp > 0)
-            findfile(buf, tmp, writeline, (void *) data);
+            findpath(&context, buf, tmp, writeline);
     }
 
     if (inpath && ((strcmp(inpath, "-") == 0 && (linemode = 0, fp = stdin)) ||
@@ -976,118 +2996,116 @@ int main(int argc, char *const argv[])
             for (tmp = temp - line, *temp = '\0', temp = line; *temp && isspace(*temp); temp++);
             tmp -= temp - line;
             if (*temp != '#')
-                findfile(temp, tmp, writeline, (void *) data);
+                findpath(&context, temp, tmp, writeline);
         }
         fclose(fp);
     }
 
-    fclose(si);
-    fclose(so);
-    taskwait(pid);
+    findpath(&context, NULL, 0, writeline);
 
-    if (update != 2)
-        dballfile(db, checkfile, (void *) data);
+    flushpath(&context);
 
-    if (!tagfmt)
-        tagfmt = linemode ? TAGCSCOPE : TAGCTAGS;
+    if (context.lost)
+        echoerr("%llu files not parsed, '%s' exited unexpectedly.\n", (unsigned long long) context.lost, args[0]);
 
-    if (opcode || search) {
-        fp = output ? fopen(output, "w") : NULL;
-        cd = fp && encode ? iconv_open(encode, "UTF-8") : NULL;
-        if (fp) {
-            if (tagfmt == TAGXML) {
-                print(fp, cd, "<?xml version=\"1.0\" encoding=\"%s\">\n", encode ? encode : "UTF-8");
-                print(fp, cd, "<tags>\n");
-            } else if (tagfmt == TAGCTAGS) {
-                if (encode)
-                    print(fp, cd, "!_TAG_FILE_ENCODING\t%s\t//\n", encode);
-                print(fp, cd, "!_TAG_FILE_FORMAT\t2\t/extended format; --format=1 will not append ;\" to lines/\n");
-                print(fp, cd, "!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted, 2=foldcase/\n");
-            }
-        }
+    if (debugmode && context.files) {
+        start = mstime() - start;
+        echomsg("indexed %llu files, %llu tags in %.3fs, %.0f tags/s\n",
+                (unsigned long long) context.files, (unsigned long long) context.tags,
+                start / 1000.0, start > 0 ? context.tags * 1000.0 / start : 0.0);
+    }
 
-        dumptag(fp ? fp : stdout, cd, db,
-                (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0) | DB_MATCH,
-                debugmode, tagfmt, opcode, search, cwd);
+    // 监视期间ctags进程保持运行，变更的文件交给它们解析
+    if (watch) {
+        if (!serve || servesock(&server, serve, 0) == 0)
+            watchtree(&context, argv + optind, argc - optind, dbpath);
+    }
 
-        if (fp) {
-            if (tagfmt == TAGXML)
-                print(fp, cd, "</tags>");
-            fclose(fp);
-        }
+    statphase(STAT_SPAWN);
 
-        iconv_close(cd);
+    walkclose(context.walk);
+
+    // 关闭输入后ctags进程退出，读取线程读到所有进程结束后返回
+    for (idx = 0; idx < context.count; idx++)
+        fclose(context.workers[idx].so);
+
+    pthread_join(context.reader.tid, NULL);
+
+    for (idx = 0; idx < context.count; idx++) {
+        worker = &context.workers[idx];
+        fclose(worker->si);
+        taskwait(worker->pid);
+        free(worker->buf);
     }
 
-    while (linemode && (fprintf(stdout, ">> "), fflush(stdout), tmp = getline(&line, &linesz, stdin)) > 0) {
-        for (temp = line + tmp; temp > line && isspace(temp[-1]); temp--);
-        for (temp[0] = '\0', temp = line; *temp && isspace(*temp); temp++);
-        for (opcode = 0, search = NULL; *temp && *temp == '5'; temp++)
-            regexp = 1;
-        tmp = *temp++;
-        switch (tmp) {
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '6':
-            case '8':
-            case '9':
-                opcode = ch2code(tmp);
-                exmode = opcode == 6;
-                search = temp;
-                break;
-            case '7':
-                opcode = 10;
-                search = temp;
-                break;
-            case 'r':
-                opcode = 7;
-                search = temp;
-                break;
-            case 'e':
-                regexp = 1;
-                exmode = 0;
-                opcode = 0;
-                search = temp;
-                break;
-            case 'E':
-                regexp = 1;
-                exmode = 1;
-                opcode = 0;
-                search = temp;
-                break;
-            case 'c':
-                caseless = !caseless;
-                break;
-            case 'C':
-                caseless = 1;
-                break;
-            case 'R':
-                regexp = 0;
-                exmode = 0;
-                caseless = 0;
-                break;
-            case 'F':
-                break;
-            case 'q':
-                linemode = 0;
-                break;
-            default:
-                if (tmp)
-                    echoerr("unknown command '%c%s'.\n", tmp, search ? search : "");
-                break;
+    statphase(STAT_OTHER);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // ctags进程都已回收，子进程的CPU时间即解析所用的时间
+    if (stats.mode && getrusage(RUSAGE_CHILDREN, &usage) == 0)
+        stats.ctags = ((int64_t) usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+                      ((int64_t) usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+#endif
+
+    pthread_cond_destroy(&context.reader.space);
+    pthread_cond_destroy(&context.reader.ready);
+    pthread_mutex_destroy(&context.reader.lock);
+
+    free(context.workers);
+
+    // 有文件因ctags进程退出而没有解析时不替换原数据库，否则重新打开替换后的数据库，恢复普通模式的锁和外键检查
+    if (bulk) {
+        tmp = statphase(STAT_INDEX);
+        idx = dbindex(db);
+        statphase(tmp);
+        if (dbclose(db) != 0 || context.lost)
+            idx = -1;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        // Windows上rename不能覆盖已有的文件
+        if (idx == 0)
+            remove(dbpath);
+#endif
+        if (idx != 0 || rename(bulkpath, dbpath) != 0 || !(db = dbopen(pwd, dbpath, caseless ? DB_ICASE : 0))) {
+            echoerr("build database '%s' failed.\n", dbpath);
+            remove(bulkpath);
+            free(line);
+            return 1;
+        }
+        dbview(db, cwd);
+        dbdepth(db, depth);
+    }
+
+    // 快照中的路径为绝对路径，查询时再转换为相对当前目录的路径
+    if (exportsnap) {
+        dbview(db, NULL);
+        tmp = statphase(STAT_EXPORT);
+        idx = snapexport(db, exportsnap);
+        statphase(tmp);
+        if (idx != 0) {
+            echoerr("export snapshot '%s' failed.\n", exportsnap);
+            free(line);
+            dbclose(db);
+            return 1;
         }
+        dbview(db, cwd);
+    }
 
-        if (opcode || search)
-            dumptag(stdout, NULL, db,
-                    (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0) | DB_MATCH,
-                    1, TAGCSCOPE, opcode, search, cwd);
+    if (!tagfmt)
+        tagfmt = linemode ? TAGCSCOPE : TAGCTAGS;
+
+    if (opcode || search) {
+        dumpout(db, NULL, output, encode,
+                (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0) | DB_MATCH,
+                debugmode, tagfmt, opcode, search);
     }
 
+    if (linemode)
+        serveline(stdin, stdout, db, (exmode ? DB_EXREG : 0) | (regexp ? DB_REGEX : 0) | (caseless ? DB_ICASE : 0), depth);
+
+    echostats(db, &context);
+
     free(line);
     dbclose(db);
 
-    return 0;
+    return serve && !watch ? servesock(&server, serve, 1) : 0;
 }
\ No newline at end of file
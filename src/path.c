@@ -110,4 +110,59 @@ char *relpath(const char *base, const char *path, char buf[])
     len += sprintf(buf + len, "%s", pp);
 
     return len > 0 ? buf : NULL;
-}
\ No newline at end of file
+}
+
+/**
+ * 将path按字面规则转成绝对路径，不访问文件系统
+ * 若path是相对路径，则先拼接到base之后；
+ * 然后去掉空的和'.'路径分量，'..'分量会移除前一个分量；
+ * 与abspath不同，文件不存在时也能转换，但不会解析符号链接；
+ * @param base 基本绝对路径
+ * @param path 需转换路径
+ * @param buf  转换后的缓冲区，大小至少为PATH_MAX + 1
+ * @return     转换成功返回buf指针，否则返回NULL
+ */
+char *normpath(const char *base, const char *path, char buf[])
+{
+    int len, root, size;
+    const char *p, *q;
+    char tmp[PATH_MAX * 2 + 2] = {0};
+
+    if (!path || !buf)
+        return NULL;
+
+    if (base && !isabspath(path) && snprintf(tmp, sizeof(tmp), "%s" PATHSEP "%s", base, path) > 0)
+        path = tmp;
+
+    if (!isabspath(path))
+        return NULL;
+
+    // 保留根路径部分，如'/'或'C:\'
+    for (root = 0; path[root] && path[root] != PATHSEP[0] && path[root] != '/'; root++);
+    if (root + 1 > PATH_MAX)
+        return NULL;
+    memcpy(buf, path, root);
+    buf[root++] = PATHSEP[0];
+
+    for (len = root, p = path + root; *p; p = *q ? q + 1 : q) {
+        for (q = p; *q && *q != PATHSEP[0] && *q != '/'; q++);
+        size = q - p;
+        if (size == 0 || (size == 1 && p[0] == '.'))
+            continue;
+        if (size == 2 && p[0] == '.' && p[1] == '.') {
+            for (; len > root && buf[len - 1] != PATHSEP[0]; len--);
+            if (len > root)
+                len--;
+            continue;
+        }
+        if (len + (len > root) + size > PATH_MAX)
+            return NULL;
+        if (len > root)
+            buf[len++] = PATHSEP[0];
+        memcpy(buf + len, p, size);
+        len += size;
+    }
+    buf[len] = '\0';
+
+    return buf;
+}
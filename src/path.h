@@ -17,4 +17,6 @@ char *abspath(const char *base, const char *path, char buf[]);
 
 char *relpath(const char *base, const char *path, char buf[]);
 
+char *normpath(const char *base, const char *path, char buf[]);
+
 #endif //CSTAG_PATH_H
\ No newline at end of file
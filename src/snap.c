@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include "path.h"
+#include "snap.h"
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define SNAP_MAGIC              "CSTAGSNP"
+#define SNAP_VERSION            1
+// 显示路径缓存的大小，须为2的幂
+#define SNAP_PATHS              64
+
+#define HASH_BASIS              0x811C9DC5U
+#define HASH_PRIME              0x01000193U
+
+/**
+ * 快照文件头，之后依次为名称表、tag表和字符串池，均按快照所在平台的字节序存放
+ * prefix[b]为首字节不小于b的第一个名称的下标，prefix[256]为名称数
+ */
+struct snaphead {
+    char magic[8];
+    uint32_t version;
+    uint32_t fields;
+    uint32_t names;
+    uint32_t tags;
+    uint64_t nameoff;
+    uint64_t tagoff;
+    uint64_t pooloff;
+    uint64_t poolsize;
+    uint32_t prefix[257];
+    uint32_t reserved;
+};
+
+/**
+ * 名称表的一项，按名称排序，名称相同的tags在tag表中连续存放
+ */
+struct snapname {
+    uint32_t name;
+    uint32_t first;
+    uint32_t count;
+};
+
+/**
+ * tag表的一项，每个字段为字符串池中的偏移，0表示NULL；路径为绝对路径
+ */
+struct snaptag {
+    uint32_t text[FIELD_MAX];
+};
+
+/**
+ * 打开的快照，只读映射，不做任何解析
+ */
+struct tagSnap {
+    char *data;
+    size_t size;
+    int mapped;
+    const struct snaphead *head;
+    const struct snapname *names;
+    const struct snaptag *tags;
+    const char *pool;
+    char *view;
+    struct {
+        uint32_t off;
+        char *show;
+    } paths[SNAP_PATHS];
+};
+
+/**
+ * 快照查询游标，依次扩展范围内匹配的名称，再逐个过滤其tags
+ */
+struct tagSnapCursor {
+    snap_t snap;
+    unsigned char mode;
+    unsigned char opcode;
+    int compiled;
+    regex_t regex;
+    char *pattern;
+    uint32_t name;
+    uint32_t end;
+    uint32_t tag;
+    uint32_t last;
+    const struct snaptag *row;
+};
+
+/**
+ * 导出时的字符串池，相同的字符串只存一份
+ */
+struct snappool {
+    char *data;
+    size_t size;
+    size_t cap;
+    uint32_t *slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+/**
+ * 计算字符串的哈希
+ * @param text 字符串
+ * @param len  字节数
+ * @return     哈希值
+ */
+static uint32_t texthash(const char *text, size_t len)
+{
+    uint32_t hash = HASH_BASIS;
+
+    while (len-- > 0)
+        hash = (hash ^ (unsigned char) *text++) * HASH_PRIME;
+
+    return hash;
+}
+
+/**
+ * 将字符串放入字符串池
+ * @param pool 字符串池
+ * @param text 字符串，NULL返回0
+ * @return     字符串在池中的偏移，失败返回0并置pool->data为NULL
+ */
+static uint32_t intern(struct snappool *pool, const char *text)
+{
+    char *data;
+    uint32_t *slots, idx, pos, slot, mask;
+    size_t len, cap;
+
+    if (!text || !pool->data)
+        return 0;
+
+    len = strlen(text);
+
+    for (idx = texthash(text, len) & pool->mask; pool->slots[idx]; idx = (idx + 1) & pool->mask)
+        if (strcmp(pool->data + pool->slots[idx], text) == 0)
+            return pool->slots[idx];
+
+    if (pool->size + len + 1 > UINT32_MAX)
+        return (free(pool->data), pool->data = NULL, 0);
+
+    if (pool->size + len + 1 > pool->cap) {
+        cap = pool->cap * 2 > pool->size + len + 1 ? pool->cap * 2 : pool->size + len + 1;
+        if (!(data = (char *) realloc(pool->data, cap)))
+            return (free(pool->data), pool->data = NULL, 0);
+        pool->data = data;
+        pool->cap = cap;
+    }
+
+    pos = (uint32_t) pool->size;
+    memcpy(pool->data + pos, text, len + 1);
+    pool->size += len + 1;
+    pool->slots[idx] = pos;
+
+    // 装载率超过一半时扩容并重新放置
+    if (++pool->count * 2 > pool->mask) {
+        mask = pool->mask * 2 + 1;
+        if (!(slots = (uint32_t *) calloc(mask + 1, sizeof(*slots))))
+            return (free(pool->data), pool->data = NULL, 0);
+        for (idx = 0; idx <= pool->mask; idx++) {
+            if (!pool->slots[idx])
+                continue;
+            pos = pool->slots[idx];
+            for (slot = texthash(pool->data + pos, strlen(pool->data + pos)) & mask; slots[slot];)
+                slot = (slot + 1) & mask;
+            slots[slot] = pos;
+        }
+        free(pool->slots);
+        pool->slots = slots;
+        pool->mask = mask;
+    }
+
+    return (uint32_t) (pool->size - len - 1);
+}
+
+/**
+ * 将快照各部分写入文件
+ * @param path  快照文件路径
+ * @param head  文件头
+ * @param names 名称表
+ * @param tags  tag表
+ * @param pool  字符串池
+ * @return      写入成功返回0，否则返回非0
+ */
+static int snapwrite(const char *path, const struct snaphead *head,
+                     const struct snapname *names, const struct snaptag *tags, const char *pool)
+{
+    int ret;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "wb")))
+        return -1;
+
+    ret = fwrite(head, sizeof(*head), 1, fp) == 1 &&
+          (!head->names || fwrite(names, sizeof(*names), head->names, fp) == head->names) &&
+          (!head->tags || fwrite(tags, sizeof(*tags), head->tags, fp) == head->tags) &&
+          fwrite(pool, 1, head->poolsize, fp) == head->poolsize ? 0 : -1;
+
+    if (fclose(fp) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+/**
+ * 将数据库中的全部tags导出为只读快照，先写入临时文件再改名，
+ * 已经映射旧快照的进程不受影响；路径按数据库的视图目录输出，导出前应设为NULL以得到绝对路径
+ * @param db   数据库句柄
+ * @param path 快照文件路径
+ * @return     导出成功返回0，否则返回非0
+ */
+int snapexport(db_t db, const char *path)
+{
+    int ret, idx;
+    uint32_t off, last = 0;
+    size_t cap = 0;
+    cursor_t cur;
+    char tmp[PATH_MAX + 8];
+    struct snaphead head = {.magic = SNAP_MAGIC, .version = SNAP_VERSION, .fields = FIELD_MAX};
+    struct snapname *names = NULL, *name;
+    struct snaptag *tags = NULL, *tag;
+    struct snappool pool = {0};
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+        return -1;
+
+    // 偏移0表示NULL，池以一个空字节开始
+    pool.cap = 4096;
+    pool.size = 1;
+    pool.mask = 1023;
+    pool.data = (char *) calloc(pool.cap, 1);
+    pool.slots = (uint32_t *) calloc(pool.mask + 1, sizeof(*pool.slots));
+
+    // 结果按名称、行号和类型排序，名称相同的tags连续
+    if (!pool.data || !pool.slots || !(cur = dbfindtags(db, 0, "1"))) {
+        free(pool.data);
+        free(pool.slots);
+        return -1;
+    }
+
+    while ((ret = dbstep(cur)) > 0) {
+        if (head.tags == cap || head.names == cap) {
+            cap = cap ? cap * 2 : 1024;
+            if (!(tag = (struct snaptag *) realloc(tags, cap * sizeof(*tags))))
+                break;
+            tags = tag;
+            if (!(name = (struct snapname *) realloc(names, cap * sizeof(*names))))
+                break;
+            names = name;
+        }
+
+        tag = &tags[head.tags];
+        for (idx = 0; idx < FIELD_MAX; idx++)
+            tag->text[idx] = intern(&pool, dbcoltext(cur, idx));
+
+        if (!pool.data || !(off = tag->text[FIELD_IDX_NAME]))
+            break;
+
+        // 相同的名称在池中偏移相同
+        if (!head.names || off != last) {
+            name = &names[head.names++];
+            name->name = last = off;
+            name->first = head.tags;
+            name->count = 0;
+        }
+        names[head.names - 1].count++;
+        head.tags++;
+    }
+
+    dbfinish(cur);
+
+    if (ret == 0 && pool.data) {
+        for (idx = 0, off = 0; idx <= 256; idx++) {
+            while (off < head.names && (unsigned char) pool.data[names[off].name] < idx)
+                off++;
+            head.prefix[idx] = off;
+        }
+        head.nameoff = sizeof(head);
+        head.tagoff = head.nameoff + (uint64_t) head.names * sizeof(*names);
+        head.pooloff = head.tagoff + (uint64_t) head.tags * sizeof(*tags);
+        head.poolsize = pool.size;
+
+        if ((ret = snapwrite(tmp, &head, names, tags, pool.data)) != 0 || (ret = rename(tmp, path)) != 0)
+            remove(tmp);
+    } else
+        ret = -1;
+
+    free(names);
+    free(tags);
+    free(pool.data);
+    free(pool.slots);
+
+    return ret;
+}
+
+/**
+ * 打开快照，只映射文件并检查文件头，不读取内容
+ * @param path 快照文件路径
+ * @return     打开成功返回快照句柄，否则返回NULL
+ */
+snap_t snapopen(const char *path)
+{
+    snap_t snap;
+    const struct snaphead *head;
+
+    if (!(snap = (snap_t) calloc(1, sizeof(*snap))))
+        return NULL;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    int fd;
+    void *data;
+    struct stat info;
+
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size >= (off_t) sizeof(*head) &&
+            (data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+            snap->data = (char *) data;
+            snap->size = info.st_size;
+            snap->mapped = 1;
+        }
+        close(fd);
+    }
+#else
+    FILE *fp;
+    long size;
+
+    if ((fp = fopen(path, "rb"))) {
+        if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= (long) sizeof(*head) && fseek(fp, 0, SEEK_SET) == 0 &&
+            (snap->data = (char *) malloc(size))) {
+            if (fread(snap->data, 1, size, fp) == (size_t) size)
+                snap->size = size;
+            else
+                snap->data = (free(snap->data), NULL);
+        }
+        fclose(fp);
+    }
+#endif
+
+    if (!snap->data) {
+        free(snap);
+        return NULL;
+    }
+
+    head = snap->head = (const struct snaphead *) snap->data;
+
+    // 各部分须在文件范围内，字符串池须以空字节结束，保证读取字符串不会越界
+    if (memcmp(head->magic, SNAP_MAGIC, sizeof(head->magic)) != 0 ||
+        head->version != SNAP_VERSION ||
+        head->fields != FIELD_MAX ||
+        head->prefix[256] != head->names ||
+        head->nameoff != sizeof(*head) ||
+        head->tagoff != head->nameoff + (uint64_t) head->names * sizeof(struct snapname) ||
+        head->pooloff != head->tagoff + (uint64_t) head->tags * sizeof(struct snaptag) ||
+        head->poolsize == 0 ||
+        head->pooloff + head->poolsize != snap->size ||
+        snap->data[snap->size - 1] != '\0') {
+        snapclose(snap);
+        return NULL;
+    }
+
+    for (int idx = 0; idx < 256; idx++)
+        if (head->prefix[idx] > head->prefix[idx + 1]) {
+            snapclose(snap);
+            return NULL;
+        }
+
+    snap->names = (const struct snapname *) (snap->data + head->nameoff);
+    snap->tags = (const struct snaptag *) (snap->data + head->tagoff);
+    snap->pool = snap->data + head->pooloff;
+
+    return snap;
+}
+
+/**
+ * 设置查询结果中路径的视图目录，与dbview相同
+ * @param snap 快照句柄
+ * @param dir  视图目录绝对路径，NULL表示返回绝对路径
+ * @return     设置成功返回0，否则返回非0
+ */
+int snapview(snap_t snap, const char *dir)
+{
+    for (int idx = 0; idx < SNAP_PATHS; idx++) {
+        free(snap->paths[idx].show);
+        snap->paths[idx].show = NULL;
+    }
+
+    free(snap->view);
+
+    snap->view = dir ? strdup(dir) : NULL;
+
+    return !dir || snap->view ? 0 : -1;
+}
+
+/**
+ * 获取路径的显示路径，同一路径只在第一次出现时转换，之后查缓存
+ * @param snap 快照句柄
+ * @param off  路径在字符串池中的偏移
+ * @return     显示路径，失败返回NULL
+ */
+static const char *showpath(snap_t snap, uint32_t off)
+{
+    char *show;
+    const char *path = snap->pool + off;
+    char rel[PATH_MAX * 2 + 1] = {0};
+    char buf[(PATH_MAX + 1) * 3] = {0};
+
+    if (!snap->view)
+        return path;
+
+    if (snap->paths[off & (SNAP_PATHS - 1)].show && snap->paths[off & (SNAP_PATHS - 1)].off == off)
+        return snap->paths[off & (SNAP_PATHS - 1)].show;
+
+    if (!(show = pathescape(relpath(snap->view, path, rel), buf)) || !(show = strdup(show)))
+        return NULL;
+
+    free(snap->paths[off & (SNAP_PATHS - 1)].show);
+    snap->paths[off & (SNAP_PATHS - 1)].off = off;
+    snap->paths[off & (SNAP_PATHS - 1)].show = show;
+
+    return show;
+}
+
+/**
+ * 在快照中查找tags，名称规则与dbreadtags相同；非正则且区分大小写时二分查找名称，
+ * 否则逐个匹配名称，以'^'和普通字符开始的正则只匹配首字节相同的名称
+ * @param snap    快照句柄
+ * @param mode    数据库模式
+ * @param opcode  查找操作码，见SNAP_OPCODE
+ * @param pattern 名称模式
+ * @return        查找成功返回游标，否则返回NULL
+ */
+snapcur_t snapfind(snap_t snap, unsigned char mode, unsigned char opcode, const char *pattern)
+{
+    uint32_t lo, hi, mid;
+    int cmp = -1;
+    snapcur_t cur;
+    const char *meta = mode & DB_EXREG ? ".[]\\()*+?{}|^$" : ".[]\\*^$";
+
+    if (!snap || !pattern || !SNAP_OPCODE(opcode) || !(cur = (snapcur_t) calloc(1, sizeof(*cur))))
+        return NULL;
+
+    cur->snap = snap;
+    cur->mode = mode;
+    cur->opcode = opcode;
+    cur->name = 0;
+    cur->end = snap->head->names;
+
+    if (!(cur->pattern = strdup(pattern))) {
+        free(cur);
+        return NULL;
+    }
+
+    if (mode & DB_REGEX) {
+        if (regcomp(&cur->regex, pattern,
+                    REG_NOSUB | (mode & DB_ICASE ? REG_ICASE : 0) | (mode & DB_EXREG ? REG_EXTENDED : 0)) != 0) {
+            // 与数据库相同，无效的正则不匹配任何名称
+            cur->end = 0;
+            return cur;
+        }
+        cur->compiled = 1;
+        if (!(mode & DB_ICASE) && pattern[0] == '^' && pattern[1] && !strchr(meta, pattern[1]) &&
+            !strchr(pattern, '|') && (!pattern[2] || !strchr(mode & DB_EXREG ? "*?{" : "*\\", pattern[2]))) {
+            cur->name = snap->head->prefix[(unsigned char) pattern[1]];
+            cur->end = snap->head->prefix[(unsigned char) pattern[1] + 1];
+        }
+    } else if (!(mode & DB_ICASE)) {
+        // 精确匹配，在首字节的范围内二分查找
+        lo = snap->head->prefix[(unsigned char) pattern[0]];
+        hi = snap->head->prefix[(unsigned char) pattern[0] + 1];
+        while (lo < hi && snap->names[mid = lo + (hi - lo) / 2].name < snap->head->poolsize &&
+               (cmp = strcmp(snap->pool + snap->names[mid].name, pattern)) != 0) {
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        cur->name = cmp == 0 ? mid : 0;
+        cur->end = cmp == 0 ? mid + 1 : 0;
+    }
+
+    return cur;
+}
+
+/**
+ * 判断名称是否匹配游标的模式
+ * @param cur  游标
+ * @param name 名称
+ * @return     匹配返回1，否则返回0
+ */
+static int namematch(snapcur_t cur, const char *name)
+{
+    if (cur->compiled)
+        return regexec(&cur->regex, name, 0, NULL, 0) == 0;
+
+    return ((cur->mode & DB_ICASE) ? strcasecmp : strcmp)(cur->pattern, name) == 0;
+}
+
+/**
+ * 读取游标的下一行
+ * @param cur 游标
+ * @return    读到一行返回1，没有更多行返回0，快照损坏返回-1
+ */
+int snapstep(snapcur_t cur)
+{
+    uint32_t off;
+    const struct snapname *name;
+    snap_t snap = cur->snap;
+
+    for (;;) {
+        while (cur->tag < cur->last) {
+            cur->row = &snap->tags[cur->tag++];
+            for (int idx = 0; idx < FIELD_MAX; idx++)
+                if (cur->row->text[idx] >= snap->head->poolsize)
+                    return -1;
+            off = cur->row->text[FIELD_IDX_MARK];
+            if (cur->opcode == 1 ||
+                (off && snap->pool[off] == (cur->opcode == 2 ? 'D' : 'R') && !snap->pool[off + 1]))
+                return 1;
+        }
+
+        for (name = NULL; !name && cur->name < cur->end; cur->name++)
+            if (snap->names[cur->name].name < snap->head->poolsize &&
+                namematch(cur, snap->pool + snap->names[cur->name].name))
+                name = &snap->names[cur->name];
+
+        if (!name)
+            return 0;
+
+        if (name->first > snap->head->tags || name->count > snap->head->tags - name->first)
+            return -1;
+
+        cur->tag = name->first;
+        cur->last = name->first + name->count;
+    }
+}
+
+/**
+ * 统计游标的结果行数，在游标读取第一行之前调用；查找符号时直接累加各名称的tag数，不读取tag
+ * @param cur 游标
+ * @return    成功返回行数，快照损坏时返回-1
+ */
+int64_t snapcount(snapcur_t cur)
+{
+    int64_t rows = 0;
+    uint32_t idx, tag, off;
+    const struct snapname *name;
+    snap_t snap = cur->snap;
+
+    for (idx = cur->name; idx < cur->end; idx++) {
+        name = &snap->names[idx];
+        if (name->name >= snap->head->poolsize || !namematch(cur, snap->pool + name->name))
+            continue;
+        if (name->first > snap->head->tags || name->count > snap->head->tags - name->first)
+            return -1;
+        if (cur->opcode == 1) {
+            rows += name->count;
+            continue;
+        }
+        // 定义和引用按mark列筛选，与snapstep相同
+        for (tag = name->first; tag < name->first + name->count; tag++) {
+            if ((off = snap->tags[tag].text[FIELD_IDX_MARK]) >= snap->head->poolsize)
+                return -1;
+            if (off && snap->pool[off] == (cur->opcode == 2 ? 'D' : 'R') && !snap->pool[off + 1])
+                rows++;
+        }
+    }
+
+    return rows;
+}
+
+/**
+ * 获取游标当前行指定列的文本，与dbcoltext相同，路径列返回显示路径
+ * @param cur 游标
+ * @param col 列号，FIELD_IDX_*
+ * @return    列的文本，列值为NULL或列号越界时返回NULL
+ */
+const char *snapcoltext(snapcur_t cur, int col)
+{
+    uint32_t off;
+
+    if (!cur->row || col < 0 || col >= FIELD_MAX || !(off = cur->row->text[col]))
+        return NULL;
+
+    return col == FIELD_IDX_PATH ? showpath(cur->snap, off) : cur->snap->pool + off;
+}
+
+/**
+ * 结束由snapfind返回的游标
+ * @param cur 游标
+ */
+void snapfinish(snapcur_t cur)
+{
+    if (cur->compiled)
+        regfree(&cur->regex);
+
+    free(cur->pattern);
+    free(cur);
+}
+
+/**
+ * 关闭快照
+ * @param snap 快照句柄
+ */
+void snapclose(snap_t snap)
+{
+    if (!snap)
+        return;
+
+    snapview(snap, NULL);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    if (snap->mapped)
+        munmap(snap->data, snap->size);
+#endif
+    if (!snap->mapped)
+        free(snap->data);
+
+    free(snap);
+}
\ No newline at end of file
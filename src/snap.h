@@ -0,0 +1,31 @@
+#ifndef CSTAG_SNAP_H
+#define CSTAG_SNAP_H
+
+#include "dbop.h"
+
+// 快照能回答的查询操作码：-0查找符号，-1查找定义，-3查找引用
+#define SNAP_OPCODE(op)         ((op) == 1 || (op) == 2 || (op) == 4)
+
+typedef struct tagSnap *snap_t;
+
+typedef struct tagSnapCursor *snapcur_t;
+
+int snapexport(db_t db, const char *path);
+
+snap_t snapopen(const char *path);
+
+int snapview(snap_t snap, const char *dir);
+
+snapcur_t snapfind(snap_t snap, unsigned char mode, unsigned char opcode, const char *pattern);
+
+int64_t snapcount(snapcur_t cur);
+
+int snapstep(snapcur_t cur);
+
+const char *snapcoltext(snapcur_t cur, int col);
+
+void snapfinish(snapcur_t cur);
+
+void snapclose(snap_t snap);
+
+#endif //CSTAG_SNAP_H
\ No newline at end of file
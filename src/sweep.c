@@ -0,0 +1,399 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sweep.h"
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// io_uring一次提交的statx请求数
+#define SWEEP_DEPTH             256
+
+#define HASH_PRIME1             0x9E3779B185EBCA87ULL
+#define HASH_PRIME2             0xC2B2AE3D27D4EB4FULL
+
+/**
+ * 线程池检查时的共享状态，线程依次领取下一个文件
+ */
+struct sweeppool {
+    pthread_mutex_t lock;
+    struct sweepfile *files;
+    int count;
+    int next;
+};
+
+/**
+ * 根据文件当前属性设置检查结果
+ * @param file 待检查的文件
+ * @param reg  是否为普通文件
+ * @param size 当前字节数
+ * @param time 当前修改时间
+ */
+static void markfile(struct sweepfile *file, int reg, int64_t size, int64_t time)
+{
+    if (!reg)
+        file->state = SWEEP_GONE;
+    else if (file->size != size || file->time != time)
+        file->state = SWEEP_CHANGED;
+    else
+        file->state = SWEEP_SAME;
+
+    file->size = size;
+    file->time = time;
+}
+
+/**
+ * 线程池的检查线程，每次领取一批文件stat
+ * @param arg 共享状态
+ * @return    NULL
+ */
+static void *sweepthread(void *arg)
+{
+    int idx, end;
+    struct stat info;
+    struct sweeppool *pool = (struct sweeppool *) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        idx = pool->next;
+        end = pool->next = idx + SWEEP_DEPTH < pool->count ? idx + SWEEP_DEPTH : pool->count;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (idx >= end)
+            break;
+
+        for (; idx < end; idx++) {
+            if (stat(pool->files[idx].path, &info) != 0)
+                markfile(&pool->files[idx], 0, 0, 0);
+            else
+                markfile(&pool->files[idx], S_ISREG(info.st_mode), info.st_size, info.st_mtime);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 用线程池检查文件，当前线程也参与检查
+ * @param files 待检查的文件
+ * @param count 文件个数
+ * @param jobs  线程数
+ * @return      检查成功返回0，否则返回非0
+ */
+static int poolstat(struct sweepfile files[], int count, int jobs)
+{
+    int idx;
+    pthread_t tids[jobs > 1 ? jobs - 1 : 1];
+    struct sweeppool pool = {.files = files, .count = count, .next = 0};
+
+    pthread_mutex_init(&pool.lock, NULL);
+
+    for (idx = 0; idx < jobs - 1; idx++) {
+        if (pthread_create(&tids[idx], NULL, sweepthread, &pool) != 0)
+            break;
+    }
+
+    sweepthread(&pool);
+
+    while (idx-- > 0)
+        pthread_join(tids[idx], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+
+    return 0;
+}
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+/**
+ * 映射到用户空间的io_uring队列
+ */
+struct uring {
+    int fd;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring;
+    void *cqring;
+    size_t sqlen;
+    size_t cqlen;
+    size_t sqelen;
+};
+
+/**
+ * 关闭io_uring
+ * @param ring 队列
+ */
+static void ringclose(struct uring *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqelen);
+    if (ring->cqring && ring->cqring != MAP_FAILED && ring->cqring != ring->sqring)
+        munmap(ring->cqring, ring->cqlen);
+    if (ring->sqring && ring->sqring != MAP_FAILED)
+        munmap(ring->sqring, ring->sqlen);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+/**
+ * 创建io_uring并映射提交、完成队列
+ * @param ring    队列
+ * @param entries 队列大小
+ * @return        创建成功返回0，否则返回非0（如内核不支持或被禁用）
+ */
+static int ringopen(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return -1;
+
+    fcntl(ring->fd, F_SETFD, FD_CLOEXEC);
+
+    ring->sqlen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqlen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqelen = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqlen = ring->cqlen = ring->sqlen > ring->cqlen ? ring->sqlen : ring->cqlen;
+
+    ring->sqring = mmap(NULL, ring->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqring == MAP_FAILED) {
+        ringclose(ring);
+        return -1;
+    }
+
+    ring->cqring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sqring :
+                   mmap(NULL, ring->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqelen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cqring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ringclose(ring);
+        return -1;
+    }
+
+    ring->sqhead = (unsigned *) ((char *) ring->sqring + params.sq_off.head);
+    ring->sqtail = (unsigned *) ((char *) ring->sqring + params.sq_off.tail);
+    ring->sqmask = (unsigned *) ((char *) ring->sqring + params.sq_off.ring_mask);
+    ring->sqarray = (unsigned *) ((char *) ring->sqring + params.sq_off.array);
+    ring->cqhead = (unsigned *) ((char *) ring->cqring + params.cq_off.head);
+    ring->cqtail = (unsigned *) ((char *) ring->cqring + params.cq_off.tail);
+    ring->cqmask = (unsigned *) ((char *) ring->cqring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqring + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * 用io_uring批量提交statx检查文件，每批SWEEP_DEPTH个请求只需一次系统调用
+ * 内核不支持statx操作时返回失败，由调用者改用线程池；
+ * @param files 待检查的文件
+ * @param count 文件个数
+ * @return      检查成功返回0，否则返回非0
+ */
+static int uringstat(struct sweepfile files[], int count)
+{
+    int idx, cnt, sent, done, res, rc = 0;
+    unsigned head, tail;
+    struct uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct statx *stx;
+
+    if (ringopen(&ring, SWEEP_DEPTH) != 0)
+        return -1;
+
+    if (!(stx = (struct statx *) malloc(SWEEP_DEPTH * sizeof(*stx)))) {
+        ringclose(&ring);
+        return -1;
+    }
+
+    for (idx = 0; idx < count && rc == 0; idx += cnt) {
+        cnt = count - idx < SWEEP_DEPTH ? count - idx : SWEEP_DEPTH;
+
+        tail = *ring.sqtail;
+        for (int pos = 0; pos < cnt; pos++, tail++) {
+            sqe = &ring.sqes[tail & *ring.sqmask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t) (uintptr_t) files[idx + pos].path;
+            sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+            sqe->off = (uint64_t) (uintptr_t) &stx[pos];
+            sqe->user_data = pos;
+            ring.sqarray[tail & *ring.sqmask] = tail & *ring.sqmask;
+        }
+        __atomic_store_n(ring.sqtail, tail, __ATOMIC_RELEASE);
+
+        // 返回值为实际提交的个数，可能少于cnt；未提交的请求留在队列中，随队列关闭丢弃
+        for (sent = 0; sent < cnt; sent += res) {
+            while ((res = (int) syscall(__NR_io_uring_enter, ring.fd, cnt - sent, 0, 0, NULL, 0)) < 0 && errno == EINTR);
+            if (res <= 0)
+                break;
+        }
+        if (sent < cnt)
+            rc = -1;
+
+        // 只等待已提交的请求，且须全部完成后才能释放stx或关闭队列，完成顺序不确定，按user_data对应到文件
+        for (done = 0; done < sent;) {
+            head = *ring.cqhead;
+            tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                if (syscall(__NR_io_uring_enter, ring.fd, 0, sent - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                    errno != EINTR)
+                    break;
+                continue;
+            }
+            for (; head != tail; head++, done++) {
+                cqe = &ring.cqes[head & *ring.cqmask];
+                if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                    rc = -1;
+                else if (cqe->res < 0)
+                    markfile(&files[idx + cqe->user_data], 0, 0, 0);
+                else
+                    markfile(&files[idx + cqe->user_data], S_ISREG(stx[cqe->user_data].stx_mode),
+                             stx[cqe->user_data].stx_size, stx[cqe->user_data].stx_mtime.tv_sec);
+            }
+            __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+        }
+
+        // 无法等到全部完成时内核仍可能写入stx，不释放stx
+        if (done < sent) {
+            ringclose(&ring);
+            return -1;
+        }
+    }
+
+    free(stx);
+    ringclose(&ring);
+
+    return rc;
+}
+
+#else
+
+static int uringstat(struct sweepfile files[], int count)
+{
+    return -1;
+}
+
+#endif
+
+/**
+ * 检查文件是否被删除或修改，结果保存在各文件的state中
+ * 优先使用io_uring批量提交statx，不可用时用jobs个线程并行stat；
+ * @param files 待检查的文件
+ * @param count 文件个数
+ * @param jobs  不能使用io_uring时的线程数
+ * @return      检查成功返回0，否则返回非0
+ */
+int sweepstat(struct sweepfile files[], int count, int jobs)
+{
+    if (count <= 0)
+        return 0;
+
+    return uringstat(files, count) == 0 ? 0 : poolstat(files, count, jobs > 0 ? jobs : 1);
+}
+
+/**
+ * 计算内容的64位哈希，每次处理8字节，非加密用途
+ * @param data 内容
+ * @param size 字节数
+ * @return     非0的哈希值
+ */
+static uint64_t hashmem(const unsigned char *data, size_t size)
+{
+    size_t idx;
+    uint64_t word, hash = HASH_PRIME1 ^ size * HASH_PRIME2;
+
+    for (idx = 0; idx + sizeof(word) <= size; idx += sizeof(word)) {
+        memcpy(&word, data + idx, sizeof(word));
+        hash ^= word * HASH_PRIME2;
+        hash = (hash << 31 | hash >> 33) * HASH_PRIME1;
+    }
+
+    // 不足8字节的尾部，长度已计入初值
+    for (word = 0; idx < size; idx++)
+        word = word << 8 | data[idx];
+    hash ^= word * HASH_PRIME2;
+    hash = (hash << 31 | hash >> 33) * HASH_PRIME1;
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+
+    // 0表示未知，不与任何文件相同
+    return hash ? hash : 1;
+}
+
+/**
+ * 计算文件内容的哈希，用于判断修改时间变化的文件内容是否相同
+ * @param path 文件路径
+ * @return     哈希值，失败返回0
+ */
+int64_t sweephash(const char *path)
+{
+    uint64_t hash = 0;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    int fd;
+    void *data;
+    struct stat info;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        if (info.st_size == 0)
+            hash = hashmem(NULL, 0);
+        else if ((data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+            hash = hashmem((const unsigned char *) data, info.st_size);
+            munmap(data, info.st_size);
+        }
+    }
+
+    close(fd);
+#else
+    FILE *fp;
+    long size;
+    unsigned char *data;
+
+    if (!(fp = fopen(path, "rb")))
+        return 0;
+
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+        (data = (unsigned char *) malloc(size + 1))) {
+        if (fread(data, 1, size, fp) == (size_t) size)
+            hash = hashmem(data, size);
+        free(data);
+    }
+
+    fclose(fp);
+#endif
+
+    return (int64_t) hash;
+}
\ No newline at end of file
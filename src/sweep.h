@@ -0,0 +1,26 @@
+#ifndef CSTAG_SWEEP_H
+#define CSTAG_SWEEP_H
+
+#include <stdint.h>
+
+#define SWEEP_SAME              0
+#define SWEEP_CHANGED           1
+#define SWEEP_GONE              2
+
+/**
+ * 待检查的文件，size和time为数据库中记录的值，检查后更新为当前值
+ */
+struct sweepfile {
+    int64_t fid;
+    char *path;
+    int len;
+    int64_t size;
+    int64_t time;
+    int state;
+};
+
+int sweepstat(struct sweepfile files[], int count, int jobs);
+
+int64_t sweephash(const char *path);
+
+#endif //CSTAG_SWEEP_H
\ No newline at end of file
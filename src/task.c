@@ -98,10 +98,94 @@ int taskwait(int pid)
     return bFlag;
 }
 
+/**
+ * 等待任一子程序输出可读
+ * windows匿名管道不支持等待，直接返回第一个有效的句柄
+ * @param fps   子程序输出句柄数组，NULL元素会被忽略
+ * @param count 数组元素个数
+ * @return      可读句柄的下标，失败返回-1
+ */
+int taskpoll(FILE *const fps[], int count)
+{
+    for (int idx = 0; idx < count; idx++) {
+        if (fps[idx])
+            return idx;
+    }
+    return -1;
+}
+
+/**
+ * 等待任一描述符可读
+ * windows不支持，直接返回失败
+ * @param fds   描述符数组，负数元素会被忽略
+ * @param ready 返回各描述符是否可读
+ * @param count 数组元素个数
+ * @return      可读描述符的个数，失败返回-1
+ */
+int taskselect(const int fds[], char ready[], int count)
+{
+    return -1;
+}
+
+/**
+ * 创建用于唤醒taskselect的管道
+ * windows不支持，直接返回失败
+ * @param fds 返回管道的读端和写端
+ * @return    创建成功返回0，否则返回非0
+ */
+int taskpipe(int fds[2])
+{
+    return -1;
+}
+
+/**
+ * 在本地套接字上监听
+ * windows不支持，直接返回失败
+ * @param path 套接字文件路径
+ * @return     监听的套接字，失败返回-1
+ */
+int tasklisten(const char *path)
+{
+    return -1;
+}
+
+/**
+ * 接受一个本地套接字连接
+ * windows不支持，直接返回失败
+ * @param sock 监听的套接字
+ * @param in   连接输入
+ * @param out  连接输出
+ * @return     接受成功返回0，否则返回非0
+ */
+int taskaccept(int sock, FILE **in, FILE **out)
+{
+    return -1;
+}
+
+/**
+ * 连接本地套接字
+ * windows不支持，直接返回失败
+ * @param path 套接字文件路径
+ * @param in   连接输入
+ * @param out  连接输出
+ * @return     连接成功返回0，否则返回非0
+ */
+int taskconnect(const char *path, FILE **in, FILE **out)
+{
+    return -1;
+}
+
 #else
 
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
 
 /**
  * 执行子程序
@@ -124,6 +208,9 @@ int taskexec(const char *file, char *const argv[], const char *cwd, FILE **in, F
         close(ipipe[1]);
         return -1;
     }
+    // 父进程持有的管道端不能被后续创建的子进程继承，否则关闭输入后子进程收不到EOF
+    fcntl(ipipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(opipe[1], F_SETFD, FD_CLOEXEC);
     pid = fork();
     if (pid == 0) {
         close(ipipe[0]);
@@ -135,6 +222,8 @@ int taskexec(const char *file, char *const argv[], const char *cwd, FILE **in, F
             chdir(cwd);
             execvp(file ? file : argv[0], argv);
         }
+        // 子进程不能返回调用者，否则会继续执行父进程的流程
+        _exit(127);
     } else {
         close(ipipe[1]);
         close(opipe[0]);
@@ -162,4 +251,206 @@ int taskwait(int pid)
     return waitpid(pid, NULL, 0);
 }
 
+/**
+ * 等待任一子程序输出可读
+ * @param fps   子程序输出句柄数组，NULL元素会被忽略
+ * @param count 数组元素个数
+ * @return      可读句柄的下标，失败返回-1
+ */
+int taskpoll(FILE *const fps[], int count)
+{
+    int idx, rc;
+    struct pollfd pfds[count];
+
+    for (idx = 0; idx < count; idx++) {
+        pfds[idx].fd = fps[idx] ? fileno(fps[idx]) : -1;
+        pfds[idx].events = POLLIN;
+        pfds[idx].revents = 0;
+    }
+
+    while ((rc = poll(pfds, count, -1)) < 0 && errno == EINTR);
+
+    for (idx = 0; rc > 0 && idx < count; idx++) {
+        if (pfds[idx].revents)
+            return idx;
+    }
+
+    return -1;
+}
+
+/**
+ * 等待任一描述符可读
+ * @param fds   描述符数组，负数元素会被忽略
+ * @param ready 返回各描述符是否可读
+ * @param count 数组元素个数
+ * @return      可读描述符的个数，失败返回-1
+ */
+int taskselect(const int fds[], char ready[], int count)
+{
+    int idx, rc;
+    struct pollfd pfds[count];
+
+    for (idx = 0; idx < count; idx++) {
+        pfds[idx].fd = fds[idx];
+        pfds[idx].events = POLLIN;
+        pfds[idx].revents = 0;
+    }
+
+    while ((rc = poll(pfds, count, -1)) < 0 && errno == EINTR);
+
+    // 连接关闭或出错时也视为可读，由读取返回的结果处理
+    for (idx = 0; idx < count; idx++)
+        ready[idx] = rc > 0 && pfds[idx].revents != 0;
+
+    return rc;
+}
+
+/**
+ * 创建用于唤醒taskselect的管道
+ * @param fds 返回管道的读端和写端
+ * @return    创建成功返回0，否则返回非0
+ */
+int taskpipe(int fds[2])
+{
+    if (pipe(fds) != 0)
+        return -1;
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    return 0;
+}
+
+/**
+ * 设置本地套接字地址
+ * @param path 套接字文件路径
+ * @param addr 套接字地址
+ * @return     设置成功返回0，路径过长返回-1
+ */
+static int sockaddr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (!path || strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/**
+ * 将连接的套接字分别打开为输入、输出句柄
+ * @param fd  连接的套接字
+ * @param in  连接输入
+ * @param out 连接输出
+ * @return    打开成功返回0，否则返回非0
+ */
+static int sockfile(int fd, FILE **in, FILE **out)
+{
+    int dupfd;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if ((dupfd = dup(fd)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(dupfd, F_SETFD, FD_CLOEXEC);
+
+    if (!(*in = fdopen(fd, "r"))) {
+        close(fd);
+        close(dupfd);
+        return -1;
+    }
+    if (!(*out = fdopen(dupfd, "w"))) {
+        fclose(*in);
+        close(dupfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 在本地套接字上监听
+ * 套接字文件已存在但无人监听时视为上次残留，删除后重新绑定
+ * @param path 套接字文件路径
+ * @return     监听的套接字，失败返回-1
+ */
+int tasklisten(const char *path)
+{
+    int fd, tmp;
+    struct sockaddr_un addr;
+
+    if (sockaddr(path, &addr) != 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        if (errno != EADDRINUSE || (tmp = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (connect(tmp, (struct sockaddr *) &addr, sizeof(addr)) == 0 || errno != ECONNREFUSED ||
+            unlink(path) != 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(tmp);
+            close(fd);
+            return -1;
+        }
+        close(tmp);
+    }
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // 客户端提前断开时写入失败即可，不能终止服务进程
+    signal(SIGPIPE, SIG_IGN);
+
+    return fd;
+}
+
+/**
+ * 接受一个本地套接字连接，可在多个线程中同时调用
+ * @param sock 监听的套接字
+ * @param in   连接输入
+ * @param out  连接输出
+ * @return     接受成功返回0，否则返回非0
+ */
+int taskaccept(int sock, FILE **in, FILE **out)
+{
+    int fd;
+
+    while ((fd = accept(sock, NULL, NULL)) < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+    return fd < 0 ? -1 : sockfile(fd, in, out);
+}
+
+/**
+ * 连接本地套接字
+ * @param path 套接字文件路径
+ * @param in   连接输入
+ * @param out  连接输出
+ * @return     连接成功返回0，否则返回非0
+ */
+int taskconnect(const char *path, FILE **in, FILE **out)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    if (sockaddr(path, &addr) != 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return sockfile(fd, in, out);
+}
+
 #endif
\ No newline at end of file
@@ -5,4 +5,16 @@ int taskexec(const char *file, char *const argv[], const char *cwd, FILE **in, F
 
 int taskwait(int pid);
 
+int taskpoll(FILE *const fps[], int count);
+
+int taskselect(const int fds[], char ready[], int count);
+
+int taskpipe(int fds[2]);
+
+int tasklisten(const char *path);
+
+int taskaccept(int sock, FILE **in, FILE **out);
+
+int taskconnect(const char *path, FILE **in, FILE **out);
+
 #endif //CSTAG_TASK_H
\ No newline at end of file
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include "walk.h"
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+
+/**
+ * 创建并行遍历句柄
+ * windows没有openat，直接返回失败，由调用者逐个目录遍历
+ * @param jobs      遍历线程数
+ * @param recursive 是否遍历子目录
+ * @return          NULL
+ */
+walk_t walkopen(int jobs, int recursive)
+{
+    return NULL;
+}
+
+/**
+ * 添加遍历的根路径
+ * windows不支持，直接返回失败
+ * @param walk 遍历句柄
+ * @param path 文件或目录路径
+ * @return     -1
+ */
+int walkpush(walk_t walk, const char *path)
+{
+    return -1;
+}
+
+/**
+ * 获取下一个找到的文件
+ * windows不支持，直接返回0
+ * @param walk 遍历句柄
+ * @param wait 是否等待
+ * @param buf  文件路径缓冲区
+ * @param size 文件字节数
+ * @param time 文件修改时间
+ * @return     0
+ */
+int walknext(walk_t walk, int wait, char buf[], int64_t *size, int64_t *time)
+{
+    return 0;
+}
+
+/**
+ * 关闭遍历句柄
+ * @param walk 遍历句柄
+ */
+void walkclose(walk_t walk)
+{
+}
+
+#else
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "path.h"
+
+// 结果队列的大小，队列满时遍历线程等待调用者取走
+#define WALK_QUEUE              4096
+
+/**
+ * 已打开的目录，子目录通过它openat，所有子目录都打开后才关闭
+ */
+struct walkref {
+    DIR *dir;
+    int refs;
+};
+
+/**
+ * 待遍历的目录，根路径的parent为NULL，此时也可能是文件
+ */
+struct walkdir {
+    struct walkref *parent;
+    char *path;
+    int name;
+};
+
+/**
+ * 遍历线程的任务队列，线程从尾部取自己的任务（深度优先），
+ * 空闲时从其它线程队列的头部窃取（通常是更大的子树）
+ */
+struct walkdeque {
+    walk_t walk;
+    int idx;
+    int head;
+    int tail;
+    int size;
+    struct walkdir *items;
+};
+
+struct walkfile {
+    char *path;
+    int len;
+    int64_t size;
+    int64_t time;
+};
+
+struct tagWalk {
+    int jobs;
+    int recursive;
+    int stop;
+    int next;
+    int queued;
+    int pending;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_t *threads;
+    struct walkdeque *deques;
+    struct walkfile files[WALK_QUEUE];
+};
+
+/**
+ * 将目录任务放入线程idx的队列，调用时必须持有锁
+ * @param walk 遍历句柄
+ * @param idx  线程下标
+ * @param task 目录任务
+ * @return     成功返回0，否则返回非0
+ */
+static int pushdir(walk_t walk, int idx, const struct walkdir *task)
+{
+    int size;
+    struct walkdir *items;
+    struct walkdeque *deque = &walk->deques[idx];
+
+    if (deque->tail == deque->size && deque->head > 0) {
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(*items));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+
+    if (deque->tail == deque->size) {
+        size = deque->size ? deque->size * 2 : 64;
+        if (!(items = (struct walkdir *) realloc(deque->items, size * sizeof(*items))))
+            return -1;
+        deque->items = items;
+        deque->size = size;
+    }
+
+    if (task->parent)
+        task->parent->refs++;
+
+    deque->items[deque->tail++] = *task;
+    walk->queued++;
+    walk->pending++;
+
+    pthread_cond_signal(&walk->work);
+
+    return 0;
+}
+
+/**
+ * 取出线程idx的下一个目录任务，自己的队列为空时从其它线程窃取，调用时必须持有锁
+ * @param walk 遍历句柄
+ * @param idx  线程下标
+ * @param task 取出的目录任务
+ * @return     取到返回1，否则返回0
+ */
+static int popdir(walk_t walk, int idx, struct walkdir *task)
+{
+    struct walkdeque *deque = &walk->deques[idx];
+
+    if (deque->tail > deque->head) {
+        *task = deque->items[--deque->tail];
+        walk->queued--;
+        return 1;
+    }
+
+    for (int cnt = 1; cnt < walk->jobs; cnt++) {
+        deque = &walk->deques[(idx + cnt) % walk->jobs];
+        if (deque->tail > deque->head) {
+            *task = deque->items[deque->head++];
+            walk->queued--;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * 释放目录的一个引用，最后一个引用释放时关闭目录
+ * @param walk 遍历句柄
+ * @param ref  目录
+ */
+static void release(walk_t walk, struct walkref *ref)
+{
+    int refs;
+
+    if (!ref)
+        return;
+
+    pthread_mutex_lock(&walk->lock);
+    refs = --ref->refs;
+    pthread_mutex_unlock(&walk->lock);
+
+    if (refs == 0) {
+        closedir(ref->dir);
+        free(ref);
+    }
+}
+
+/**
+ * 将找到的文件放入结果队列，队列满时等待
+ * @param walk 遍历句柄
+ * @param path 文件路径，由结果队列接管
+ * @param len  路径长度
+ * @param info 文件属性
+ */
+static void putfile(walk_t walk, char *path, int len, const struct stat *info)
+{
+    struct walkfile *file;
+
+    pthread_mutex_lock(&walk->lock);
+
+    while (walk->count == WALK_QUEUE && !walk->stop)
+        pthread_cond_wait(&walk->space, &walk->lock);
+
+    if (walk->stop)
+        free(path);
+    else {
+        file = &walk->files[(walk->head + walk->count++) % WALK_QUEUE];
+        file->path = path;
+        file->len = len;
+        file->size = info->st_size;
+        file->time = info->st_mtime;
+        pthread_cond_signal(&walk->ready);
+    }
+
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/**
+ * 遍历一个目录：文件放入结果队列，子目录作为新任务放入当前线程的队列
+ * 所有文件系统操作都相对于父目录句柄进行，与路径深度无关；
+ * 能从d_type得知是目录时不再stat，文件需要fstatat获取大小和修改时间；
+ * @param walk 遍历句柄
+ * @param idx  线程下标
+ * @param task 目录任务
+ */
+static void walkdir(walk_t walk, int idx, struct walkdir *task)
+{
+    int fd, len, size, type;
+    DIR *dir;
+    char *path;
+    struct dirent *entry;
+    struct stat info = {0};
+    struct walkref *ref = NULL;
+
+    if (task->parent)
+        fd = openat(dirfd(task->parent->dir), task->path + task->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else if (fstatat(AT_FDCWD, task->path, &info, 0) != 0 || !S_ISDIR(info.st_mode)) {
+        // 根路径也可能是文件
+        if (S_ISREG(info.st_mode)) {
+            putfile(walk, task->path, strlen(task->path), &info);
+            task->path = NULL;
+        }
+        fd = -1;
+    } else
+        fd = openat(AT_FDCWD, task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    release(walk, task->parent);
+
+    if (fd >= 0) {
+        if (!(dir = fdopendir(fd)))
+            close(fd);
+        else if (!(ref = (struct walkref *) malloc(sizeof(*ref))))
+            closedir(dir);
+    }
+
+    if (ref) {
+        ref->dir = dir;
+        ref->refs = 1;
+        len = strlen(task->path);
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+#ifdef DT_UNKNOWN
+            type = entry->d_type;
+#else
+            type = 0;
+#endif
+            if (type == DT_DIR && !walk->recursive)
+                continue;
+            if (type != DT_DIR) {
+                if (fstatat(dirfd(dir), entry->d_name, &info, 0) != 0)
+                    continue;
+                type = S_ISREG(info.st_mode) ? DT_REG : S_ISDIR(info.st_mode) && walk->recursive ? DT_DIR : 0;
+            }
+            size = len + 1 + strlen(entry->d_name);
+            if ((type != DT_REG && type != DT_DIR) || size >= PATH_MAX || !(path = (char *) malloc(size + 1)))
+                continue;
+            sprintf(path, "%s" PATHSEP "%s", task->path, entry->d_name);
+            if (type == DT_REG)
+                putfile(walk, path, size, &info);
+            else {
+                struct walkdir sub = {ref, path, len + 1};
+                pthread_mutex_lock(&walk->lock);
+                if (pushdir(walk, idx, &sub) != 0)
+                    free(path);
+                pthread_mutex_unlock(&walk->lock);
+            }
+        }
+        release(walk, ref);
+    }
+
+    free(task->path);
+
+    pthread_mutex_lock(&walk->lock);
+    if (--walk->pending == 0)
+        pthread_cond_broadcast(&walk->ready);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/**
+ * 遍历线程
+ * @param arg 线程的任务队列
+ * @return    NULL
+ */
+static void *walkthread(void *arg)
+{
+    struct walkdir task;
+    struct walkdeque *deque = (struct walkdeque *) arg;
+    walk_t walk = deque->walk;
+
+    pthread_mutex_lock(&walk->lock);
+
+    while (!walk->stop) {
+        if (popdir(walk, deque->idx, &task)) {
+            pthread_mutex_unlock(&walk->lock);
+            walkdir(walk, deque->idx, &task);
+            pthread_mutex_lock(&walk->lock);
+        } else
+            pthread_cond_wait(&walk->work, &walk->lock);
+    }
+
+    pthread_mutex_unlock(&walk->lock);
+
+    return NULL;
+}
+
+/**
+ * 创建并行遍历句柄，启动jobs个遍历线程
+ * @param jobs      遍历线程数
+ * @param recursive 是否遍历子目录
+ * @return          创建成功返回遍历句柄，否则返回NULL
+ */
+walk_t walkopen(int jobs, int recursive)
+{
+    walk_t walk;
+
+    if (jobs <= 0 || !(walk = (walk_t) calloc(1, sizeof(*walk))))
+        return NULL;
+
+    walk->recursive = recursive;
+
+    if (!(walk->threads = (pthread_t *) calloc(jobs, sizeof(*walk->threads))) ||
+        !(walk->deques = (struct walkdeque *) calloc(jobs, sizeof(*walk->deques)))) {
+        free(walk->threads);
+        free(walk);
+        return NULL;
+    }
+
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->work, NULL);
+    pthread_cond_init(&walk->ready, NULL);
+    pthread_cond_init(&walk->space, NULL);
+
+    for (; walk->jobs < jobs; walk->jobs++) {
+        walk->deques[walk->jobs].walk = walk;
+        walk->deques[walk->jobs].idx = walk->jobs;
+        if (pthread_create(&walk->threads[walk->jobs], NULL, walkthread, &walk->deques[walk->jobs]) != 0)
+            break;
+    }
+
+    if (walk->jobs == 0) {
+        walkclose(walk);
+        return NULL;
+    }
+
+    return walk;
+}
+
+/**
+ * 添加遍历的根路径，可在遍历过程中继续添加
+ * @param walk 遍历句柄
+ * @param path 文件或目录路径
+ * @return     添加成功返回0，否则返回非0
+ */
+int walkpush(walk_t walk, const char *path)
+{
+    int rc = -1;
+    struct walkdir task = {NULL, NULL, 0};
+
+    if (!walk || !path || strlen(path) >= PATH_MAX || !(task.path = strdup(path)))
+        return -1;
+
+    pthread_mutex_lock(&walk->lock);
+    if ((rc = pushdir(walk, walk->next, &task)) == 0)
+        walk->next = (walk->next + 1) % walk->jobs;
+    pthread_mutex_unlock(&walk->lock);
+
+    if (rc != 0)
+        free(task.path);
+
+    return rc;
+}
+
+/**
+ * 获取下一个找到的文件，文件的顺序不确定
+ * @param walk 遍历句柄
+ * @param wait 非0时等待，直到找到文件或所有根路径都已遍历完
+ * @param buf  文件路径缓冲区，大小至少为PATH_MAX + 1
+ * @param size 文件字节数
+ * @param time 文件修改时间
+ * @return     文件路径长度，没有更多文件时返回0
+ */
+int walknext(walk_t walk, int wait, char buf[], int64_t *size, int64_t *time)
+{
+    struct walkfile file;
+
+    if (!walk)
+        return 0;
+
+    pthread_mutex_lock(&walk->lock);
+
+    while (wait && walk->count == 0 && walk->pending > 0)
+        pthread_cond_wait(&walk->ready, &walk->lock);
+
+    if (walk->count == 0) {
+        pthread_mutex_unlock(&walk->lock);
+        return 0;
+    }
+
+    file = walk->files[walk->head];
+    walk->head = (walk->head + 1) % WALK_QUEUE;
+    walk->count--;
+    pthread_cond_signal(&walk->space);
+
+    pthread_mutex_unlock(&walk->lock);
+
+    memcpy(buf, file.path, file.len + 1);
+    free(file.path);
+
+    if (size)
+        *size = file.size;
+    if (time)
+        *time = file.time;
+
+    return file.len;
+}
+
+/**
+ * 停止所有遍历线程并关闭遍历句柄，未完成的遍历会被丢弃
+ * @param walk 遍历句柄
+ */
+void walkclose(walk_t walk)
+{
+    struct walkdir task;
+
+    if (!walk)
+        return;
+
+    pthread_mutex_lock(&walk->lock);
+    walk->stop = 1;
+    pthread_cond_broadcast(&walk->work);
+    pthread_cond_broadcast(&walk->space);
+    pthread_mutex_unlock(&walk->lock);
+
+    for (int idx = 0; idx < walk->jobs; idx++)
+        pthread_join(walk->threads[idx], NULL);
+
+    for (int idx = 0; idx < walk->jobs; idx++) {
+        while (popdir(walk, idx, &task)) {
+            release(walk, task.parent);
+            free(task.path);
+        }
+        free(walk->deques[idx].items);
+    }
+
+    for (; walk->count > 0; walk->count--, walk->head = (walk->head + 1) % WALK_QUEUE)
+        free(walk->files[walk->head].path);
+
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->work);
+    pthread_cond_destroy(&walk->ready);
+    pthread_cond_destroy(&walk->space);
+
+    free(walk->threads);
+    free(walk->deques);
+    free(walk);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef CSTAG_WALK_H
+#define CSTAG_WALK_H
+
+#include <stdint.h>
+
+typedef struct tagWalk *walk_t;
+
+walk_t walkopen(int jobs, int recursive);
+
+int walkpush(walk_t walk, const char *path);
+
+int walknext(walk_t walk, int wait, char buf[], int64_t *size, int64_t *time);
+
+void walkclose(walk_t walk);
+
+#endif //CSTAG_WALK_H
\ No newline at end of file
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include "watch.h"
+
+#if defined(__linux__)
+
+#include <poll.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "path.h"
+
+#define WATCH_MASK              (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                                 IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * 一个被监视的路径，按wd升序保存
+ */
+struct watchdir {
+    int wd;
+    char *path;
+};
+
+struct tagWatch {
+    int fd;
+    int count;
+    int size;
+    struct watchdir *dirs;
+};
+
+/**
+ * 二分查找wd所在的位置
+ * @param watch 监视句柄
+ * @param wd    inotify监视描述符
+ * @return      找到时返回下标，否则返回应插入位置的-(下标+1)
+ */
+static int finddir(watch_t watch, int wd)
+{
+    int lo = 0, hi = watch->count - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (watch->dirs[mid].wd == wd)
+            return mid;
+        if (watch->dirs[mid].wd < wd)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -(lo + 1);
+}
+
+/**
+ * 移除下标为idx的路径
+ * @param watch 监视句柄
+ * @param idx   下标
+ */
+static void deldir(watch_t watch, int idx)
+{
+    free(watch->dirs[idx].path);
+    memmove(watch->dirs + idx, watch->dirs + idx + 1, (watch->count - idx - 1) * sizeof(*watch->dirs));
+    watch->count--;
+}
+
+/**
+ * 取消监视path及其下的所有路径，用于目录被删除或移走时
+ * @param watch 监视句柄
+ * @param path  路径
+ */
+static void dropdirs(watch_t watch, const char *path)
+{
+    size_t len = strlen(path);
+
+    for (int idx = watch->count - 1; idx >= 0; idx--) {
+        if (strncmp(watch->dirs[idx].path, path, len) == 0 &&
+            (watch->dirs[idx].path[len] == '\0' || watch->dirs[idx].path[len] == PATHSEP[0])) {
+            inotify_rm_watch(watch->fd, watch->dirs[idx].wd);
+            deldir(watch, idx);
+        }
+    }
+}
+
+/**
+ * 创建监视句柄
+ * @return 创建成功返回监视句柄，否则返回NULL
+ */
+watch_t watchopen(void)
+{
+    watch_t watch;
+
+    if (!(watch = (watch_t) calloc(1, sizeof(*watch))))
+        return NULL;
+
+    if ((watch->fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+/**
+ * 监视文件或目录，recursive非0时同时监视其下的所有子目录
+ * 目录中的文件只通过目录的事件报告，不单独监视
+ * @param watch     监视句柄
+ * @param path      文件或目录路径
+ * @param recursive 是否监视子目录
+ * @return          新增监视返回1，已在监视返回0，失败返回-1
+ */
+int watchadd(watch_t watch, const char *path, int recursive)
+{
+    int wd, idx, size;
+    DIR *dir;
+    char *copy;
+    struct stat info;
+    struct dirent *entry;
+    struct watchdir *dirs;
+    char buf[PATH_MAX + 1];
+
+    if (!watch || !path || (wd = inotify_add_watch(watch->fd, path, WATCH_MASK)) < 0)
+        return -1;
+
+    // 同一个inode只有一个wd，已监视时只更新路径，这也避免了符号链接成环时无限递归
+    if ((idx = finddir(watch, wd)) >= 0) {
+        if (strcmp(watch->dirs[idx].path, path) != 0 && (copy = strdup(path))) {
+            free(watch->dirs[idx].path);
+            watch->dirs[idx].path = copy;
+        }
+        return 0;
+    }
+
+    if (watch->count == watch->size) {
+        size = watch->size ? watch->size * 2 : 64;
+        if (!(dirs = (struct watchdir *) realloc(watch->dirs, size * sizeof(*dirs)))) {
+            inotify_rm_watch(watch->fd, wd);
+            return -1;
+        }
+        watch->dirs = dirs;
+        watch->size = size;
+    }
+
+    if (!(copy = strdup(path))) {
+        inotify_rm_watch(watch->fd, wd);
+        return -1;
+    }
+
+    idx = -idx - 1;
+    memmove(watch->dirs + idx + 1, watch->dirs + idx, (watch->count - idx) * sizeof(*watch->dirs));
+    watch->dirs[idx].wd = wd;
+    watch->dirs[idx].path = copy;
+    watch->count++;
+
+    if (recursive && (dir = opendir(path))) {
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+                (size_t) snprintf(buf, sizeof(buf), "%s" PATHSEP "%s", path, entry->d_name) < sizeof(buf) &&
+                stat(buf, &info) == 0 && S_ISDIR(info.st_mode))
+                watchadd(watch, buf, recursive);
+        }
+        closedir(dir);
+    }
+
+    return 1;
+}
+
+/**
+ * 读取一批变更事件，每个变更的路径调用一次func
+ * 路径可能是新建、修改、删除或移入移出的文件或目录，调用者需要自行检查其当前状态；
+ * 事件队列溢出时以NULL路径调用func，表示有变更丢失；
+ * @param watch 监视句柄
+ * @param msec  等待事件的毫秒数，-1表示一直等待
+ * @param func  变更路径的回调函数
+ * @param ctx   回调函数上下文
+ * @return      读到的事件数，超时返回0，失败返回-1
+ */
+int watchread(watch_t watch, int msec, void (*func)(const char *path, void *ctx), void *ctx)
+{
+    int idx, cnt = 0;
+    ssize_t len;
+    const char *p;
+    struct pollfd pfd;
+    const struct inotify_event *event;
+    char path[PATH_MAX + 1];
+    char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if (!watch || !func)
+        return -1;
+
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if ((idx = poll(&pfd, 1, msec)) <= 0)
+        return idx < 0 && errno != EINTR ? -1 : 0;
+
+    if ((len = read(watch->fd, buf, sizeof(buf))) <= 0)
+        return len < 0 && errno == EINTR ? 0 : -1;
+
+    for (p = buf; p < buf + len; p += sizeof(*event) + event->len, cnt++) {
+        event = (const struct inotify_event *) p;
+        if (event->mask & IN_Q_OVERFLOW) {
+            func(NULL, ctx);
+            continue;
+        }
+        if ((idx = finddir(watch, event->wd)) < 0)
+            continue;
+        // 监视已被内核移除，如被监视的路径已删除
+        if (event->mask & IN_IGNORED) {
+            deldir(watch, idx);
+            continue;
+        }
+        if (event->len == 0)
+            snprintf(path, sizeof(path), "%s", watch->dirs[idx].path);
+        else if ((size_t) snprintf(path, sizeof(path), "%s" PATHSEP "%s", watch->dirs[idx].path, event->name) >= sizeof(path))
+            continue;
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM)))
+            dropdirs(watch, path);
+        func(path, ctx);
+    }
+
+    return cnt;
+}
+
+/**
+ * 关闭监视句柄
+ * @param watch 监视句柄
+ */
+void watchclose(watch_t watch)
+{
+    if (!watch)
+        return;
+
+    for (int idx = 0; idx < watch->count; idx++)
+        free(watch->dirs[idx].path);
+
+    free(watch->dirs);
+    close(watch->fd);
+    free(watch);
+}
+
+#else
+
+/**
+ * 创建监视句柄
+ * 仅支持linux inotify，其它平台直接返回失败
+ * @return NULL
+ */
+watch_t watchopen(void)
+{
+    return NULL;
+}
+
+/**
+ * 监视文件或目录
+ * 仅支持linux inotify，其它平台直接返回失败
+ * @param watch     监视句柄
+ * @param path      文件或目录路径
+ * @param recursive 是否监视子目录
+ * @return          -1
+ */
+int watchadd(watch_t watch, const char *path, int recursive)
+{
+    return -1;
+}
+
+/**
+ * 读取一批变更事件
+ * 仅支持linux inotify，其它平台直接返回失败
+ * @param watch 监视句柄
+ * @param msec  等待事件的毫秒数
+ * @param func  变更路径的回调函数
+ * @param ctx   回调函数上下文
+ * @return      -1
+ */
+int watchread(watch_t watch, int msec, void (*func)(const char *path, void *ctx), void *ctx)
+{
+    return -1;
+}
+
+/**
+ * 关闭监视句柄
+ * @param watch 监视句柄
+ */
+void watchclose(watch_t watch)
+{
+}
+
+#endif
\ No newline at end of file
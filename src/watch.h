@@ -0,0 +1,14 @@
+#ifndef CSTAG_WATCH_H
+#define CSTAG_WATCH_H
+
+typedef struct tagWatch *watch_t;
+
+watch_t watchopen(void);
+
+int watchadd(watch_t watch, const char *path, int recursive);
+
+int watchread(watch_t watch, int msec, void (*func)(const char *path, void *ctx), void *ctx);
+
+void watchclose(watch_t watch);
+
+#endif //CSTAG_WATCH_H
\ No newline at end of file